@@ -100,6 +100,45 @@ local function newset()
     }})
 end
 
+-----------------------------------------------------------------------------
+-- Name resolution for the coroutine dispatcher
+-----------------------------------------------------------------------------
+-- looks the host name up in the background, if the library has a resolver,
+-- and returns the list of addresses found, in the order they should be tried
+local function coresolve(dispatcher, host)
+    local resolver = dispatcher.resolver
+    -- numeric addresses need no lookup
+    if not resolver or string.find(host, "^[%d%.]+$") or
+        string.find(host, ":", 1, true) then
+        return { host }
+    end
+    local id, error = resolver:getaddrinfo(host)
+    if not id then return nil, error end
+    -- the dispatcher watches the resolver while there are lookups
+    dispatcher.receiving.set:insert(resolver)
+    local lookup = coroutine.yield(dispatcher.resolving, id)
+    if not lookup.result then return nil, lookup.err end
+    local addrs = {}
+    for i, found in base.ipairs(lookup.result) do addrs[i] = found.addr end
+    return addrs
+end
+
+-- hands finished lookups to the cortns waiting for them
+local function coresolved(dispatcher)
+    local resolving = dispatcher.resolving
+    for _, lookup in base.ipairs(dispatcher.resolver:results()) do
+        local cortn = resolving.cortn[lookup.id]
+        if cortn then
+            kick(resolving, lookup.id)
+            resolving.stamp[lookup.id] = nil
+            schedule(cortn, coroutine.resume(cortn, lookup))
+        end
+    end
+    if #resolving.set == 0 then
+        dispatcher.receiving.set:remove(dispatcher.resolver)
+    end
+end
+
 -----------------------------------------------------------------------------
 -- socket.tcp() wrapper for the coroutine dispatcher
 -----------------------------------------------------------------------------
@@ -166,9 +205,9 @@ local function cowrap(dispatcher, tcp, error)
             end
         end
     end
-    -- connect in non-blocking mode and yield on timeout
-    function wrap:connect(host, port)
-        local result, error = tcp:connect(host, port)
+    -- connect to one address in non-blocking mode and yield on timeout
+    local function tryconnect(addr, port)
+        local result, error = tcp:connect(addr, port)
         if error == "timeout" then
             -- return control to dispatcher. we will be writable when
             -- connection succeeds.
@@ -178,11 +217,32 @@ local function cowrap(dispatcher, tcp, error)
                 return nil, "timeout"
             end
             -- when we come back, check if connection was successful
-            result, error = tcp:connect(host, port)
+            result, error = tcp:connect(addr, port)
             if result or error == "already connected" then return 1
             else return nil, "non-blocking connect failed" end
         else return result, error end
     end
+    -- connect to each address the host name resolves to, until one
+    -- answers, like tcp:connect does
+    function wrap:connect(host, port)
+        -- don't let the name lookup block the other cortns
+        local addrs, error = coresolve(dispatcher, host)
+        if not addrs then return nil, error end
+        local result
+        for i, addr in base.ipairs(addrs) do
+            if i > 1 then
+                -- a failed attempt leaves the socket unusable, so the
+                -- next address gets a new one
+                wrap:close()
+                tcp, error = socket.tcp()
+                if not tcp then return nil, error end
+                tcp:settimeout(0)
+            end
+            result, error = tryconnect(addr, port)
+            if result or error == "timeout" then return result, error end
+        end
+        return nil, error
+    end
     -- accept in non-blocking mode and yield on timeout
     function wrap:accept()
         while 1 do
@@ -260,7 +320,8 @@ function cometat.__index:step()
     -- for all readable connections, resume their cortns and reschedule
     -- when they yield back to us
     for _, tcp in base.ipairs(readable) do
-        schedule(wakeup(self.receiving, tcp))
+        if tcp == self.resolver then coresolved(self)
+        else schedule(wakeup(self.receiving, tcp)) end
     end
     -- for all writable connections, do the same
     for _, tcp in base.ipairs(writable) do
@@ -298,6 +359,15 @@ function handlert.coroutine()
             cortn = {},
             stamp = stamp
         },
+        -- cortns waiting for name lookups, indexed by lookup id
+        resolving = {
+            name = "resolving",
+            set = newset(),
+            cortn = {},
+            stamp = {}
+        },
+        -- looks up names without blocking, where available
+        resolver = socket.resolver and socket.resolver()
     }
     function dispatcher.tcp()
         return cowrap(dispatcher, socket.tcp())
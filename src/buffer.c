@@ -2,21 +2,67 @@
 * Input/Output interface for Lua programs
 * LuaSocket toolkit
 \*=========================================================================*/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "lua.h"
 #include "lauxlib.h"
 #include "compat.h"
 
 #include "buffer.h"
 
+/* framed receive pattern, given as a table */
+typedef struct t_frame_ {
+    const char *delim;      /* delimiter, or NULL for length prefixed frames */
+    size_t dlen;            /* delimiter length */
+    size_t *fail;           /* delimiter partial match table */
+    size_t length;          /* size of length prefix in bytes: 1, 2 or 4 */
+    int little;             /* length prefix is little endian */
+    size_t max;             /* largest frame accepted */
+} t_frame;
+typedef t_frame *p_frame;
+
+/* growable storage for lines of a header block. the storage is a userdata
+ * kept at stack index idx, so nothing leaks if Lua raises an error */
+typedef struct t_line_ {
+    lua_State *L;
+    int idx;
+    char *data;
+    size_t len, size;
+} t_line;
+
 /*=========================================================================*\
 * Internal function prototypes
 \*=========================================================================*/
 static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b);
 static int recvline(p_buffer buf, luaL_Buffer *b);
 static int recvall(p_buffer buf, luaL_Buffer *b);
+static void getframe(lua_State *L, int idx, p_frame fr);
+static size_t matchdelim(p_frame fr, const char *data, size_t count,
+        size_t *matched, luaL_Buffer *b);
+static int recvdelim(p_buffer buf, p_frame fr, const char *part, size_t size,
+        luaL_Buffer *b);
+static int recvframe(p_buffer buf, p_frame fr, const char *part, size_t size,
+        luaL_Buffer *b, char *hdr, size_t *hdrlen);
+static void lineinit(lua_State *L, t_line *line);
+static void lineadd(t_line *line, const char *data, size_t count);
+static int recvhline(p_buffer buf, t_line *line);
+static void setheader(lua_State *L, int idx, t_line *line);
+static int getchunksize(t_line *line, size_t *size);
+#if LUA_VERSION_NUM > 501
+static int recvdirect(p_buffer buf, size_t count, luaL_Buffer *b,
+        size_t *got);
+#endif
 static int buffer_get(p_buffer buf, const char **data, size_t *count);
 static void buffer_skip(p_buffer buf, size_t count);
 static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent);
+static int pushsendresult(lua_State *L, p_buffer buf, int top, int err,
+        size_t last);
+static int sendrawv(p_buffer buf, t_iobuf *bufs, int n, size_t *sent);
+static int sendout(p_buffer buf, t_iobuf *bufs, int n, size_t *sent);
+static int flushout(p_buffer buf);
 
 /* min and max macros */
 #ifndef MIN
@@ -45,7 +91,38 @@ void buffer_init(p_buffer buf, p_io io, p_timeout tm) {
     buf->io = io;
     buf->tm = tm;
     buf->received = buf->sent = 0;
-    buf->birthday = timeout_gettime();
+    buf->birthday = timeout_monotime();
+    buf->size = BUF_SIZE;
+    buf->release = 0;
+    buf->data = NULL;
+    buf->outsize = buf->outlen = 0;
+    buf->out = NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases buffer storage. Any buffered data, including pending output,
+* is lost, so objects send pending output with buffer_flushpending first.
+\*-------------------------------------------------------------------------*/
+void buffer_destroy(p_buffer buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->first = buf->last = 0;
+    free(buf->out);
+    buf->out = NULL;
+    buf->outlen = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends pending output before the object is closed. The object timeout
+* applies, unless wait is false, in which case only what can be sent
+* without blocking goes out (as when the object is collected).
+* Returns an IO error code
+\*-------------------------------------------------------------------------*/
+int buffer_flushpending(p_buffer buf, int wait) {
+    if (buf->outlen == 0) return IO_DONE;
+    if (!wait) timeout_init(buf->tm, 0.0, -1);
+    timeout_markstart(buf->tm);
+    return flushout(buf);
 }
 
 /*-------------------------------------------------------------------------*\
@@ -54,7 +131,7 @@ void buffer_init(p_buffer buf, p_io io, p_timeout tm) {
 int buffer_meth_getstats(lua_State *L, p_buffer buf) {
     lua_pushnumber(L, (lua_Number) buf->received);
     lua_pushnumber(L, (lua_Number) buf->sent);
-    lua_pushnumber(L, timeout_gettime() - buf->birthday);
+    lua_pushnumber(L, timeout_monotime() - buf->birthday);
     return 3;
 }
 
@@ -64,11 +141,108 @@ int buffer_meth_getstats(lua_State *L, p_buffer buf) {
 int buffer_meth_setstats(lua_State *L, p_buffer buf) {
     buf->received = (long) luaL_optnumber(L, 2, (lua_Number) buf->received);
     buf->sent = (long) luaL_optnumber(L, 3, (lua_Number) buf->sent);
-    if (lua_isnumber(L, 4)) buf->birthday = timeout_gettime() - lua_tonumber(L, 4);
+    if (lua_isnumber(L, 4)) buf->birthday = timeout_monotime() - lua_tonumber(L, 4);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:getbuffersize() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_getbuffersize(lua_State *L, p_buffer buf) {
+    lua_pushnumber(L, (lua_Number) buf->size);
+    lua_pushboolean(L, buf->release);
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:setbuffersize() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf) {
+    double n = luaL_checknumber(L, 2);
+    size_t size = (size_t) n;
+    luaL_argcheck(L, n >= 1, 2, "invalid buffer size");
+    if (!lua_isnoneornil(L, 3)) buf->release = lua_toboolean(L, 3);
+    if (buffer_isempty(buf)) {
+        /* storage is allocated again on demand. pending output is in a
+         * buffer of its own, and is kept */
+        free(buf->data);
+        buf->data = NULL;
+        buf->first = buf->last = 0;
+    } else if (size != buf->size) {
+        /* keep buffered data, even if it does not fit the new size */
+        size_t count = buf->last - buf->first;
+        char *data;
+        memmove(buf->data, buf->data + buf->first, count);
+        buf->first = 0;
+        buf->last = count;
+        size = MAX(size, count);
+        data = (char *) realloc(buf->data, size);
+        if (!data) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(IO_NOMEM));
+            return 2;
+        }
+        buf->data = data;
+    }
+    buf->size = size;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:setoutputbuffer() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_setoutputbuffer(lua_State *L, p_buffer buf) {
+    double n = luaL_optnumber(L, 2, BUF_SIZE);
+    size_t size = (size_t) n;
+    luaL_argcheck(L, n >= 0, 2, "invalid buffer size");
+    timeout_markstart(buf->tm);
+    /* pending output that does not fit the new size is sent right away */
+    if (buf->outlen > size) {
+        int err = flushout(buf);
+        if (err != IO_DONE) {
+            lua_pushnil(L);
+            lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+            return 2;
+        }
+    }
+    if (size == 0) {
+        free(buf->out);
+        buf->out = NULL;
+    } else if (buf->out && size != buf->outsize) {
+        char *out = (char *) realloc(buf->out, size);
+        if (!out) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(IO_NOMEM));
+            return 2;
+        }
+        buf->out = out;
+    }
+    buf->outsize = size;
     lua_pushnumber(L, 1);
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* object:flush() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_flush(lua_State *L, p_buffer buf) {
+    int top = lua_gettop(L);
+    int err = IO_DONE;
+    timeout_markstart(buf->tm);
+    if (buf->outlen > 0) err = flushout(buf);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+    } else lua_pushnumber(L, 1);
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
+#endif
+    return lua_gettop(L) - top;
+}
+
 /*-------------------------------------------------------------------------*\
 * object:send() interface
 \*-------------------------------------------------------------------------*/
@@ -84,20 +258,143 @@ int buffer_meth_send(lua_State *L, p_buffer buf) {
     if (end < 0) end = (long) (size+end+1);
     if (start < 1) start = (long) 1;
     if (end > (long) size) end = (long) size;
-    if (start <= end) err = sendraw(buf, data+start-1, end-start+1, &sent);
+    if (start <= end) {
+        if (buf->outsize == 0 && buf->outlen == 0) {
+            err = sendraw(buf, data+start-1, end-start+1, &sent);
+        } else {
+            t_iobuf bufs[2];
+            bufs[1].data = data+start-1;
+            bufs[1].count = end-start+1;
+            err = sendout(buf, bufs, 1, &sent);
+        }
+    }
+    return pushsendresult(L, buf, top, err, sent+start-1);
+}
+
+/*-------------------------------------------------------------------------*\
+* object:sendv() interface
+* Works as object:send() on the concatenation of an array of strings, but
+* without building the concatenation.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_sendv(lua_State *L, p_buffer buf) {
+    int top = lua_gettop(L);
+    int err = IO_DONE;
+    size_t size = 0, sent = 0, skip;
+    long start, end;
+    int i, n = 0, first = 0, last = 0;
+    t_iobuf *bufs;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    start = (long) luaL_optnumber(L, 3, 1);
+    end = (long) luaL_optnumber(L, 4, -1);
+    lua_settop(L, 4);
+    for (;;) {
+        lua_rawgeti(L, 2, n+1);
+        if (lua_isnil(L, -1)) break;
+        /* only strings stay put while they sit in the table */
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2,
+            "array of strings expected");
+        lua_pop(L, 1);
+        n++;
+    }
+    lua_pop(L, 1);
+    /* the first entry is scratch space for sendout */
+    bufs = (t_iobuf *) lua_newuserdata(L, (n+1)*sizeof(t_iobuf));
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        bufs[i].data = lua_tolstring(L, -1, &bufs[i].count);
+        size += bufs[i].count;
+        lua_pop(L, 1);
+    }
+    timeout_markstart(buf->tm);
+    if (start < 0) start = (long) (size+start+1);
+    if (end < 0) end = (long) (size+end+1);
+    if (start < 1) start = (long) 1;
+    if (end > (long) size) end = (long) size;
+    if (start <= end) {
+        /* trim the blocks to the [start, end] range */
+        skip = (size_t) (start-1);
+        first = 1;
+        while (first <= n && skip >= bufs[first].count)
+            skip -= bufs[first++].count;
+        bufs[first].data += skip;
+        bufs[first].count -= skip;
+        skip = size - (size_t) end;
+        last = n;
+        while (last > first && skip >= bufs[last].count)
+            skip -= bufs[last--].count;
+        bufs[last].count -= skip;
+        if (buf->outsize == 0 && buf->outlen == 0)
+            err = sendrawv(buf, bufs+first, last-first+1, &sent);
+        else err = sendout(buf, bufs+first-1, last-first+1, &sent);
+    }
+    lua_settop(L, top);
+    return pushsendresult(L, buf, top, err, sent+start-1);
+}
+
+/*-------------------------------------------------------------------------*\
+* object:sendchunk() interface
+* Sends data as one chunk of the HTTP chunked transfer-coding, or the last
+* chunk if data is nil. The framing is sent along with the data, which is
+* never copied.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_sendchunk(lua_State *L, p_buffer buf) {
+    int top = lua_gettop(L);
+    int err = IO_DONE;
+    size_t size = 0, sent = 0;
+    const char *data = luaL_optlstring(L, 2, NULL, &size);
+    char head[32];
+    t_iobuf bufs[4];
+    int n = 3;
+    timeout_markstart(buf->tm);
+    if (!data) {
+        bufs[1].data = "0\r\n\r\n";
+        bufs[1].count = 5;
+        n = 1;
+    } else {
+        sprintf(head, "%lX\r\n", (unsigned long) size);
+        bufs[1].data = head;
+        bufs[1].count = strlen(head);
+        bufs[2].data = data;
+        bufs[2].count = size;
+        bufs[3].data = "\r\n";
+        bufs[3].count = 2;
+    }
+    /* an empty chunk would end the body, so there is nothing to send */
+    if (data && size == 0) n = 0;
+    if (n > 0 && buf->outsize == 0 && buf->outlen == 0)
+        err = sendrawv(buf, bufs+1, n, &sent);
+    else if (n > 0) err = sendout(buf, bufs, n, &sent);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+    } else lua_pushnumber(L, 1);
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes the results of a send: the index of the last byte sent, or nil,
+* the error message and the index of the last byte sent
+\*-------------------------------------------------------------------------*/
+static int pushsendresult(lua_State *L, p_buffer buf, int top, int err,
+        size_t last) {
+    size_t sent = last;
     /* check if there was an error */
     if (err != IO_DONE) {
         lua_pushnil(L);
         lua_pushstring(L, buf->io->error(buf->io->ctx, err));
-        lua_pushnumber(L, (lua_Number) (sent+start-1));
+        lua_pushnumber(L, (lua_Number) sent);
     } else {
-        lua_pushnumber(L, (lua_Number) (sent+start-1));
+        lua_pushnumber(L, (lua_Number) sent);
         lua_pushnil(L);
         lua_pushnil(L);
     }
 #ifdef LUASOCKET_DEBUG
     /* push time elapsed during operation as the last return value */
-    lua_pushnumber(L, timeout_gettime() - timeout_getstart(buf->tm));
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
 #endif
     return lua_gettop(L) - top;
 }
@@ -108,15 +405,33 @@ int buffer_meth_send(lua_State *L, p_buffer buf) {
 int buffer_meth_receive(lua_State *L, p_buffer buf) {
     int err = IO_DONE, top = lua_gettop(L);
     luaL_Buffer b;
-    size_t size;
+    size_t size, hdrlen = 0;
+    t_frame frame;
+    char hdr[4];
     const char *part = luaL_optlstring(L, 3, "", &size);
+    /* framed patterns may leave their match table on the stack */
+    if (lua_istable(L, 2)) {
+        getframe(L, 2, &frame);
+        top = lua_gettop(L);
+    }
     timeout_markstart(buf->tm);
-    /* initialize buffer with optional extra prefix
-     * (useful for concatenating previous partial results) */
     luaL_buffinit(L, &b);
-    luaL_addlstring(&b, part, size);
-    /* receive new patterns */
-    if (!lua_isnumber(L, 2)) {
+    /* the peer may be waiting for our pending output before replying */
+    if (buf->outlen > 0) err = flushout(buf);
+    /* framed patterns deal with the prefix themselves */
+    if (lua_istable(L, 2)) {
+        if (err != IO_DONE) luaL_addlstring(&b, part, size);
+        else if (frame.delim) err = recvdelim(buf, &frame, part, size, &b);
+        else err = recvframe(buf, &frame, part, size, &b, hdr, &hdrlen);
+    } else {
+        /* initialize buffer with optional extra prefix
+         * (useful for concatenating previous partial results) */
+        luaL_addlstring(&b, part, size);
+    }
+    /* receive new patterns, unless the flush failed */
+    if (err != IO_DONE || lua_istable(L, 2)) {
+        /* nothing else to receive */
+    } else if (!lua_isnumber(L, 2)) {
         const char *p= luaL_optstring(L, 2, "*l");
         if (p[0] == '*' && p[1] == 'l') err = recvline(buf, &b);
         else if (p[0] == '*' && p[1] == 'a') err = recvall(buf, &b);
@@ -135,6 +450,12 @@ int buffer_meth_receive(lua_State *L, p_buffer buf) {
         /* we can't push anyting in the stack before pushing the
          * contents of the buffer. this is the reason for the complication */
         luaL_pushresult(&b);
+        /* partial frames include the length prefix that was consumed */
+        if (hdrlen > 0) {
+            lua_pushlstring(L, hdr, hdrlen);
+            lua_insert(L, -2);
+            lua_concat(L, 2);
+        }
         lua_pushstring(L, buf->io->error(buf->io->ctx, err));
         lua_pushvalue(L, -2);
         lua_pushnil(L);
@@ -146,7 +467,94 @@ int buffer_meth_receive(lua_State *L, p_buffer buf) {
     }
 #ifdef LUASOCKET_DEBUG
     /* push time elapsed during operation as the last return value */
-    lua_pushnumber(L, timeout_gettime() - timeout_getstart(buf->tm));
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receiveheaders() interface
+* Reads a block of MIME headers, up to and including the blank line that
+* ends it. Names are lowercased, folded values are unfolded, and repeated
+* fields are joined with commas, as done by http.lua.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receiveheaders(lua_State *L, p_buffer buf) {
+    int err = IO_DONE, top, malformed = 0;
+    t_line cur, next, tmp;
+    lua_settop(L, 2);
+    if (lua_isnil(L, 2)) {
+        lua_newtable(L);
+        lua_replace(L, 2);
+    } else luaL_checktype(L, 2, LUA_TTABLE);
+    lineinit(L, &cur);
+    lineinit(L, &next);
+    top = lua_gettop(L);
+    timeout_markstart(buf->tm);
+    /* the peer may be waiting for our pending output before replying */
+    if (buf->outlen > 0) err = flushout(buf);
+    if (err == IO_DONE) err = recvhline(buf, &next);
+    /* headers go until a blank line is found */
+    while (err == IO_DONE && next.len > 0) {
+        tmp = cur; cur = next; next = tmp;
+        if (!memchr(cur.data, ':', cur.len)) {
+            malformed = 1;
+            break;
+        }
+        /* folded values continue on lines starting with white space */
+        while ((err = recvhline(buf, &next)) == IO_DONE && next.len > 0 &&
+                isspace((unsigned char) next.data[0]))
+            lineadd(&cur, next.data, next.len);
+        if (err == IO_DONE) setheader(L, 2, &cur);
+    }
+    if (malformed) {
+        lua_pushnil(L);
+        lua_pushstring(L, "malformed reponse headers");
+    } else if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+    } else lua_pushvalue(L, 2);
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receivechunk() interface
+* Reads one chunk of the HTTP chunked transfer-coding, including the line
+* with its size and the line break after the data. Chunk extensions are
+* ignored. The last chunk comes back as an empty string, and the trailer
+* that follows it is left for receiveheaders.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receivechunk(lua_State *L, p_buffer buf) {
+    int err = IO_DONE, top, invalid = 0;
+    t_line line;
+    size_t size = 0;
+    luaL_Buffer b;
+    lineinit(L, &line);
+    top = lua_gettop(L);
+    timeout_markstart(buf->tm);
+    luaL_buffinit(L, &b);
+    /* the peer may be waiting for our pending output before replying */
+    if (buf->outlen > 0) err = flushout(buf);
+    if (err == IO_DONE) err = recvhline(buf, &line);
+    if (err == IO_DONE && !getchunksize(&line, &size)) invalid = 1;
+    else if (err == IO_DONE && size > 0) {
+        err = recvraw(buf, size, &b);
+        /* skip the line break after the data */
+        if (err == IO_DONE) err = recvhline(buf, &line);
+    }
+    luaL_pushresult(&b);
+    if (invalid || err != IO_DONE) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_pushstring(L, invalid? "invalid chunk size":
+            buf->io->error(buf->io->ctx, err));
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_now() - timeout_getstart(buf->tm));
 #endif
     return lua_gettop(L) - top;
 }
@@ -158,13 +566,48 @@ int buffer_isempty(p_buffer buf) {
     return buf->first >= buf->last;
 }
 
+/*-------------------------------------------------------------------------*\
+* Reads at most count bytes into data, for code that moves data without
+* Lua strings. Buffered input is returned first. Otherwise, data is read
+* straight from the transport layer.
+\*-------------------------------------------------------------------------*/
+int buffer_read(p_buffer buf, char *data, size_t count, size_t *got) {
+    p_io io = buf->io;
+    int err;
+    if (!buffer_isempty(buf)) {
+        *got = MIN(count, buf->last - buf->first);
+        memcpy(data, buf->data + buf->first, *got);
+        buffer_skip(buf, *got);
+        return IO_DONE;
+    }
+    *got = 0;
+    err = io->recv(io->ctx, data, count, got, buf->tm);
+    buf->received += *got;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends pending output and then count bytes of data, for code that moves
+* data without Lua strings.
+\*-------------------------------------------------------------------------*/
+int buffer_write(p_buffer buf, const char *data, size_t count, size_t *sent) {
+    int err = IO_DONE;
+    *sent = 0;
+    if (buf->outlen > 0) err = flushout(buf);
+    if (err == IO_DONE && count > 0) err = sendraw(buf, data, count, sent);
+    return err;
+}
+
 /*=========================================================================*\
 * Internal functions
 \*=========================================================================*/
 /*-------------------------------------------------------------------------*\
 * Sends a block of data (unbuffered)
 \*-------------------------------------------------------------------------*/
+#ifdef _WIN32
+/* WinSock buffers everything it is given, so we send in small steps */
 #define STEPSIZE 8192
+#endif
 static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
     p_io io = buf->io;
     p_timeout tm = buf->tm;
@@ -172,7 +615,10 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
     int err = IO_DONE;
     while (total < count && err == IO_DONE) {
         size_t done = 0;
-        size_t step = (count-total <= STEPSIZE)? count-total: STEPSIZE;
+        size_t step = count-total;
+#ifdef STEPSIZE
+        if (step > STEPSIZE) step = STEPSIZE;
+#endif
         err = io->send(io->ctx, data+total, step, &done, tm);
         total += done;
     }
@@ -181,6 +627,123 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sends blocks of data through the output buffer. The blocks to send are
+* bufs[1] to bufs[n]; bufs[0] is scratch space. Small amounts of data are
+* only stored. Otherwise, pending output and the new data are sent together.
+\*-------------------------------------------------------------------------*/
+static int sendout(p_buffer buf, t_iobuf *bufs, int n, size_t *sent) {
+    size_t total = 0, pending = buf->outlen, done = 0;
+    int i, err;
+    for (i = 1; i <= n; i++) total += bufs[i].count;
+    if (buf->outsize > 0 && pending + total <= buf->outsize) {
+        if (!buf->out) {
+            buf->out = (char *) malloc(buf->outsize);
+            if (!buf->out) {
+                *sent = 0;
+                return IO_NOMEM;
+            }
+        }
+        for (i = 1; i <= n; i++) {
+            memcpy(buf->out + buf->outlen, bufs[i].data, bufs[i].count);
+            buf->outlen += bufs[i].count;
+        }
+        *sent = total;
+        return IO_DONE;
+    }
+    bufs[0].data = buf->out;
+    bufs[0].count = pending;
+    err = sendrawv(buf, bufs, n+1, &done);
+    if (done < pending) {
+        /* keep what is left of the pending output */
+        memmove(buf->out, buf->out + done, pending - done);
+        buf->outlen = pending - done;
+        *sent = 0;
+    } else {
+        buf->outlen = 0;
+        *sent = done - pending;
+        if (buf->release) {
+            free(buf->out);
+            buf->out = NULL;
+        }
+    }
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends all pending output
+\*-------------------------------------------------------------------------*/
+static int flushout(p_buffer buf) {
+    size_t done = 0;
+    int err = sendraw(buf, buf->out, buf->outlen, &done);
+    buf->outlen -= done;
+    if (buf->outlen > 0) memmove(buf->out, buf->out + done, buf->outlen);
+    else if (buf->release) {
+        free(buf->out);
+        buf->out = NULL;
+    }
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends several blocks of data in order (unbuffered). The blocks are
+* updated to reflect what is left to send.
+\*-------------------------------------------------------------------------*/
+static int sendrawv(p_buffer buf, t_iobuf *bufs, int n, size_t *sent) {
+    p_io io = buf->io;
+    size_t total = 0;
+    int err = IO_DONE;
+    /* without vectored output, just send one block at a time */
+    if (!io->sendv) {
+        for ( ; n > 0 && err == IO_DONE; bufs++, n--) {
+            size_t done = 0;
+            err = sendraw(buf, bufs->data, bufs->count, &done);
+            total += done;
+        }
+        *sent = total;
+        return err;
+    }
+    while (n > 0 && err == IO_DONE) {
+        size_t done = 0;
+        if (bufs->count == 0) {
+            bufs++; n--;
+            continue;
+        }
+        err = io->sendv(io->ctx, bufs, n, &done, buf->tm);
+        total += done;
+        /* skip whatever was sent */
+        while (n > 0 && done >= bufs->count) {
+            done -= bufs->count;
+            bufs++; n--;
+        }
+        if (n > 0) {
+            bufs->data += done;
+            bufs->count -= done;
+        }
+    }
+    *sent = total;
+    buf->sent += total;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads up to count bytes straight into the result, skipping the input
+* buffer. Only used when the input buffer is empty. Lua 5.1 cannot reserve
+* more than LUAL_BUFFERSIZE bytes in a luaL_Buffer, so there we always go
+* through the input buffer.
+\*-------------------------------------------------------------------------*/
+#if LUA_VERSION_NUM > 501
+static int recvdirect(p_buffer buf, size_t count, luaL_Buffer *b,
+        size_t *got) {
+    p_io io = buf->io;
+    char *data = luaL_prepbuffsize(b, count);
+    int err = io->recv(io->ctx, data, count, got, buf->tm);
+    luaL_addsize(b, *got);
+    buf->received += *got;
+    return err;
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Reads a fixed number of bytes (buffered)
 \*-------------------------------------------------------------------------*/
@@ -189,6 +752,19 @@ static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
     size_t total = 0;
     while (err == IO_DONE) {
         size_t count; const char *data;
+#if LUA_VERSION_NUM > 501
+        /* large reads go straight into the result. reservations are
+         * capped, and only grow with the data actually received, so that
+         * huge requests do not allocate all they ask for up front */
+        if (buffer_isempty(buf) && wanted - total >= buf->size) {
+            size_t got = 0;
+            count = MIN(wanted - total, MAX(total, BUF_DIRECTSIZE));
+            err = recvdirect(buf, count, b, &got);
+            total += got;
+            if (total >= wanted) break;
+            continue;
+        }
+#endif
         err = buffer_get(buf, &data, &count);
         count = MIN(count, wanted - total);
         luaL_addlstring(b, data, count);
@@ -199,6 +775,156 @@ static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Reads a framed pattern from its table description
+\*-------------------------------------------------------------------------*/
+static void getframe(lua_State *L, int idx, p_frame fr) {
+    memset(fr, 0, sizeof(t_frame));
+    fr->max = (size_t) -1;
+    lua_getfield(L, idx, "max");
+    if (!lua_isnil(L, -1)) {
+        double max = lua_tonumber(L, -1);
+        luaL_argcheck(L, lua_isnumber(L, -1) && max >= 0, idx,
+            "invalid frame limit");
+        fr->max = (size_t) max;
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "delimiter");
+    if (!lua_isnil(L, -1)) {
+        size_t i, k = 0;
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx,
+            "invalid frame delimiter");
+        fr->delim = lua_tolstring(L, -1, &fr->dlen);
+        luaL_argcheck(L, fr->dlen > 0, idx, "invalid frame delimiter");
+        /* the pattern table keeps the delimiter alive */
+        lua_pop(L, 1);
+        /* fail[i] is the length of the longest proper prefix of the
+         * delimiter that ends at delim[i] */
+        fr->fail = (size_t *) lua_newuserdata(L, fr->dlen*sizeof(size_t));
+        fr->fail[0] = 0;
+        for (i = 1; i < fr->dlen; i++) {
+            while (k > 0 && fr->delim[i] != fr->delim[k]) k = fr->fail[k-1];
+            if (fr->delim[i] == fr->delim[k]) k++;
+            fr->fail[i] = k;
+        }
+        return;
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "length");
+    fr->length = (size_t) lua_tonumber(L, -1);
+    luaL_argcheck(L, fr->length == 1 || fr->length == 2 || fr->length == 4,
+        idx, "invalid receive pattern");
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "endian");
+    if (!lua_isnil(L, -1)) {
+        const char *endian;
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx,
+            "invalid frame endianness");
+        endian = lua_tostring(L, -1);
+        if (strcmp(endian, "little") == 0) fr->little = 1;
+        else luaL_argcheck(L, strcmp(endian, "big") == 0, idx,
+            "invalid frame endianness");
+    }
+    lua_pop(L, 1);
+}
+
+/*-------------------------------------------------------------------------*\
+* Feeds data to the delimiter matcher. Bytes that may be the start of the
+* delimiter are held back in *matched, everything else goes to the result.
+* Returns the number of bytes used, which stops right after the delimiter.
+\*-------------------------------------------------------------------------*/
+static size_t matchdelim(p_frame fr, const char *data, size_t count,
+        size_t *matched, luaL_Buffer *b) {
+    const char *delim = fr->delim;
+    size_t pos = 0, m = *matched;
+    while (pos < count) {
+        if (m == 0) {
+            /* copy everything up to the next possible match at once */
+            const char *c = (const char *) memchr(data+pos, delim[0],
+                count-pos);
+            size_t run = c? (size_t) (c - data) - pos: count - pos;
+            luaL_addlstring(b, data+pos, run);
+            pos += run;
+            if (!c) break;
+        }
+        /* bytes held back that can no longer match are released */
+        while (m > 0 && data[pos] != delim[m]) {
+            size_t k = fr->fail[m-1];
+            luaL_addlstring(b, delim, m-k);
+            m = k;
+        }
+        if (data[pos] == delim[m]) m++;
+        else luaL_addchar(b, data[pos]);
+        pos++;
+        if (m == fr->dlen) break;
+    }
+    *matched = m;
+    return pos;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads everything up to a delimiter, which is consumed but not returned
+\*-------------------------------------------------------------------------*/
+static int recvdelim(p_buffer buf, p_frame fr, const char *part, size_t size,
+        luaL_Buffer *b) {
+    int err = IO_DONE;
+    size_t matched = 0, total = size;
+    /* the delimiter must end within dlen bytes past the limit */
+    size_t limit = fr->max > (size_t) -1 - fr->dlen? (size_t) -1:
+        fr->max + fr->dlen;
+    /* the prefix may end with part of the delimiter */
+    matchdelim(fr, part, size, &matched, b);
+    while (matched < fr->dlen && err == IO_DONE) {
+        size_t count, used; const char *data;
+        if (total >= limit) {
+            err = IO_LIMIT;
+            break;
+        }
+        err = buffer_get(buf, &data, &count);
+        count = MIN(count, limit - total);
+        used = matchdelim(fr, data, count, &matched, b);
+        buffer_skip(buf, used);
+        total += used;
+    }
+    /* partial results include whatever was held back */
+    if (matched < fr->dlen) luaL_addlstring(b, fr->delim, matched);
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads a length prefixed frame. The prefix is returned in hdr, and only
+* the payload goes to the result.
+\*-------------------------------------------------------------------------*/
+static int recvframe(p_buffer buf, p_frame fr, const char *part, size_t size,
+        luaL_Buffer *b, char *hdr, size_t *hdrlen) {
+    int err = IO_DONE;
+    size_t have = MIN(size, fr->length), len = 0, extra, i;
+    /* the prefix starts with all or part of the length */
+    memcpy(hdr, part, have);
+    while (have < fr->length && err == IO_DONE) {
+        size_t count; const char *data;
+        err = buffer_get(buf, &data, &count);
+        count = MIN(count, fr->length - have);
+        memcpy(hdr+have, data, count);
+        buffer_skip(buf, count);
+        have += count;
+    }
+    *hdrlen = have;
+    if (have < fr->length) return err;
+    for (i = 0; i < have; i++) {
+        unsigned char c = (unsigned char) hdr[fr->little? have-1-i: i];
+        len = (len << 8) | c;
+    }
+    if (len > fr->max) return IO_LIMIT;
+    /* followed by part of the payload */
+    extra = size > have? MIN(size - have, len): 0;
+    luaL_addlstring(b, part+have, extra);
+    if (extra < len) err = recvraw(buf, len - extra, b);
+    /* complete frames are returned without the length */
+    if (err == IO_DONE) *hdrlen = 0;
+    return err;
+}
+
 /*-------------------------------------------------------------------------*\
 * Reads everything until the connection is closed (buffered)
 \*-------------------------------------------------------------------------*/
@@ -207,6 +933,15 @@ static int recvall(p_buffer buf, luaL_Buffer *b) {
     size_t total = 0;
     while (err == IO_DONE) {
         const char *data; size_t count;
+#if LUA_VERSION_NUM > 501
+        if (buffer_isempty(buf)) {
+            size_t got = 0;
+            count = MAX(buf->size, MIN(total, BUF_DIRECTSIZE));
+            err = recvdirect(buf, count, b, &got);
+            total += got;
+            continue;
+        }
+#endif
         err = buffer_get(buf, &data, &count);
         total += count;
         luaL_addlstring(b, data, count);
@@ -225,23 +960,122 @@ static int recvall(p_buffer buf, luaL_Buffer *b) {
 static int recvline(p_buffer buf, luaL_Buffer *b) {
     int err = IO_DONE;
     while (err == IO_DONE) {
-        size_t count, pos; const char *data;
+        size_t count, pos, span; const char *data, *nl;
         err = buffer_get(buf, &data, &count);
+        nl = count > 0? (const char *) memchr(data, '\n', count): NULL;
+        span = nl? (size_t) (nl - data): count;
+        /* copy whole runs at a time, but we ignore all \r's */
         pos = 0;
-        while (pos < count && data[pos] != '\n') {
-            /* we ignore all \r's */
-            if (data[pos] != '\r') luaL_addchar(b, data[pos]);
-            pos++;
+        while (pos < span) {
+            const char *cr = (const char *) memchr(data+pos, '\r', span-pos);
+            size_t run = cr? (size_t) (cr - data) - pos: span - pos;
+            luaL_addlstring(b, data+pos, run);
+            pos += cr? run+1: run;
         }
-        if (pos < count) { /* found '\n' */
-            buffer_skip(buf, pos+1); /* skip '\n' too */
+        if (nl) { /* found '\n' */
+            buffer_skip(buf, span+1); /* skip '\n' too */
             break; /* we are done */
         } else /* reached the end of the buffer */
-            buffer_skip(buf, pos);
+            buffer_skip(buf, span);
     }
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Reserves a stack slot for the storage of a line
+\*-------------------------------------------------------------------------*/
+static void lineinit(lua_State *L, t_line *line) {
+    lua_pushnil(L);
+    line->L = L;
+    line->idx = lua_gettop(L);
+    line->data = NULL;
+    line->len = line->size = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends data to a line, growing its storage as needed. The old storage
+* is left to the garbage collector
+\*-------------------------------------------------------------------------*/
+static void lineadd(t_line *line, const char *data, size_t count) {
+    if (line->len + count > line->size) {
+        size_t size = MAX(MAX(line->len + count, 2*line->size), 128);
+        char *grown = (char *) lua_newuserdata(line->L, size);
+        if (line->len > 0) memcpy(grown, line->data, line->len);
+        lua_replace(line->L, line->idx);
+        line->data = grown;
+        line->size = size;
+    }
+    memcpy(line->data + line->len, data, count);
+    line->len += count;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads a header line into C storage, with the same rules as recvline
+\*-------------------------------------------------------------------------*/
+static int recvhline(p_buffer buf, t_line *line) {
+    int err = IO_DONE;
+    line->len = 0;
+    while (err == IO_DONE) {
+        size_t count, pos, span; const char *data, *nl;
+        err = buffer_get(buf, &data, &count);
+        nl = count > 0? (const char *) memchr(data, '\n', count): NULL;
+        span = nl? (size_t) (nl - data): count;
+        pos = 0;
+        while (pos < span && err == IO_DONE) {
+            const char *cr = (const char *) memchr(data+pos, '\r', span-pos);
+            size_t run = cr? (size_t) (cr - data) - pos: span - pos;
+            lineadd(line, data+pos, run);
+            pos += cr? run+1: run;
+        }
+        if (nl && err == IO_DONE) {
+            buffer_skip(buf, span+1);
+            break;
+        } else buffer_skip(buf, span);
+    }
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Stores a "name: value" line in the table at idx
+\*-------------------------------------------------------------------------*/
+static void setheader(lua_State *L, int idx, t_line *line) {
+    char *colon = (char *) memchr(line->data, ':', line->len);
+    char *value = colon + 1, *end = line->data + line->len, *c;
+    for (c = line->data; c < colon; c++) *c = (char) tolower((unsigned char) *c);
+    while (value < end && isspace((unsigned char) *value)) value++;
+    lua_pushlstring(L, line->data, (size_t) (colon - line->data));
+    lua_pushvalue(L, -1);
+    lua_gettable(L, idx);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, value, (size_t) (end - value));
+    } else {
+        lua_pushliteral(L, ", ");
+        lua_pushlstring(L, value, (size_t) (end - value));
+        lua_concat(L, 3);
+    }
+    lua_settable(L, idx);
+}
+
+/*-------------------------------------------------------------------------*\
+* Parses the hexadecimal size at the start of a chunk, before any chunk
+* extension. Returns 0 if the size is invalid.
+\*-------------------------------------------------------------------------*/
+static int getchunksize(t_line *line, size_t *size) {
+    const char *c = line->data, *end = line->data + line->len;
+    int digits = 0;
+    *size = 0;
+    while (c < end && isspace((unsigned char) *c)) c++;
+    for ( ; c < end && isxdigit((unsigned char) *c); c++, digits++) {
+        int d = isdigit((unsigned char) *c)? *c - '0':
+            tolower((unsigned char) *c) - 'a' + 10;
+        if (*size > ((size_t) -1 >> 4)) return 0;
+        *size = (*size << 4) | (size_t) d;
+    }
+    while (c < end && isspace((unsigned char) *c)) c++;
+    return digits > 0 && (c == end || *c == ';');
+}
+
 /*-------------------------------------------------------------------------*\
 * Skips a given number of bytes from read buffer. No data is read from the
 * transport layer
@@ -249,8 +1083,13 @@ static int recvline(p_buffer buf, luaL_Buffer *b) {
 static void buffer_skip(p_buffer buf, size_t count) {
     buf->received += count;
     buf->first += count;
-    if (buffer_isempty(buf))
+    if (buffer_isempty(buf)) {
         buf->first = buf->last = 0;
+        if (buf->release) {
+            free(buf->data);
+            buf->data = NULL;
+        }
+    }
 }
 
 /*-------------------------------------------------------------------------*\
@@ -263,7 +1102,15 @@ static int buffer_get(p_buffer buf, const char **data, size_t *count) {
     p_timeout tm = buf->tm;
     if (buffer_isempty(buf)) {
         size_t got;
-        err = io->recv(io->ctx, buf->data, BUF_SIZE, &got, tm);
+        if (!buf->data) {
+            buf->data = (char *) malloc(buf->size);
+            if (!buf->data) {
+                *count = 0;
+                *data = NULL;
+                return IO_NOMEM;
+            }
+        }
+        err = io->recv(io->ctx, buf->data, buf->size, &got, tm);
         buf->first = 0;
         buf->last = got;
     }
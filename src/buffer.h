@@ -9,8 +9,16 @@
 * LuaSocket interface for input/output on connected objects, as seen by 
 * Lua programs. 
 *
-* Input is buffered. Output is *not* buffered because there was no simple
-* way of making sure the buffered output data would ever be sent.
+* Input is buffered. Output is *not* buffered by default, because there is
+* no simple way of making sure the buffered output data would ever be sent.
+* Objects can opt into an output buffer, in which case the program is
+* responsible for calling flush. Pending output is also flushed before each
+* receive, whenever the buffer fills up, and when the object is closed, so
+* that request/response protocols work unchanged.
+*
+* The input buffer is only allocated when data is first read, and its size
+* can be changed per object. Objects can also choose to release the buffer
+* whenever it becomes empty, which keeps idle objects small.
 *
 * The module is built on top of the I/O abstraction defined in io.h and the
 * timeout management is done with the timeout.h interface.
@@ -20,9 +28,12 @@
 #include "io.h"
 #include "timeout.h"
 
-/* buffer size in bytes */
+/* default buffer size in bytes */
 #define BUF_SIZE 8192
 
+/* largest read done directly into the result of a receive */
+#define BUF_DIRECTSIZE 1048576
+
 /* buffer control structure */
 typedef struct t_buffer_ {
     double birthday;        /* throttle support info: creation time, */
@@ -30,16 +41,33 @@ typedef struct t_buffer_ {
     p_io io;                /* IO driver used for this buffer */
     p_timeout tm;           /* timeout management for this buffer */
     size_t first, last;     /* index of first and last bytes of stored data */
-    char data[BUF_SIZE];    /* storage space for buffer data */
+    size_t size;            /* capacity of data */
+    int release;            /* free data whenever the buffer becomes empty */
+    char *data;             /* storage space for buffer data, or NULL */
+    size_t outsize;         /* capacity of output buffer, 0 if disabled */
+    size_t outlen;          /* number of bytes of pending output */
+    char *out;              /* storage space for pending output, or NULL */
 } t_buffer;
 typedef t_buffer *p_buffer;
 
 int buffer_open(lua_State *L);
 void buffer_init(p_buffer buf, p_io io, p_timeout tm);
+void buffer_destroy(p_buffer buf);
+int buffer_flushpending(p_buffer buf, int wait);
 int buffer_meth_send(lua_State *L, p_buffer buf);
+int buffer_meth_sendv(lua_State *L, p_buffer buf);
 int buffer_meth_receive(lua_State *L, p_buffer buf);
+int buffer_meth_receiveheaders(lua_State *L, p_buffer buf);
+int buffer_meth_receivechunk(lua_State *L, p_buffer buf);
+int buffer_meth_sendchunk(lua_State *L, p_buffer buf);
 int buffer_meth_getstats(lua_State *L, p_buffer buf);
 int buffer_meth_setstats(lua_State *L, p_buffer buf);
+int buffer_meth_getbuffersize(lua_State *L, p_buffer buf);
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf);
+int buffer_meth_setoutputbuffer(lua_State *L, p_buffer buf);
+int buffer_meth_flush(lua_State *L, p_buffer buf);
 int buffer_isempty(p_buffer buf);
+int buffer_read(p_buffer buf, char *data, size_t count, size_t *got);
+int buffer_write(p_buffer buf, const char *data, size_t count, size_t *sent);
 
 #endif /* BUF_H */
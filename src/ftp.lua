@@ -28,6 +28,8 @@ local PORT = 21
 -- provided in url. should be changed to your e-mail.
 _M.USER = "ftp"
 _M.PASSWORD = "anonymous@anonymous.org"
+-- hold commands in the output buffer until the reply is read
+_M.OUTPUTBUFFER = false
 
 -----------------------------------------------------------------------------
 -- Low level FTP API
@@ -35,7 +37,8 @@ _M.PASSWORD = "anonymous@anonymous.org"
 local metat = { __index = {} }
 
 function _M.open(server, port, create)
-    local tp = socket.try(tp.connect(server, port or PORT, _M.TIMEOUT, create))
+    local tp = socket.try(tp.connect(server, port or PORT, _M.TIMEOUT,
+        create, _M.OUTPUTBUFFER))
     local f = base.setmetatable({ tp = tp }, metat)
     -- make sure everything gets closed in an exception
     f.try = socket.newtry(function() f:close() end)
@@ -156,6 +159,8 @@ function metat.__index:send(sendt)
         return step(src, snk)
     end
     local sink = socket.sink("close-when-done", self.data)
+    -- files are sent by the kernel, the control connection is checked after
+    if not sendt.step and ltn12.native[sendt.source] then checkstep = nil end
     -- transfer all data and check error
     self.try(ltn12.pump.all(sendt.source, sink, checkstep))
     if string.find(code, "1..") then self.try(self.tp:check("2..")) end
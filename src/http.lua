@@ -25,6 +25,15 @@ local _M = socket.http
 _M.TIMEOUT = 60
 -- user agent field sent in request
 _M.USERAGENT = socket._VERSION
+-- keep connections open for reuse by later requests
+_M.KEEPALIVE = false
+-- most idle connections kept, overall and per server
+_M.MAXIDLE = 16
+_M.MAXIDLEPERHOST = 4
+-- idle connections older than this many seconds are closed
+_M.IDLETIMEOUT = 30
+-- hold requests in the output buffer until the response is read
+_M.OUTPUTBUFFER = false
 
 -- supported schemes
 local SCHEMES = { ["http"] = true }
@@ -36,6 +45,8 @@ local PORT = 80
 -----------------------------------------------------------------------------
 local function receiveheaders(sock, headers)
     local line, name, value, err
+    -- LuaSocket objects parse the whole block in C
+    if sock.receiveheaders then return sock:receiveheaders(headers) end
     headers = headers or {}
     -- get first line
     line, err = sock:receive()
@@ -71,6 +82,15 @@ socket.sourcet["http-chunked"] = function(sock, headers)
         dirty = function() return sock:dirty() end
     }, {
         __call = function()
+            -- LuaSocket objects decode chunks in C
+            if sock.receivechunk then
+                local chunk, err = sock:receivechunk()
+                if chunk ~= "" then return chunk, err end
+                -- the last chunk is followed by the trailers
+                headers, err = receiveheaders(sock, headers)
+                if not headers then return nil, err end
+                return nil
+            end
             -- get chunk size, skip extention
             local line, err = sock:receive()
             if err then return nil, err end
@@ -97,6 +117,8 @@ socket.sinkt["http-chunked"] = function(sock)
         dirty = function() return sock:dirty() end
     }, {
         __call = function(self, chunk, err)
+            -- LuaSocket objects send the framing without copying the chunk
+            if sock.sendchunk then return sock:sendchunk(chunk) end
             if not chunk then return sock:send("0\r\n\r\n") end
             local size = string.format("%X\r\n", string.len(chunk))
             return sock:send(size ..  chunk .. "\r\n")
@@ -109,15 +131,25 @@ end
 -----------------------------------------------------------------------------
 local metat = { __index = {} }
 
-function _M.open(host, port, create)
-    -- create socket with user connect function, or with default
-    local c = socket.try((create or socket.tcp)())
+local function wrap(c)
     local h = base.setmetatable({ c = c }, metat)
     -- create finalized try
     h.try = socket.newtry(function() h:close() end)
+    return h
+end
+
+function _M.open(host, port, create)
+    -- create socket with user connect function, or with default
+    local c = socket.try((create or socket.tcp)())
+    local h = wrap(c)
     -- set timeout before connecting
     h.try(c:settimeout(_M.TIMEOUT))
     h.try(c:connect(host, port or PORT))
+    -- coalesce request line, headers and small bodies into few packets.
+    -- pending output is flushed when we start reading the response
+    if _M.OUTPUTBUFFER and c.setoutputbuffer then
+        h.try(c:setoutputbuffer())
+    end
     -- here everything worked
     return h
 end
@@ -183,6 +215,109 @@ function metat.__index:close()
     return self.c:close()
 end
 
+-----------------------------------------------------------------------------
+-- Pool of idle connections, kept for reuse when KEEPALIVE is on
+-----------------------------------------------------------------------------
+-- idle[key] is a non-empty list of {c = socket, t = time it became idle},
+-- oldest first
+local pool = { idle = {}, count = 0, hits = 0, misses = 0 }
+
+local function poolkey(reqt)
+    -- we can only tell our own sockets apart
+    if reqt.create then return nil end
+    if reqt.keepalive == false then return nil end
+    if reqt.keepalive == nil and not _M.KEEPALIVE then return nil end
+    return table.concat({reqt.scheme or "http", reqt.host,
+        base.tostring(reqt.port), reqt.proxy or _M.PROXY or ""}, " ")
+end
+
+local function dropidle(key, i)
+    local e = table.remove(pool.idle[key], i)
+    if #pool.idle[key] == 0 then pool.idle[key] = nil end
+    pool.count = pool.count - 1
+    e.c:close()
+end
+
+-- closes connections that have been idle for too long
+local function expireidle(now)
+    for key, list in base.pairs(pool.idle) do
+        while list[1] and now - list[1].t > _M.IDLETIMEOUT do
+            dropidle(key, 1)
+        end
+    end
+end
+
+local function takeidle(key)
+    expireidle(socket.monotime())
+    local list = pool.idle[key]
+    while list and list[1] do
+        local e = table.remove(list)
+        if #list == 0 then pool.idle[key] = nil end
+        pool.count = pool.count - 1
+        -- an idle connection has nothing to read, unless the server
+        -- closed it or sent something we did not ask for
+        local r = socket.select({e.c}, nil, 0)
+        if #r == 0 then
+            pool.hits = pool.hits + 1
+            local h = wrap(e.c)
+            h.try(e.c:settimeout(_M.TIMEOUT))
+            return h
+        end
+        e.c:close()
+    end
+    pool.misses = pool.misses + 1
+end
+
+local function putidle(key, h)
+    local now = socket.monotime()
+    expireidle(now)
+    if _M.MAXIDLE < 1 or _M.MAXIDLEPERHOST < 1 then return h:close() end
+    while pool.idle[key] and #pool.idle[key] >= _M.MAXIDLEPERHOST do
+        dropidle(key, 1)
+    end
+    -- make room by closing the connection that was idle the longest
+    while pool.count >= _M.MAXIDLE do
+        local oldest, okey
+        for k, list in base.pairs(pool.idle) do
+            if not oldest or list[1].t < oldest then
+                oldest, okey = list[1].t, k
+            end
+        end
+        dropidle(okey, 1)
+    end
+    local list = pool.idle[key] or {}
+    pool.idle[key] = list
+    table.insert(list, {c = h.c, t = now})
+    pool.count = pool.count + 1
+end
+
+-- the connection can be reused if the server agrees and the end of the
+-- response did not depend on the connection being closed
+local function persists(status, headers, body)
+    local connection = string.lower(headers["connection"] or "")
+    if string.find(connection, "close", 1, true) then return false end
+    if not string.find(status, "^HTTP/1%.1") and
+        not string.find(connection, "keep-alive", 1, true) then
+        return false
+    end
+    if not body then return true end
+    local t = headers["transfer-encoding"]
+    return (t and t ~= "identity") or
+        base.tonumber(headers["content-length"]) ~= nil
+end
+
+-- returns hit and miss counters, and the number of idle connections
+function _M.poolstats()
+    return { hits = pool.hits, misses = pool.misses, idle = pool.count }
+end
+
+-- closes all idle connections
+function _M.closeidle()
+    for key in base.pairs(pool.idle) do
+        while pool.idle[key] do dropidle(key, 1) end
+    end
+end
+
 -----------------------------------------------------------------------------
 -- High level HTTP API
 -----------------------------------------------------------------------------
@@ -216,7 +351,7 @@ local function adjustheaders(reqt)
     local lower = {
         ["user-agent"] = _M.USERAGENT,
         ["host"] = host,
-        ["connection"] = "close, TE",
+        ["connection"] = reqt.poolkey and "TE" or "close, TE",
         ["te"] = "trailers"
     }
     -- if we have authentication information, pass it along
@@ -260,6 +395,8 @@ local function adjustrequest(reqt)
     end
     -- compute uri if user hasn't overriden
     nreqt.uri = reqt.uri or adjusturi(nreqt)
+    -- connections are pooled by server and proxy
+    nreqt.poolkey = poolkey(nreqt)
     -- adjust headers in request
     nreqt.headers = adjustheaders(nreqt)
     -- ajust host and port if there is a proxy
@@ -287,6 +424,28 @@ local function shouldreceivebody(reqt, code)
     return 1
 end
 
+-- methods that can be sent again without changing their effect
+local idempotent = { GET = true, HEAD = true, PUT = true, DELETE = true,
+    OPTIONS = true, TRACE = true }
+
+-- bytes received so far by the connection, if it keeps count
+local function received(c)
+    return c.getstats and (c:getstats()) or 0
+end
+
+-- sends the request and reads the status line, returning true followed
+-- by the results of receivestatusline, or nil and an error message
+local sendrequest = socket.protect(function(h, nreqt)
+    -- send request line and headers
+    h:sendrequestline(nreqt.method, nreqt.uri)
+    h:sendheaders(nreqt.headers)
+    -- if there is a body, send it
+    if nreqt.source then
+        h:sendbody(nreqt.headers, nreqt.source, nreqt.step)
+    end
+    return true, h:receivestatusline()
+end)
+
 -- forward declarations
 local trequest, tredirect
 
@@ -300,7 +459,8 @@ local trequest, tredirect
         headers = reqt.headers,
         proxy = reqt.proxy,
         nredirects = (reqt.nredirects or 0) + 1,
-        create = reqt.create
+        create = reqt.create,
+        keepalive = reqt.keepalive
     }
     -- pass location header back as a hint we redirected
     headers = headers or {}
@@ -312,15 +472,20 @@ end
     -- we loop until we get what we want, or
     -- until we are sure there is no way to get it
     local nreqt = adjustrequest(reqt)
-    local h = _M.open(nreqt.host, nreqt.port, nreqt.create)
-    -- send request line and headers
-    h:sendrequestline(nreqt.method, nreqt.uri)
-    h:sendheaders(nreqt.headers)
-    -- if there is a body, send it
-    if nreqt.source then
-        h:sendbody(nreqt.headers, nreqt.source, nreqt.step)
+    local key = nreqt.poolkey
+    local h = key and takeidle(key)
+    local reused, before = h ~= nil, h and received(h.c)
+    h = h or _M.open(nreqt.host, nreqt.port, nreqt.create)
+    local ok, code, status = sendrequest(h, nreqt)
+    -- the server may have closed an idle connection just as we reused
+    -- it. if nothing came back, and the request can be sent again, try
+    -- once more on a fresh connection
+    if not ok and reused and received(h.c) == before and
+        idempotent[nreqt.method or "GET"] and not nreqt.source then
+        h = _M.open(nreqt.host, nreqt.port, nreqt.create)
+        ok, code, status = sendrequest(h, nreqt)
     end
-    local code, status = h:receivestatusline()
+    socket.try(ok, code)
     -- if it is an HTTP/0.9 server, simply get the body and we are done
     if not code then
         h:receive09body(status, nreqt.sink, nreqt.step)
@@ -340,10 +505,12 @@ end
         return tredirect(reqt, headers.location)
     end
     -- here we are finally done
-    if shouldreceivebody(nreqt, code) then
+    local body = shouldreceivebody(nreqt, code)
+    if body then
         h:receivebody(headers, nreqt.sink, nreqt.step)
     end
-    h:close()
+    if key and persists(status, headers, body) then putidle(key, h)
+    else h:close() end
     return 1, code, headers, status
 end
 
@@ -10,6 +10,7 @@
 #include "lauxlib.h"
 #include "compat.h"
 
+#include "auxiliar.h"
 #include "inet.h"
 
 /*=========================================================================*\
@@ -21,6 +22,14 @@ static int inet_global_tohostname(lua_State *L);
 static int inet_global_getnameinfo(lua_State *L);
 static void inet_pushresolved(lua_State *L, struct hostent *hp);
 static int inet_global_gethostname(lua_State *L);
+static int inet_global_unpackaddr(lua_State *L);
+static int inet_global_address(lua_State *L);
+static int inet_address_getaddress(lua_State *L);
+static int inet_address_eq(lua_State *L);
+static int inet_global_setcache(lua_State *L);
+static int inet_global_getcache(lua_State *L);
+static int inet_global_flush(lua_State *L);
+static int inet_cache_gc(lua_State *L);
 
 /* DNS functions */
 static luaL_Reg func[] = {
@@ -29,9 +38,56 @@ static luaL_Reg func[] = {
     { "tohostname", inet_global_tohostname},
     { "getnameinfo", inet_global_getnameinfo},
     { "gethostname", inet_global_gethostname},
+    { "unpackaddr", inet_global_unpackaddr},
+    { "setcache", inet_global_setcache},
+    { "getcache", inet_global_getcache},
+    { "flush", inet_global_flush},
     { NULL, NULL}
 };
 
+/* functions in library namespace */
+static luaL_Reg addrfunc[] = {
+    { "address", inet_global_address},
+    { NULL, NULL}
+};
+
+/* address object methods */
+static luaL_Reg address_methods[] = {
+    {"__eq",       inet_address_eq},
+    {"__tostring", auxiliar_tostring},
+    {"getaddress", inet_address_getaddress},
+    {NULL,         NULL}
+};
+
+/* cached resolver answer */
+typedef struct t_dnsentry_ {
+    char *host, *serv;          /* copies of the query, or NULL */
+    int family, socktype, protocol, flags;
+    unsigned long hash;
+    int err;                    /* getaddrinfo error of negative answers */
+    struct addrinfo *resolved;  /* answer, owned by the cache */
+    double expires;             /* see timeout_now */
+    unsigned long used;         /* last use, for eviction */
+} t_dnsentry;
+typedef t_dnsentry *p_dnsentry;
+
+/* resolver cache of a Lua state, disabled by default */
+typedef struct t_dnscache_ {
+    p_dnsentry entries;
+    int size, count;
+    double ttl, negttl;
+    unsigned long clock;
+    unsigned long hits;         /* lookups answered from the cache */
+} t_dnscache;
+typedef t_dnscache *p_dnscache;
+
+static void inet_dropentries(p_dnscache cache, const char *host);
+
+/* each Lua state keeps its cache in the registry, under this key */
+static char dnscache_key;
+
+#define DNSCACHE_SIZE 256
+
 /*=========================================================================*\
 * Exported functions
 \*=========================================================================*/
@@ -44,9 +100,55 @@ int inet_open(lua_State *L)
     lua_newtable(L);
     luaL_setfuncs(L, func, 0);
     lua_settable(L, -3);
+    auxiliar_newclass(L, "inet{address}", address_methods);
+    luaL_setfuncs(L, addrfunc, 0);
+    /* create the resolver cache, unless the library was loaded before */
+    lua_pushlightuserdata(L, &dnscache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        p_dnscache cache;
+        lua_pushlightuserdata(L, &dnscache_key);
+        cache = (p_dnscache) lua_newuserdata(L, sizeof(t_dnscache));
+        memset(cache, 0, sizeof(t_dnscache));
+        luaL_newmetatable(L, "inet{dnscache}");
+        lua_pushstring(L, "__gc");
+        lua_pushcfunction(L, inet_cache_gc);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
     return 0;
 }
 
+/*-------------------------------------------------------------------------*\
+* Returns the resolver cache of the Lua state, or NULL if there is none
+\*-------------------------------------------------------------------------*/
+static p_dnscache inet_getcache(lua_State *L)
+{
+    p_dnscache cache;
+    lua_pushlightuserdata(L, &dnscache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    cache = (p_dnscache) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return cache;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the address object at stack index idx, or NULL if the value is
+* something else
+\*-------------------------------------------------------------------------*/
+p_inetaddr inet_toaddress(lua_State *L, int idx)
+{
+    p_inetaddr addr = NULL;
+    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+        return NULL;
+    luaL_getmetatable(L, "inet{address}");
+    if (lua_rawequal(L, -1, -2)) addr = (p_inetaddr) lua_touserdata(L, idx);
+    lua_pop(L, 2);
+    return addr;
+}
+
 /*=========================================================================*\
 * Global Lua functions
 \*=========================================================================*/
@@ -159,31 +261,23 @@ int inet_optsocktype(lua_State* L, int narg, const char* def)
     return optvalue[luaL_checkoption(L, narg, def, optname)];
 }
 
-static int inet_global_getaddrinfo(lua_State *L)
+/*-------------------------------------------------------------------------*\
+* Pushes a table with the family and numeric address of each entry of a
+* resolved list. Returns a getaddrinfo error code, and pushes nothing,
+* in case of failure
+\*-------------------------------------------------------------------------*/
+int inet_pushaddrinfo(lua_State *L, struct addrinfo *resolved)
 {
-    const char *hostname = luaL_checkstring(L, 1);
-    struct addrinfo *iterator = NULL, *resolved = NULL;
-    struct addrinfo hints;
+    struct addrinfo *iterator = NULL;
     int i = 1, ret = 0;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_family = AF_UNSPEC;
-    ret = getaddrinfo(hostname, NULL, &hints, &resolved);
-    if (ret != 0) {
-        lua_pushnil(L);
-        lua_pushstring(L, socket_gaistrerror(ret));
-        return 2;
-    }
     lua_newtable(L);
     for (iterator = resolved; iterator; iterator = iterator->ai_next) {
         char hbuf[NI_MAXHOST];
         ret = getnameinfo(iterator->ai_addr, (socklen_t) iterator->ai_addrlen,
             hbuf, (socklen_t) sizeof(hbuf), NULL, 0, NI_NUMERICHOST);
         if (ret){
-          freeaddrinfo(resolved);
-          lua_pushnil(L);
-          lua_pushstring(L, socket_gaistrerror(ret));
-          return 2;
+          lua_pop(L, 1);
+          return ret;
         }
         lua_pushnumber(L, i);
         lua_newtable(L);
@@ -215,10 +309,109 @@ static int inet_global_getaddrinfo(lua_State *L)
         lua_settable(L, -3);
         i++;
     }
-    freeaddrinfo(resolved);
+    return 0;
+}
+
+static int inet_global_getaddrinfo(lua_State *L)
+{
+    const char *hostname = luaL_checkstring(L, 1);
+    struct addrinfo *resolved = NULL;
+    struct addrinfo hints;
+    int ret = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+    ret = inet_getaddrinfo(L, hostname, NULL, &hints, &resolved);
+    if (ret == 0) {
+        ret = inet_pushaddrinfo(L, resolved);
+        inet_freeaddrinfo(L, resolved);
+    }
+    if (ret != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_gaistrerror(ret));
+        return 2;
+    }
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Configures the resolver cache: time to live of answers and of failed
+* lookups, in seconds, and maximum number of entries. A time to live of
+* zero, or nil, disables the cache
+\*-------------------------------------------------------------------------*/
+static int inet_global_setcache(lua_State *L)
+{
+    double ttl = luaL_optnumber(L, 1, 0.0);
+    lua_Integer size = luaL_optinteger(L, 2, DNSCACHE_SIZE);
+    double negttl = luaL_optnumber(L, 3, ttl);
+    p_dnscache cache = inet_getcache(L);
+    p_dnsentry entries = NULL;
+    luaL_argcheck(L, size >= 0 && size <= 65536, 2, "out of range");
+    inet_flushcache(L, NULL);
+    if (ttl <= 0.0) size = 0;
+    if (size != cache->size) {
+        if (size > 0) {
+            entries = (p_dnsentry) malloc((size_t) size*sizeof(t_dnsentry));
+            if (!entries) {
+                lua_pushnil(L);
+                lua_pushliteral(L, "out of memory");
+                return 2;
+            }
+        }
+        free(cache->entries);
+        cache->entries = entries;
+        cache->size = (int) size;
+    }
+    cache->ttl = ttl;
+    cache->negttl = negttl > 0.0? negttl: 0.0;
+    cache->hits = 0;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the resolver cache settings, the number of entries in use, the
+* number of lookups answered from the cache and the number of entries
+* that hold failed lookups
+\*-------------------------------------------------------------------------*/
+static int inet_global_getcache(lua_State *L)
+{
+    p_dnscache cache = inet_getcache(L);
+    int i, negative = 0;
+    for (i = 0; i < cache->count; i++)
+        if (cache->entries[i].err) negative++;
+    lua_pushnumber(L, cache->ttl);
+    lua_pushnumber(L, cache->size);
+    lua_pushnumber(L, cache->negttl);
+    lua_pushnumber(L, cache->count);
+    lua_pushnumber(L, (lua_Number) cache->hits);
+    lua_pushnumber(L, negative);
+    return 6;
+}
+
+/*-------------------------------------------------------------------------*\
+* Drops the cached answers for a host name, or all of them
+\*-------------------------------------------------------------------------*/
+static int inet_global_flush(lua_State *L)
+{
+    inet_flushcache(L, luaL_optstring(L, 1, NULL));
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the resolver cache when the Lua state is closed
+\*-------------------------------------------------------------------------*/
+static int inet_cache_gc(lua_State *L)
+{
+    p_dnscache cache = (p_dnscache) lua_touserdata(L, 1);
+    inet_dropentries(cache, NULL);
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->size = 0;
+    return 0;
+}
+
 /*-------------------------------------------------------------------------*\
 * Gets the host name
 \*-------------------------------------------------------------------------*/
@@ -236,6 +429,111 @@ static int inet_global_gethostname(lua_State *L)
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Converts a packed address, as returned by udp:receivemany, into the
+* numeric host, port and family
+\*-------------------------------------------------------------------------*/
+static int inet_global_unpackaddr(lua_State *L)
+{
+    size_t len;
+    const char *packed = luaL_checklstring(L, 1, &len);
+    t_sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[INET6_ADDRSTRLEN];
+    char port[6];
+    int err;
+    if (!inet_unpack(packed, len, &addr, &addr_len)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid packed address");
+        return 2;
+    }
+    err = getnameinfo((SA *) &addr, addr_len, name, INET6_ADDRSTRLEN,
+        port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, gai_strerror(err));
+        return 2;
+    }
+    lua_pushstring(L, name);
+    lua_pushinteger(L, (int) strtol(port, (char **) NULL, 10));
+    if (((SA *) &addr)->sa_family == AF_INET6) lua_pushliteral(L, "inet6");
+    else lua_pushliteral(L, "inet");
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* Creates an address object, either from a numeric host and port or from
+* a packed address. Address objects can be passed to udp:sendto and
+* udp:sendmany instead of host and port, skipping any parsing.
+\*-------------------------------------------------------------------------*/
+static int inet_global_address(lua_State *L)
+{
+    size_t len;
+    const char *host = luaL_checklstring(L, 1, &len);
+    int packed = lua_isnoneornil(L, 2);
+    p_inetaddr addr = (p_inetaddr) lua_newuserdata(L, sizeof(t_inetaddr));
+    memset(addr, 0, sizeof(t_inetaddr));
+    if (packed) {
+        if (!inet_unpack(host, len, &addr->addr, &addr->addr_len)) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "invalid packed address");
+            return 2;
+        }
+    } else {
+        const char *serv = luaL_checkstring(L, 2);
+        struct addrinfo hints, *resolved;
+        int err;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        err = getaddrinfo(host, serv, &hints, &resolved);
+        if (err) {
+            lua_pushnil(L);
+            lua_pushstring(L, socket_gaistrerror(err));
+            return 2;
+        }
+        memcpy(&addr->addr, resolved->ai_addr, resolved->ai_addrlen);
+        addr->addr_len = (socklen_t) resolved->ai_addrlen;
+        freeaddrinfo(resolved);
+    }
+    auxiliar_setclass(L, "inet{address}", -1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the numeric host, port and family of an address object
+\*-------------------------------------------------------------------------*/
+static int inet_address_getaddress(lua_State *L)
+{
+    p_inetaddr addr = (p_inetaddr) auxiliar_checkclass(L, "inet{address}", 1);
+    char name[INET6_ADDRSTRLEN];
+    char port[6];
+    int err = getnameinfo((SA *) &addr->addr, addr->addr_len,
+        name, INET6_ADDRSTRLEN, port, sizeof(port),
+        NI_NUMERICHOST | NI_NUMERICSERV);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_gaistrerror(err));
+        return 2;
+    }
+    lua_pushstring(L, name);
+    lua_pushinteger(L, (int) strtol(port, (char **) NULL, 10));
+    if (((SA *) &addr->addr)->sa_family == AF_INET6)
+        lua_pushliteral(L, "inet6");
+    else lua_pushliteral(L, "inet");
+    return 3;
+}
+
+static int inet_address_eq(lua_State *L)
+{
+    p_inetaddr a = (p_inetaddr) auxiliar_checkclass(L, "inet{address}", 1);
+    p_inetaddr b = (p_inetaddr) auxiliar_checkclass(L, "inet{address}", 2);
+    lua_pushboolean(L, a->addr_len == b->addr_len &&
+        memcmp(&a->addr, &b->addr, a->addr_len) == 0);
+    return 1;
+}
+
 /*=========================================================================*\
 * Lua methods
 \*=========================================================================*/
@@ -349,6 +647,73 @@ static void inet_pushresolved(lua_State *L, struct hostent *hp)
     lua_settable(L, resolved);
 }
 
+/*-------------------------------------------------------------------------*\
+* Pushes a compact binary form of an inet address: the port followed by
+* the address, both in network byte order, followed by the scope id for
+* scoped IPv6 addresses. Short strings are interned by Lua, so the result
+* is cheap to compare and to use as a table key. Pushes nil for other
+* families.
+\*-------------------------------------------------------------------------*/
+void inet_pushpacked(lua_State *L, SA *addr, socklen_t addr_len)
+{
+    char packed[INET_PACKEDMAX];
+    if (addr->sa_family == AF_INET &&
+            addr_len >= (socklen_t) sizeof(struct sockaddr_in)) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+        memcpy(packed, &sin->sin_port, 2);
+        memcpy(packed + 2, &sin->sin_addr, 4);
+        lua_pushlstring(L, packed, 6);
+    } else if (addr->sa_family == AF_INET6 &&
+            addr_len >= (socklen_t) sizeof(struct sockaddr_in6)) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+        unsigned long scope = (unsigned long) sin6->sin6_scope_id;
+        memcpy(packed, &sin6->sin6_port, 2);
+        memcpy(packed + 2, &sin6->sin6_addr, 16);
+        if (sin6->sin6_scope_id == 0) {
+            lua_pushlstring(L, packed, 18);
+        } else {
+            unsigned char *p = (unsigned char *) packed + 18;
+            p[0] = (unsigned char) (scope >> 24);
+            p[1] = (unsigned char) (scope >> 16);
+            p[2] = (unsigned char) (scope >> 8);
+            p[3] = (unsigned char) scope;
+            lua_pushlstring(L, packed, 22);
+        }
+    } else lua_pushnil(L);
+}
+
+/*-------------------------------------------------------------------------*\
+* Rebuilds the socket address from its packed form.
+* Returns 0 if the packed form is invalid.
+\*-------------------------------------------------------------------------*/
+int inet_unpack(const char *packed, size_t len, t_sockaddr_storage *addr,
+        socklen_t *addr_len)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (len == 6) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_port, packed, 2);
+        memcpy(&sin->sin_addr, packed + 2, 4);
+        *addr_len = sizeof(struct sockaddr_in);
+        return 1;
+    } else if (len == 18 || len == 22) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_port, packed, 2);
+        memcpy(&sin6->sin6_addr, packed + 2, 16);
+        if (len == 22) {
+            const unsigned char *p = (const unsigned char *) packed + 18;
+            sin6->sin6_scope_id = ((unsigned long) p[0] << 24) |
+                ((unsigned long) p[1] << 16) | ((unsigned long) p[2] << 8) |
+                (unsigned long) p[3];
+        }
+        *addr_len = sizeof(struct sockaddr_in6);
+        return 1;
+    }
+    return 0;
+}
+
 /*-------------------------------------------------------------------------*\
 * Tries to create a new inet socket
 \*-------------------------------------------------------------------------*/
@@ -391,19 +756,17 @@ const char *inet_trydisconnect(p_socket ps, int family, p_timeout tm)
 /*-------------------------------------------------------------------------*\
 * Tries to connect to remote address (address, port)
 \*-------------------------------------------------------------------------*/
-const char *inet_tryconnect(p_socket ps, int *family, const char *address,
-        const char *serv, p_timeout tm, struct addrinfo *connecthints)
+const char *inet_tryconnect(lua_State *L, p_socket ps, int *family,
+        const char *address, const char *serv, p_timeout tm,
+        struct addrinfo *connecthints)
 {
     struct addrinfo *iterator = NULL, *resolved = NULL;
     const char *err = NULL;
     int current_family = *family;
     /* try resolving */
-    err = socket_gaistrerror(getaddrinfo(address, serv,
+    err = socket_gaistrerror(inet_getaddrinfo(L, address, serv,
                 connecthints, &resolved));
-    if (err != NULL) {
-        if (resolved) freeaddrinfo(resolved);
-        return err;
-    }
+    if (err != NULL) return err;
     for (iterator = resolved; iterator; iterator = iterator->ai_next) {
         timeout_markstart(tm);
         /* create new socket if necessary. if there was no
@@ -417,8 +780,6 @@ const char *inet_tryconnect(p_socket ps, int *family, const char *address,
                 iterator->ai_socktype, iterator->ai_protocol);
             if (err) continue;
             current_family = iterator->ai_family;
-            /* set non-blocking before connect */
-            socket_setnonblocking(ps);
         }
         /* try connecting to remote address */
         err = socket_strerror(socket_connect(ps, (SA *) iterator->ai_addr,
@@ -429,7 +790,122 @@ const char *inet_tryconnect(p_socket ps, int *family, const char *address,
             break;
         }
     }
-    freeaddrinfo(resolved);
+    inet_freeaddrinfo(L, resolved);
+    /* here, if err is set, we failed */
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Takes the next address from the list that is (or is not) of the family
+\*-------------------------------------------------------------------------*/
+static struct addrinfo *inet_nextaddr(struct addrinfo **cursor, int family,
+        int same) {
+    struct addrinfo *ai = *cursor;
+    while (ai && (ai->ai_family == family) != same) ai = ai->ai_next;
+    *cursor = ai? ai->ai_next: NULL;
+    return ai;
+}
+
+/*-------------------------------------------------------------------------*\
+* Tries to connect to remote address (address, port), racing the resolved
+* addresses as in RFC 8305: a new attempt starts every delay seconds, or as
+* soon as one fails, alternating between address families, and the first
+* attempt to succeed wins. Only works for sockets not created yet
+\*-------------------------------------------------------------------------*/
+const char *inet_tryeyeballs(lua_State *L, p_socket ps, int *family,
+        const char *address, const char *serv, p_timeout tm,
+        struct addrinfo *connecthints, double delay)
+{
+    struct addrinfo *resolved = NULL, *cursor[2];
+    t_socket socks[SOCKET_MAXCONNECT];
+    int families[SOCKET_MAXCONNECT];
+    int i, n = 0, turn = 0, which = -1, first;
+    const char *err = NULL;
+    t_timeout zero;
+    if (*ps != SOCKET_INVALID || timeout_iszero(tm))
+        return inet_tryconnect(L, ps, family, address, serv, tm,
+            connecthints);
+    err = socket_gaistrerror(inet_getaddrinfo(L, address, serv,
+                connecthints, &resolved));
+    if (err != NULL) return err;
+    first = resolved->ai_family;
+    cursor[0] = cursor[1] = resolved;
+    timeout_init(&zero, 0.0, -1);
+    timeout_markstart(tm);
+    for ( ;; ) {
+        struct addrinfo *next = NULL;
+        t_timeout wait;
+        double t;
+        int ret;
+        /* start another attempt, alternating between families */
+        if ((next = inet_nextaddr(&cursor[turn], first, !turn)) != NULL)
+            turn = !turn;
+        else next = inet_nextaddr(&cursor[!turn], first, turn);
+        if (next) {
+            t_socket sock;
+            /* make room by giving up on the oldest attempt */
+            if (n == SOCKET_MAXCONNECT) {
+                socket_destroy(&socks[0]);
+                for (i = 1; i < n; i++) {
+                    socks[i-1] = socks[i];
+                    families[i-1] = families[i];
+                }
+                n--;
+            }
+            err = inet_trycreate(&sock, next->ai_family, next->ai_socktype,
+                next->ai_protocol);
+            if (err) continue;
+            ret = socket_connect(&sock, (SA *) next->ai_addr,
+                (socklen_t) next->ai_addrlen, &zero);
+            if (ret == IO_DONE) {
+                socks[n] = sock;
+                families[n] = next->ai_family;
+                which = n++;
+                break;
+            } else if (ret != IO_TIMEOUT) {
+                /* failed right away, move on to the next address */
+                err = socket_strerror(ret);
+                socket_destroy(&sock);
+                continue;
+            }
+            socks[n] = sock;
+            families[n] = next->ai_family;
+            n++;
+        } else if (n == 0) break;
+        /* wait for the attempts underway, until it is time for another */
+        t = timeout_getretry(tm);
+        if (next && (t < 0.0 || delay < t)) t = delay;
+        timeout_init(&wait, t, -1);
+        timeout_markstart(&wait);
+        ret = socket_waitconnect(socks, n, &which, &wait);
+        if (which >= 0) {
+            if (ret == IO_DONE) break;
+            /* drop the failed attempt and start the next one right away */
+            err = socket_strerror(ret);
+            socket_destroy(&socks[which]);
+            for (i = which+1; i < n; i++) {
+                socks[i-1] = socks[i];
+                families[i-1] = families[i];
+            }
+            n--;
+            which = -1;
+        } else if (ret != IO_TIMEOUT) {
+            err = socket_strerror(ret);
+            break;
+        } else if (timeout_getretry(tm) == 0.0) {
+            err = io_strerror(IO_TIMEOUT);
+            break;
+        }
+    }
+    inet_freeaddrinfo(L, resolved);
+    /* keep the winner, if any, and abandon the other attempts */
+    for (i = 0; i < n; i++) {
+        if (i == which) {
+            *ps = socks[i];
+            *family = families[i];
+            err = NULL;
+        } else socket_destroy(&socks[i]);
+    }
     /* here, if err is set, we failed */
     return err;
 }
@@ -453,8 +929,8 @@ const char *inet_tryaccept(p_socket server, int family, p_socket client,
 /*-------------------------------------------------------------------------*\
 * Tries to bind socket to (address, port)
 \*-------------------------------------------------------------------------*/
-const char *inet_trybind(p_socket ps, int *family, const char *address,
-    const char *serv, struct addrinfo *bindhints) {
+const char *inet_trybind(lua_State *L, p_socket ps, int *family,
+    const char *address, const char *serv, struct addrinfo *bindhints) {
     struct addrinfo *iterator = NULL, *resolved = NULL;
     const char *err = NULL;
     int current_family = *family;
@@ -462,11 +938,9 @@ const char *inet_trybind(p_socket ps, int *family, const char *address,
     if (strcmp(address, "*") == 0) address = NULL;
     if (!serv) serv = "0";
     /* try resolving */
-    err = socket_gaistrerror(getaddrinfo(address, serv, bindhints, &resolved));
-    if (err) {
-        if (resolved) freeaddrinfo(resolved);
-        return err;
-    }
+    err = socket_gaistrerror(inet_getaddrinfo(L, address, serv, bindhints,
+                &resolved));
+    if (err) return err;
     /* iterate over resolved addresses until one is good */
     for (iterator = resolved; iterator; iterator = iterator->ai_next) {
         if (current_family != iterator->ai_family || *ps == SOCKET_INVALID) {
@@ -482,17 +956,160 @@ const char *inet_trybind(p_socket ps, int *family, const char *address,
         /* keep trying unless bind succeeded */
         if (err == NULL) {
             *family = current_family;
-            /* set to non-blocking after bind */
-            socket_setnonblocking(ps);
             break;
         }
     }
     /* cleanup and return error */
-    freeaddrinfo(resolved);
+    inet_freeaddrinfo(L, resolved);
     /* here, if err is set, we failed */
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Resolver cache. Answers for host names are kept for the configured time
+* to live, and so are the lookups of names that do not exist. Numeric
+* addresses are resolved without going to the network, and are not cached.
+* Each Lua state has its own cache. Lists returned by inet_getaddrinfo
+* must be released with inet_freeaddrinfo, and are only valid until the
+* next call into the cache of the same state
+\*-------------------------------------------------------------------------*/
+static int inet_isnumeric(const char *host) {
+    return !host || strchr(host, ':') ||
+        host[strspn(host, "0123456789.")] == '\0';
+}
+
+static int inet_isnegative(int err) {
+#ifdef EAI_NODATA
+    if (err == EAI_NODATA) return 1;
+#endif
+    return err == EAI_NONAME;
+}
+
+static unsigned long inet_hashquery(const char *host, const char *serv) {
+    unsigned long hash = 5381;
+    while (*host) hash = hash*33 + (unsigned char) *host++;
+    hash = hash*33 + (serv? '/': '\0');
+    if (serv) while (*serv) hash = hash*33 + (unsigned char) *serv++;
+    return hash;
+}
+
+static int inet_samestring(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static char *inet_copystring(const char *s) {
+    char *copy;
+    if (!s) return NULL;
+    copy = (char *) malloc(strlen(s)+1);
+    if (copy) strcpy(copy, s);
+    return copy;
+}
+
+static void inet_clearentry(p_dnsentry entry) {
+    free(entry->host);
+    free(entry->serv);
+    if (entry->resolved) freeaddrinfo(entry->resolved);
+    entry->host = entry->serv = NULL;
+    entry->resolved = NULL;
+}
+
+static void inet_dropentry(p_dnscache cache, p_dnsentry entry) {
+    inet_clearentry(entry);
+    *entry = cache->entries[--cache->count];
+}
+
+int inet_getaddrinfo(lua_State *L, const char *host, const char *serv,
+        struct addrinfo *hints, struct addrinfo **resolved)
+{
+    p_dnscache cache = inet_getcache(L);
+    p_dnsentry entry = NULL, victim = NULL;
+    unsigned long hash;
+    double now;
+    int i, err;
+    *resolved = NULL;
+    if (!cache || cache->size == 0 || !hints || inet_isnumeric(host))
+        return getaddrinfo(host, serv, hints, resolved);
+    hash = inet_hashquery(host, serv);
+    now = timeout_now();
+    for (i = 0; i < cache->count; i++) {
+        p_dnsentry e = &cache->entries[i];
+        if (e->hash == hash && e->family == hints->ai_family &&
+                e->socktype == hints->ai_socktype &&
+                e->protocol == hints->ai_protocol &&
+                e->flags == hints->ai_flags &&
+                inet_samestring(e->host, host) &&
+                inet_samestring(e->serv, serv)) {
+            entry = e;
+            break;
+        }
+        /* evict expired answers first, then the least recently used */
+        if (!victim || (victim->expires > now &&
+                (e->expires <= now || e->used < victim->used)))
+            victim = e;
+    }
+    if (entry && now < entry->expires) {
+        entry->used = ++cache->clock;
+        cache->hits++;
+        *resolved = entry->resolved;
+        return entry->err;
+    }
+    err = getaddrinfo(host, serv, hints, resolved);
+    if (err != 0 && !(inet_isnegative(err) && cache->negttl > 0.0)) {
+        if (entry) inet_dropentry(cache, entry);
+        return err;
+    }
+    if (entry) inet_clearentry(entry);
+    else if (cache->count < cache->size)
+        entry = &cache->entries[cache->count++];
+    else {
+        entry = victim;
+        inet_clearentry(entry);
+    }
+    entry->resolved = NULL;
+    entry->host = inet_copystring(host);
+    entry->serv = inet_copystring(serv);
+    /* without memory, the answer is simply not cached */
+    if (!entry->host || (serv && !entry->serv)) {
+        inet_dropentry(cache, entry);
+        return err;
+    }
+    entry->family = hints->ai_family;
+    entry->socktype = hints->ai_socktype;
+    entry->protocol = hints->ai_protocol;
+    entry->flags = hints->ai_flags;
+    entry->hash = hash;
+    entry->err = err;
+    entry->resolved = err? NULL: *resolved;
+    entry->expires = now + (err? cache->negttl: cache->ttl);
+    entry->used = ++cache->clock;
+    return err;
+}
+
+void inet_freeaddrinfo(lua_State *L, struct addrinfo *resolved)
+{
+    p_dnscache cache = inet_getcache(L);
+    int i;
+    if (!resolved) return;
+    for (i = 0; cache && i < cache->count; i++)
+        if (cache->entries[i].resolved == resolved) return;
+    freeaddrinfo(resolved);
+}
+
+static void inet_dropentries(p_dnscache cache, const char *host) {
+    int i = cache->count;
+    while (i-- > 0) {
+        p_dnsentry entry = &cache->entries[i];
+        if (!host || inet_samestring(entry->host, host))
+            inet_dropentry(cache, entry);
+    }
+}
+
+void inet_flushcache(lua_State *L, const char *host)
+{
+    p_dnscache cache = inet_getcache(L);
+    if (cache) inet_dropentries(cache, host);
+}
+
 /*-------------------------------------------------------------------------*\
 * Some systems do not provide these so that we provide our own.
 \*-------------------------------------------------------------------------*/
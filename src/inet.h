@@ -12,7 +12,13 @@
 * available. The module also implements the interface of the internet
 * getpeername and getsockname functions as seen by Lua programs.
 *
-* The Lua functions toip and tohostname are also implemented here.
+* The Lua functions toip and tohostname are also implemented here, as
+* well as the compact binary form of addresses used by udp:receivemany
+* and the address objects accepted by udp:sendto.
+*
+* Lookups can go through a cache of resolver answers, configured from Lua
+* with socket.dns.setcache. Each Lua state has its own cache, kept in its
+* registry, so states running in different threads do not share answers.
 \*=========================================================================*/
 #include "lua.h"
 #include "socket.h"
@@ -25,12 +31,38 @@
 int inet_open(lua_State *L);
 
 const char *inet_trycreate(p_socket ps, int family, int type, int protocol);
-const char *inet_tryconnect(p_socket ps, int *family, const char *address,
-        const char *serv, p_timeout tm, struct addrinfo *connecthints);
-const char *inet_trybind(p_socket ps, int *family, const char *address,
-        const char *serv, struct addrinfo *bindhints);
+const char *inet_tryconnect(lua_State *L, p_socket ps, int *family,
+        const char *address, const char *serv, p_timeout tm,
+        struct addrinfo *connecthints);
+const char *inet_tryeyeballs(lua_State *L, p_socket ps, int *family,
+        const char *address, const char *serv, p_timeout tm,
+        struct addrinfo *connecthints, double delay);
+const char *inet_trybind(lua_State *L, p_socket ps, int *family,
+        const char *address, const char *serv, struct addrinfo *bindhints);
 const char *inet_trydisconnect(p_socket ps, int family, p_timeout tm);
 const char *inet_tryaccept(p_socket server, int family, p_socket client, p_timeout tm);
+int inet_pushaddrinfo(lua_State *L, struct addrinfo *resolved);
+
+int inet_getaddrinfo(lua_State *L, const char *host, const char *serv,
+        struct addrinfo *hints, struct addrinfo **resolved);
+void inet_freeaddrinfo(lua_State *L, struct addrinfo *resolved);
+void inet_flushcache(lua_State *L, const char *host);
+
+/* largest packed address: port, IPv6 address and scope id */
+#define INET_PACKEDMAX 22
+
+/* resolved address, as created by socket.address */
+typedef struct t_inetaddr_ {
+    t_sockaddr_storage addr;
+    socklen_t addr_len;
+} t_inetaddr;
+typedef t_inetaddr *p_inetaddr;
+
+p_inetaddr inet_toaddress(lua_State *L, int idx);
+
+void inet_pushpacked(lua_State *L, SA *addr, socklen_t addr_len);
+int inet_unpack(const char *packed, size_t len, t_sockaddr_storage *addr,
+        socklen_t *addr_len);
 
 int inet_meth_getpeername(lua_State *L, p_socket ps, int family);
 int inet_meth_getsockname(lua_State *L, p_socket ps, int family);
@@ -12,11 +12,20 @@
 \*-------------------------------------------------------------------------*/
 void io_init(p_io io, p_send send, p_recv recv, p_error error, void *ctx) {
     io->send = send;
+    io->sendv = NULL;
     io->recv = recv;
     io->error = error;
     io->ctx = ctx;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sets the optional vectored send function. Without it, pieces are sent
+* one at a time with the send function.
+\*-------------------------------------------------------------------------*/
+void io_setsendv(p_io io, p_sendv sendv) {
+    io->sendv = sendv;
+}
+
 /*-------------------------------------------------------------------------*\
 * I/O error strings
 \*-------------------------------------------------------------------------*/
@@ -25,6 +34,8 @@ const char *io_strerror(int err) {
         case IO_DONE: return NULL;
         case IO_CLOSED: return "closed";
         case IO_TIMEOUT: return "timeout";
+        case IO_NOMEM: return "out of memory";
+        case IO_LIMIT: return "limit exceeded";
         default: return "unknown error";
     }
 }
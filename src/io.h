@@ -22,7 +22,9 @@ enum {
     IO_DONE = 0,        /* operation completed successfully */
     IO_TIMEOUT = -1,    /* operation timed out */
     IO_CLOSED = -2,     /* the connection has been closed */
-	IO_UNKNOWN = -3
+	IO_UNKNOWN = -3,
+    IO_NOMEM = -4,      /* out of memory */
+    IO_LIMIT = -5       /* received data exceeds the given limit */
 };
 
 /* interface to error message function */
@@ -40,6 +42,21 @@ typedef int (*p_send) (
     p_timeout tm        /* timeout control */
 );
 
+/* one piece of data for vectored output */
+typedef struct t_iobuf_ {
+    const char *data;   /* pointer to the data */
+    size_t count;       /* number of bytes in the piece */
+} t_iobuf;
+
+/* interface to vectored send function */
+typedef int (*p_sendv) (
+    void *ctx,          /* context needed by send */
+    const t_iobuf *bufs,/* pieces of data to send, in order */
+    int n,              /* number of pieces */
+    size_t *sent,       /* number of bytes sent uppon return */
+    p_timeout tm        /* timeout control */
+);
+
 /* interface to recv function */
 typedef int (*p_recv) (
     void *ctx,          /* context needed by recv */
@@ -53,12 +70,14 @@ typedef int (*p_recv) (
 typedef struct t_io_ {
     void *ctx;          /* context needed by send/recv */
     p_send send;        /* send function pointer */
+    p_sendv sendv;      /* vectored send function pointer, or NULL */
     p_recv recv;        /* receive function pointer */
     p_error error;      /* strerror function */
 } t_io;
 typedef t_io *p_io;
 
 void io_init(p_io io, p_send send, p_recv recv, p_error error, void *ctx);
+void io_setsendv(p_io io, p_sendv sendv);
 const char *io_strerror(int err);
 
 #endif /* IO_H */
@@ -25,7 +25,15 @@ _M.pump = pump
 local unpack = unpack or table.unpack
 local select = base.select
 
+-- sources and sinks that wrap native objects, so that pump.all can move
+-- data between them without going through Lua strings. each descriptor has
+-- the object, and optionally a length limit, whether the object should be
+-- closed when done, and a splice(from, to) function that moves the data
+local native = base.setmetatable({}, { __mode = "k" })
+_M.native = native
+
 -- 2048 seems to be better in windows...
+-- default chunk size, sources also take their own
 _M.BLOCKSIZE = 2048
 _M._VERSION = "LTN12 1.0.3"
 
@@ -74,6 +82,36 @@ function filter.chain(...)
     end
 end
 
+-- returns a filter that joins small chunks into chunks of at least min bytes,
+-- which are never larger than max unless a single chunk already was
+function filter.coalesce(min, max)
+    min = min or 32*_M.BLOCKSIZE
+    max = max or 4*min
+    if max < min then max = min end
+    local t, n = {}, 0
+    local function take()
+        local out = t[1]
+        if t[2] then out = table.concat(t) end
+        t, n = {}, 0
+        return out
+    end
+    return function(chunk)
+        if chunk and chunk ~= "" then
+            local size = string.len(chunk)
+            if n > 0 and n + size > max then
+                local out = take()
+                t[1], n = chunk, size
+                return out
+            end
+            t[#t+1] = chunk
+            n = n + size
+        end
+        if n >= min or (not chunk and n > 0) then return take()
+        elseif chunk then return ""
+        else return nil end
+    end
+end
+
 -----------------------------------------------------------------------------
 -- Source stuff
 -----------------------------------------------------------------------------
@@ -94,13 +132,16 @@ function source.error(err)
 end
 
 -- creates a file source
-function source.file(handle, io_err)
+function source.file(handle, io_err, size)
     if handle then
-        return function()
-            local chunk = handle:read(_M.BLOCKSIZE)
+        size = size or _M.BLOCKSIZE
+        local src = function()
+            local chunk = handle:read(size)
             if not chunk then handle:close() end
             return chunk
         end
+        native[src] = { object = handle, close = true }
+        return src
     else return source.error(io_err or "unable to open file") end
 end
 
@@ -116,12 +157,13 @@ function source.simplify(src)
 end
 
 -- creates string source
-function source.string(s)
+function source.string(s, size)
     if s then
         local i = 1
+        size = size or _M.BLOCKSIZE
         return function()
-            local chunk = string.sub(s, i, i+_M.BLOCKSIZE-1)
-            i = i + _M.BLOCKSIZE
+            local chunk = string.sub(s, i, i+size-1)
+            i = i + size
             if chunk ~= "" then return chunk
             else return nil end
         end
@@ -235,12 +277,14 @@ end
 -- creates a file sink
 function sink.file(handle, io_err)
     if handle then
-        return function(chunk, err)
+        local snk = function(chunk, err)
             if not chunk then
                 handle:close()
                 return 1
             else return handle:write(chunk) end
         end
+        native[snk] = { object = handle, close = true }
+        return snk
     else return sink.error(io_err or "unable to open file") end
 end
 
@@ -297,6 +341,11 @@ end
 function pump.all(src, snk, step)
     base.assert(src and snk)
     step = step or pump.step
+    if step == pump.step then
+        local from, to = native[src], native[snk]
+        local splice = from and to and (from.splice or to.splice)
+        if splice then return splice(from, to) end
+    end
     while true do
         local ret, err = step(src, snk)
         if not ret then
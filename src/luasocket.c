@@ -34,6 +34,13 @@
 #include "netlink.h"
 #endif
 #include "select.h"
+#include "splice.h"
+#ifdef LUASOCKET_EPOLL
+#include "poller.h"
+#endif
+#ifdef LUASOCKET_RESOLVER
+#include "resolver.h"
+#endif
 
 /*-------------------------------------------------------------------------*\
 * Internal function prototypes
@@ -54,6 +61,13 @@ static const luaL_Reg mod[] = {
     {"tcp", tcp_open},
     {"udp", udp_open},
     {"select", select_open},
+    {"splice", splice_open},
+#ifdef LUASOCKET_EPOLL
+    {"poller", poller_open},
+#endif
+#ifdef LUASOCKET_RESOLVER
+    {"resolver", resolver_open},
+#endif
 #ifdef LUASOCKET_NETLINK
     {"netlink", netlink_open},
 #endif
@@ -28,12 +28,29 @@ static int mime_global_unqp(lua_State *L);
 static int mime_global_qpwrp(lua_State *L);
 static int mime_global_eol(lua_State *L);
 static int mime_global_dot(lua_State *L);
+static int mime_global_b64wrp(lua_State *L);
+static int mime_global_eolqpwrp(lua_State *L);
 
 static size_t dot(int c, size_t state, luaL_Buffer *buffer);
+static int wrpadd(const UC *input, size_t size, int left, int length,
+        luaL_Buffer *buffer);
+static int qpwrpadd(const UC *input, size_t size, int left, int length,
+        luaL_Buffer *buffer);
 static void b64setup(UC *base);
+static void b64widesetup(void);
 static size_t b64encode(UC c, UC *input, size_t size, luaL_Buffer *buffer);
 static size_t b64pad(const UC *input, size_t size, luaL_Buffer *buffer);
 static size_t b64decode(UC c, UC *input, size_t size, luaL_Buffer *buffer);
+static size_t b64encodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer);
+static size_t b64decodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer);
+static void b64encodeto(const UC *input, size_t size, UC *code);
+static int b64wrpstr(const UC *input, size_t isize, UC *atom, size_t *asize,
+        int left, int length, luaL_Buffer *buffer);
+static void b64bulkencode(const UC *input, size_t size, luaL_Buffer *buffer);
+static size_t b64bulkdecode(const UC *input, size_t size,
+        luaL_Buffer *buffer);
 
 static void qpsetup(UC *class, UC *unbase);
 static void qpquote(UC c, luaL_Buffer *buffer);
@@ -41,12 +58,20 @@ static size_t qpdecode(UC c, UC *input, size_t size, luaL_Buffer *buffer);
 static size_t qpencode(UC c, UC *input, size_t size,
         const char *marker, luaL_Buffer *buffer);
 static size_t qppad(UC *input, size_t size, luaL_Buffer *buffer);
+static size_t qpencodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, const char *marker, luaL_Buffer *buffer);
+static size_t qpdecodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer);
+static size_t eolqpwrpstr(const UC *input, size_t size, int last, int *left,
+        int length, luaL_Buffer *buffer);
 
 /* code support functions */
 static luaL_Reg func[] = {
     { "dot", mime_global_dot },
     { "b64", mime_global_b64 },
+    { "b64wrp", mime_global_b64wrp },
     { "eol", mime_global_eol },
+    { "eolqpwrp", mime_global_eolqpwrp },
     { "qp", mime_global_qp },
     { "qpwrp", mime_global_qpwrp },
     { "unb64", mime_global_unb64 },
@@ -62,6 +87,8 @@ static UC qpclass[256];
 static UC qpbase[] = "0123456789ABCDEF";
 static UC qpunbase[256];
 enum {QP_PLAIN, QP_QUOTED, QP_CR, QP_IF_LAST};
+/* printable characters other than '=', left unchanged by unqp and qpwrp */
+#define qptext(c) (qpclass[c] == QP_PLAIN || qpclass[c] == QP_IF_LAST)
 
 /*-------------------------------------------------------------------------*\
 * Base64 globals
@@ -70,6 +97,16 @@ static const UC b64base[] =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static UC b64unbase[256];
 
+/* wide tables for the bulk paths: b64pair maps 12 bits to two output
+ * characters, and b64wide[i] maps the i-th character of a group of four
+ * to its bits in the decoded value, or to B64_INVALID */
+static UC b64pair[4096][2];
+static unsigned long b64wide[4][256];
+#define B64_INVALID 0x1000000UL
+
+/* bytes of input encoded at a time by the bulk path */
+#define B64_BLOCK 3072
+
 /*=========================================================================*\
 * Exported functions
 \*=========================================================================*/
@@ -87,6 +124,7 @@ MIME_API int luaopen_mime_core(lua_State *L)
     /* initialize lookup tables */
     qpsetup(qpclass, qpunbase);
     b64setup(b64unbase);
+    b64widesetup();
     return 1;
 }
 
@@ -105,7 +143,6 @@ static int mime_global_wrp(lua_State *L)
     size_t size = 0;
     int left = (int) luaL_checknumber(L, 1);
     const UC *input = (const UC *) luaL_optlstring(L, 2, NULL, &size);
-    const UC *last = input + size;
     int length = (int) luaL_optnumber(L, 3, 76);
     luaL_Buffer buffer;
     /* end of input black-hole */
@@ -118,28 +155,51 @@ static int mime_global_wrp(lua_State *L)
         return 2;
     }
     luaL_buffinit(L, &buffer);
+    left = wrpadd(input, size, left, length, &buffer);
+    luaL_pushresult(&buffer);
+    lua_pushnumber(L, left);
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* Breaks a string into lines, as wrp does, appending it to the buffer.
+* Returns the new number of bytes left in the current line.
+\*-------------------------------------------------------------------------*/
+static int wrpadd(const UC *input, size_t size, int left, int length,
+        luaL_Buffer *buffer)
+{
+    const UC *last = input + size;
     while (input < last) {
+        /* copy as much of a line as fits at once */
+        if (left > 0 && *input != '\r' && *input != '\n') {
+            const UC *run = input;
+            const UC *stop = (size_t) (last - input) < (size_t) left?
+                last: input + left;
+            while (input < stop && *input != '\r' && *input != '\n') input++;
+            luaL_addlstring(buffer, (const char *) run,
+                (size_t) (input - run));
+            left -= (int) (input - run);
+            continue;
+        }
         switch (*input) {
             case '\r':
                 break;
             case '\n':
-                luaL_addstring(&buffer, CRLF);
+                luaL_addstring(buffer, CRLF);
                 left = length;
                 break;
             default:
                 if (left <= 0) {
                     left = length;
-                    luaL_addstring(&buffer, CRLF);
+                    luaL_addstring(buffer, CRLF);
                 }
-                luaL_addchar(&buffer, *input);
+                luaL_addchar(buffer, *input);
                 left--;
                 break;
         }
         input++;
     }
-    luaL_pushresult(&buffer);
-    lua_pushnumber(L, left);
-    return 2;
+    return left;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -153,6 +213,150 @@ static void b64setup(UC *unbase)
     unbase['='] = 0;
 }
 
+/*-------------------------------------------------------------------------*\
+* Fill wide Base64 tables used by the bulk paths.
+\*-------------------------------------------------------------------------*/
+static void b64widesetup(void)
+{
+    int i, j;
+    for (i = 0; i < 4096; i++) {
+        b64pair[i][0] = b64base[i >> 6];
+        b64pair[i][1] = b64base[i & 0x3f];
+    }
+    for (j = 0; j < 4; j++) {
+        /* padding is left for the byte-by-byte decoder */
+        for (i = 0; i <= 255; i++) b64wide[j][i] = B64_INVALID;
+        for (i = 0; i < 64; i++)
+            b64wide[j][b64base[i]] = (unsigned long) i << (18 - 6*j);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Encodes a number of bytes that is a multiple of 3 into memory.
+\*-------------------------------------------------------------------------*/
+static void b64encodeto(const UC *input, size_t size, UC *code)
+{
+    size_t i;
+    for (i = 0; i < size; i += 3) {
+        unsigned long value = ((unsigned long) input[i] << 16) |
+            ((unsigned long) input[i+1] << 8) | input[i+2];
+        memcpy(code, b64pair[value >> 12], 2);
+        memcpy(code+2, b64pair[value & 0xfff], 2);
+        code += 4;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Encodes a number of bytes that is a multiple of 3, a block at a time,
+* straight into the buffer.
+\*-------------------------------------------------------------------------*/
+static void b64bulkencode(const UC *input, size_t size, luaL_Buffer *buffer)
+{
+    while (size > 0) {
+        size_t n = size < B64_BLOCK? size: B64_BLOCK;
+#if LUA_VERSION_NUM > 501
+        UC *code = (UC *) luaL_prepbuffsize(buffer, n/3*4);
+#else
+        UC code[B64_BLOCK/3*4];
+#endif
+        b64encodeto(input, n, code);
+#if LUA_VERSION_NUM > 501
+        luaL_addsize(buffer, n/3*4);
+#else
+        luaL_addlstring(buffer, (char *) code, n/3*4);
+#endif
+        input += n;
+        size -= n;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Decodes groups of 4 Base64 characters for as long as they are valid and
+* carry no padding, straight into the buffer.
+* Returns the number of bytes used, a multiple of 4.
+\*-------------------------------------------------------------------------*/
+static size_t b64bulkdecode(const UC *input, size_t size,
+        luaL_Buffer *buffer)
+{
+    size_t used = 0;
+    int done = 0;
+    while (!done && size - used >= 4) {
+        size_t n = (size - used)/4;
+        size_t i;
+        UC *out;
+#if LUA_VERSION_NUM > 501
+        UC *decoded;
+        if (n > B64_BLOCK/3) n = B64_BLOCK/3;
+        decoded = (UC *) luaL_prepbuffsize(buffer, 3*n);
+#else
+        UC decoded[B64_BLOCK];
+        if (n > B64_BLOCK/3) n = B64_BLOCK/3;
+#endif
+        out = decoded;
+        for (i = 0; i < n; i++) {
+            const UC *c = input + used;
+            unsigned long value = b64wide[0][c[0]] | b64wide[1][c[1]] |
+                b64wide[2][c[2]] | b64wide[3][c[3]];
+            if (value & B64_INVALID) {
+                done = 1;
+                break;
+            }
+            out[0] = (UC) (value >> 16);
+            out[1] = (UC) (value >> 8);
+            out[2] = (UC) value;
+            out += 3;
+            used += 4;
+        }
+#if LUA_VERSION_NUM > 501
+        luaL_addsize(buffer, (size_t) (out - decoded));
+#else
+        luaL_addlstring(buffer, (char *) decoded, (size_t) (out - decoded));
+#endif
+    }
+    return used;
+}
+
+/*-------------------------------------------------------------------------*\
+* Encodes a string, continuing from the bytes in the atom. Whole groups of
+* 3 bytes go through the bulk path.
+* Returns new number of bytes in the atom.
+\*-------------------------------------------------------------------------*/
+static size_t b64encodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer)
+{
+    const UC *last = input + isize;
+    size_t bulk;
+    /* complete the pending atom first */
+    while (asize > 0 && input < last)
+        asize = b64encode(*input++, atom, asize, buffer);
+    bulk = (size_t) (last - input)/3*3;
+    b64bulkencode(input, bulk, buffer);
+    input += bulk;
+    while (input < last)
+        asize = b64encode(*input++, atom, asize, buffer);
+    return asize;
+}
+
+/*-------------------------------------------------------------------------*\
+* Decodes a string, continuing from the bytes in the atom. Runs of valid
+* groups go through the bulk path. Line breaks, padding, invalid characters
+* and pending atoms are handled one byte at a time.
+* Returns new number of bytes in the atom.
+\*-------------------------------------------------------------------------*/
+static size_t b64decodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer)
+{
+    const UC *last = input + isize;
+    while (input < last) {
+        size_t used = 0;
+        if (asize == 0)
+            used = b64bulkdecode(input, (size_t) (last - input), buffer);
+        if (used > 0) input += used;
+        else asize = b64decode(*input++, atom, asize, buffer);
+    }
+    return asize;
+}
+
 /*-------------------------------------------------------------------------*\
 * Acumulates bytes in input buffer until 3 bytes are available.
 * Translate the 3 bytes into Base64 form and append to buffer.
@@ -253,7 +457,6 @@ static int mime_global_b64(lua_State *L)
     UC atom[3];
     size_t isize = 0, asize = 0;
     const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
-    const UC *last = input + isize;
     luaL_Buffer buffer;
     /* end-of-input blackhole */
     if (!input) {
@@ -265,8 +468,7 @@ static int mime_global_b64(lua_State *L)
     lua_settop(L, 2);
     /* process first part of the input */
     luaL_buffinit(L, &buffer);
-    while (input < last)
-        asize = b64encode(*input++, atom, asize, &buffer);
+    asize = b64encodestr(input, isize, atom, asize, &buffer);
     input = (const UC *) luaL_optlstring(L, 2, NULL, &isize);
     /* if second part is nil, we are done */
     if (!input) {
@@ -280,9 +482,7 @@ static int mime_global_b64(lua_State *L)
         return 2;
     }
     /* otherwise process the second part */
-    last = input + isize;
-    while (input < last)
-        asize = b64encode(*input++, atom, asize, &buffer);
+    asize = b64encodestr(input, isize, atom, asize, &buffer);
     luaL_pushresult(&buffer);
     lua_pushlstring(L, (char *) atom, asize);
     return 2;
@@ -299,7 +499,6 @@ static int mime_global_unb64(lua_State *L)
     UC atom[4];
     size_t isize = 0, asize = 0;
     const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
-    const UC *last = input + isize;
     luaL_Buffer buffer;
     /* end-of-input blackhole */
     if (!input) {
@@ -311,8 +510,7 @@ static int mime_global_unb64(lua_State *L)
     lua_settop(L, 2);
     /* process first part of the input */
     luaL_buffinit(L, &buffer);
-    while (input < last)
-        asize = b64decode(*input++, atom, asize, &buffer);
+    asize = b64decodestr(input, isize, atom, asize, &buffer);
     input = (const UC *) luaL_optlstring(L, 2, NULL, &isize);
     /* if second is nil, we are done */
     if (!input) {
@@ -325,14 +523,101 @@ static int mime_global_unb64(lua_State *L)
         return 2;
     }
     /* otherwise, process the rest of the input */
-    last = input + isize;
-    while (input < last)
-        asize = b64decode(*input++, atom, asize, &buffer);
+    asize = b64decodestr(input, isize, atom, asize, &buffer);
     luaL_pushresult(&buffer);
     lua_pushlstring(L, (char *) atom, asize);
     return 2;
 }
 
+/*-------------------------------------------------------------------------*\
+* Encodes a string in Base64 and breaks it into lines, continuing from the
+* bytes in the atom. Returns the new number of bytes left in the current
+* line.
+\*-------------------------------------------------------------------------*/
+static int b64wrpstr(const UC *input, size_t isize, UC *atom, size_t *asize,
+        int left, int length, luaL_Buffer *buffer)
+{
+    UC code[B64_BLOCK/3*4];
+    const UC *last = input + isize;
+    size_t n = *asize;
+    /* complete the pending atom first */
+    while (n > 0 && n < 3 && input < last) atom[n++] = *input++;
+    if (n == 3) {
+        b64encodeto(atom, 3, code);
+        left = wrpadd(code, 4, left, length, buffer);
+        n = 0;
+    }
+    while (n == 0 && (size_t) (last - input) >= 3) {
+        size_t bulk = (size_t) (last - input)/3*3;
+        if (bulk > B64_BLOCK) bulk = B64_BLOCK;
+        b64encodeto(input, bulk, code);
+        left = wrpadd(code, bulk/3*4, left, length, buffer);
+        input += bulk;
+    }
+    while (input < last) atom[n++] = *input++;
+    *asize = n;
+    return left;
+}
+
+/*-------------------------------------------------------------------------*\
+* Incrementally encodes a string in Base64 and breaks it into lines, in a
+* single pass. Same as b64 followed by wrp.
+* A, B, m = b64wrp(C, D, n, length)
+* A is the encoded and wrapped version of the largest prefix of C .. D
+* that can be encoded unambiguously. B has the remaining bytes of C .. D,
+* *without* encoding. 'n' is how many bytes are left for the first line
+* of A, and 'm' is the number of bytes left in its last line. If D is nil,
+* A is padded and its last line terminated.
+\*-------------------------------------------------------------------------*/
+static int mime_global_b64wrp(lua_State *L)
+{
+    UC atom[3];
+    size_t isize = 0, asize = 0;
+    const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
+    int length = (int) luaL_optnumber(L, 4, 76);
+    int left = (int) luaL_optnumber(L, 3, length);
+    luaL_Buffer buffer;
+    /* end-of-input blackhole */
+    if (!input) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushnumber(L, left);
+        return 3;
+    }
+    /* make sure we don't confuse buffer stuff with arguments */
+    lua_settop(L, 4);
+    /* process first part of the input */
+    luaL_buffinit(L, &buffer);
+    left = b64wrpstr(input, isize, atom, &asize, left, length, &buffer);
+    input = (const UC *) luaL_optlstring(L, 2, NULL, &isize);
+    /* if second part is nil, we are done */
+    if (!input) {
+        size_t osize = 0;
+        if (asize > 0) {
+            UC code[4];
+            memset(atom + asize, 0, 3 - asize);
+            b64encodeto(atom, 3, code);
+            if (asize == 1) code[2] = '=';
+            code[3] = '=';
+            left = wrpadd(code, 4, left, length, &buffer);
+        }
+        if (left < length) luaL_addstring(&buffer, CRLF);
+        luaL_pushresult(&buffer);
+        /* if the output is empty  and the input is nil, return nil */
+        lua_tolstring(L, -1, &osize);
+        if (osize == 0) lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushnumber(L, length);
+        return 3;
+    }
+    /* otherwise process the second part */
+    left = b64wrpstr(input, isize, atom, &asize, left, length, &buffer);
+    luaL_pushresult(&buffer);
+    lua_pushlstring(L, (char *) atom, asize);
+    lua_pushnumber(L, left);
+    return 3;
+}
+
 /*-------------------------------------------------------------------------*\
 * Quoted-printable encoding scheme
 * all (except CRLF in text) can be =XX
@@ -423,6 +708,37 @@ static size_t qpencode(UC c, UC *input, size_t size,
     return 0;
 }
 
+/*-------------------------------------------------------------------------*\
+* Encodes a string, continuing from the characters in the atom. Whenever
+* the atom is empty, runs of characters that need no quoting are copied
+* at once. Spaces and tabs join the run unless they might end a line.
+* Returns new number of characters in the atom.
+\*-------------------------------------------------------------------------*/
+static size_t qpencodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, const char *marker, luaL_Buffer *buffer)
+{
+    const UC *last = input + isize;
+    while (input < last) {
+        if (asize == 0) {
+            const UC *run = input;
+            while (input < last) {
+                UC cl = qpclass[*input];
+                if (cl == QP_IF_LAST && last - input > 2 &&
+                        !(input[1] == '\r' && input[2] == '\n')) input++;
+                else if (cl == QP_PLAIN) input++;
+                else break;
+            }
+            if (input > run) {
+                luaL_addlstring(buffer, (const char *) run,
+                    (size_t) (input - run));
+                continue;
+            }
+        }
+        asize = qpencode(*input++, atom, asize, marker, buffer);
+    }
+    return asize;
+}
+
 /*-------------------------------------------------------------------------*\
 * Deal with the final characters
 \*-------------------------------------------------------------------------*/
@@ -451,7 +767,6 @@ static int mime_global_qp(lua_State *L)
     size_t asize = 0, isize = 0;
     UC atom[3];
     const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
-    const UC *last = input + isize;
     const char *marker = luaL_optstring(L, 3, CRLF);
     luaL_Buffer buffer;
     /* end-of-input blackhole */
@@ -464,8 +779,7 @@ static int mime_global_qp(lua_State *L)
     lua_settop(L, 3);
     /* process first part of input */
     luaL_buffinit(L, &buffer);
-    while (input < last)
-        asize = qpencode(*input++, atom, asize, marker, &buffer);
+    asize = qpencodestr(input, isize, atom, asize, marker, &buffer);
     input = (const UC *) luaL_optlstring(L, 2, NULL, &isize);
     /* if second part is nil, we are done */
     if (!input) {
@@ -476,9 +790,7 @@ static int mime_global_qp(lua_State *L)
         return 2;
     }
     /* otherwise process rest of input */
-    last = input + isize;
-    while (input < last)
-        asize = qpencode(*input++, atom, asize, marker, &buffer);
+    asize = qpencodestr(input, isize, atom, asize, marker, &buffer);
     luaL_pushresult(&buffer);
     lua_pushlstring(L, (char *) atom, asize);
     return 2;
@@ -515,6 +827,28 @@ static size_t qpdecode(UC c, UC *input, size_t size, luaL_Buffer *buffer) {
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Decodes a string, continuing from the characters in the atom. Whenever
+* the atom is empty, runs of plain text are copied at once.
+* Returns new number of characters in the atom.
+\*-------------------------------------------------------------------------*/
+static size_t qpdecodestr(const UC *input, size_t isize, UC *atom,
+        size_t asize, luaL_Buffer *buffer)
+{
+    const UC *last = input + isize;
+    while (input < last) {
+        if (asize == 0 && qptext(*input)) {
+            const UC *run = input;
+            while (input < last && qptext(*input)) input++;
+            luaL_addlstring(buffer, (const char *) run,
+                (size_t) (input - run));
+            continue;
+        }
+        asize = qpdecode(*input++, atom, asize, buffer);
+    }
+    return asize;
+}
+
 /*-------------------------------------------------------------------------*\
 * Incrementally decodes a string in quoted-printable
 * A, B = qp(C, D)
@@ -527,7 +861,6 @@ static int mime_global_unqp(lua_State *L)
     size_t asize = 0, isize = 0;
     UC atom[3];
     const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
-    const UC *last = input + isize;
     luaL_Buffer buffer;
     /* end-of-input blackhole */
     if (!input) {
@@ -539,8 +872,7 @@ static int mime_global_unqp(lua_State *L)
     lua_settop(L, 2);
     /* process first part of input */
     luaL_buffinit(L, &buffer);
-    while (input < last)
-        asize = qpdecode(*input++, atom, asize, &buffer);
+    asize = qpdecodestr(input, isize, atom, asize, &buffer);
     input = (const UC *) luaL_optlstring(L, 2, NULL, &isize);
     /* if second part is nil, we are done */
     if (!input) {
@@ -550,9 +882,7 @@ static int mime_global_unqp(lua_State *L)
         return 2;
     }
     /* otherwise process rest of input */
-    last = input + isize;
-    while (input < last)
-        asize = qpdecode(*input++, atom, asize, &buffer);
+    asize = qpdecodestr(input, isize, atom, asize, &buffer);
     luaL_pushresult(&buffer);
     lua_pushlstring(L, (char *) atom, asize);
     return 2;
@@ -572,7 +902,6 @@ static int mime_global_qpwrp(lua_State *L)
     size_t size = 0;
     int left = (int) luaL_checknumber(L, 1);
     const UC *input = (const UC *) luaL_optlstring(L, 2, NULL, &size);
-    const UC *last = input + size;
     int length = (int) luaL_optnumber(L, 3, 76);
     luaL_Buffer buffer;
     /* end-of-input blackhole */
@@ -584,36 +913,60 @@ static int mime_global_qpwrp(lua_State *L)
     }
     /* process all input */
     luaL_buffinit(L, &buffer);
+    left = qpwrpadd(input, size, left, length, &buffer);
+    luaL_pushresult(&buffer);
+    lua_pushnumber(L, left);
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* Breaks a quoted-printable string into lines, as qpwrp does, appending it
+* to the buffer.
+* Returns the new number of bytes left in the current line.
+\*-------------------------------------------------------------------------*/
+static int qpwrpadd(const UC *input, size_t size, int left, int length,
+        luaL_Buffer *buffer)
+{
+    const UC *last = input + size;
     while (input < last) {
+        /* copy as much plain text as fits in the current line */
+        if (left > 1 && qptext(*input)) {
+            const UC *run = input;
+            const UC *stop = (size_t) (last - input) < (size_t) (left - 1)?
+                last: input + (left - 1);
+            while (input < stop && qptext(*input)) input++;
+            luaL_addlstring(buffer, (const char *) run,
+                (size_t) (input - run));
+            left -= (int) (input - run);
+            continue;
+        }
         switch (*input) {
             case '\r':
                 break;
             case '\n':
                 left = length;
-                luaL_addstring(&buffer, CRLF);
+                luaL_addstring(buffer, CRLF);
                 break;
             case '=':
                 if (left <= 3) {
                     left = length;
-                    luaL_addstring(&buffer, EQCRLF);
+                    luaL_addstring(buffer, EQCRLF);
                 }
-                luaL_addchar(&buffer, *input);
+                luaL_addchar(buffer, *input);
                 left--;
                 break;
             default:
                 if (left <= 1) {
                     left = length;
-                    luaL_addstring(&buffer, EQCRLF);
+                    luaL_addstring(buffer, EQCRLF);
                 }
-                luaL_addchar(&buffer, *input);
+                luaL_addchar(buffer, *input);
                 left--;
                 break;
         }
         input++;
     }
-    luaL_pushresult(&buffer);
-    lua_pushnumber(L, left);
-    return 2;
+    return left;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -675,6 +1028,115 @@ static int mime_global_eol(lua_State *L)
     return 2;
 }
 
+/*-------------------------------------------------------------------------*\
+* Normalizes end-of-line markers to CRLF, encodes in quoted-printable and
+* breaks into lines, with the same result as eol, qp and qpwrp in sequence.
+* Spaces and tabs are quoted when followed by a line break or when they
+* are among the last two characters of the input, which then gets a soft
+* line break. If this is not the last part, stops at the first character
+* whose encoding depends on what follows.
+* Returns the number of characters used.
+\*-------------------------------------------------------------------------*/
+static size_t eolqpwrpstr(const UC *input, size_t size, int last, int *left,
+        int length, luaL_Buffer *buffer)
+{
+    size_t i = 0;
+    int pad = 0;
+    while (i < size) {
+        UC c = input[i];
+        if (qpclass[c] == QP_PLAIN) {
+            /* spaces and tabs that can't end a line go with the run */
+            size_t j = i + 1;
+            while (j < size && (qpclass[input[j]] == QP_PLAIN ||
+                    (qpclass[input[j]] == QP_IF_LAST && j + 2 < size &&
+                        !eolcandidate(input[j+1])))) j++;
+            *left = qpwrpadd(input + i, j - i, *left, length, buffer);
+            i = j;
+        } else if (eolcandidate(c)) {
+            /* \r\n and \n\r are one break, \r\r and \n\n are two */
+            size_t n = 1;
+            if (i + 1 < size) {
+                if (eolcandidate(input[i+1])) n = 2;
+            } else if (!last) break;
+            *left = qpwrpadd((const UC *) CRLF, 2, *left, length, buffer);
+            if (n == 2 && input[i+1] == c)
+                *left = qpwrpadd((const UC *) CRLF, 2, *left, length, buffer);
+            i += n;
+        } else {
+            UC quoted[3];
+            if (qpclass[c] == QP_IF_LAST) {
+                if (i + 1 < size && eolcandidate(input[i+1])) {
+                    /* quoted, because it ends a line */
+                } else if (i + 2 < size) {
+                    *left = qpwrpadd(&c, 1, *left, length, buffer);
+                    i++;
+                    continue;
+                } else if (!last) break;
+                else pad = 1;
+            }
+            quoted[0] = '=';
+            quoted[1] = qpbase[c >> 4];
+            quoted[2] = qpbase[c & 0x0F];
+            *left = qpwrpadd(quoted, 3, *left, length, buffer);
+            i++;
+        }
+    }
+    if (pad) *left = qpwrpadd((const UC *) EQCRLF, 3, *left, length, buffer);
+    return i;
+}
+
+/*-------------------------------------------------------------------------*\
+* Incrementally converts a text to canonical quoted-printable in a single
+* pass. Same as eol, qp and qpwrp in sequence, with CRLF markers.
+* A, B, m = eolqpwrp(C, D, n, length)
+* A is the converted version of the largest prefix of C .. D that can be
+* converted unambiguously. B has the remaining bytes of C .. D, *without*
+* conversion. 'n' is how many bytes are left for the first line of A, and
+* 'm' is the number of bytes left in its last line. If D is nil, the
+* conversion is completed.
+\*-------------------------------------------------------------------------*/
+static int mime_global_eolqpwrp(lua_State *L)
+{
+    size_t isize = 0, used = 0;
+    const UC *input = (const UC *) luaL_optlstring(L, 1, NULL, &isize);
+    int length = (int) luaL_optnumber(L, 4, 76);
+    int left = (int) luaL_optnumber(L, 3, length);
+    int last = lua_isnoneornil(L, 2);
+    luaL_Buffer buffer;
+    /* end-of-input blackhole */
+    if (!input) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushnumber(L, left);
+        return 3;
+    }
+    /* decisions look ahead across both parts, so join them */
+    if (!last) {
+        luaL_checkstring(L, 2);
+        lua_settop(L, 2);
+        lua_concat(L, 2);
+        input = (const UC *) lua_tolstring(L, 1, &isize);
+    } else lua_settop(L, 1);
+    luaL_buffinit(L, &buffer);
+    used = eolqpwrpstr(input, isize, last, &left, length, &buffer);
+    /* if second part is nil, we are done */
+    if (last) {
+        size_t osize = 0;
+        if (left < length) luaL_addstring(&buffer, EQCRLF);
+        luaL_pushresult(&buffer);
+        /* if the output is empty  and the input is nil, return nil */
+        lua_tolstring(L, -1, &osize);
+        if (osize == 0) lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushnumber(L, length);
+        return 3;
+    }
+    luaL_pushresult(&buffer);
+    lua_pushlstring(L, (const char *) input + used, isize - used);
+    lua_pushnumber(L, left);
+    return 3;
+}
+
 /*-------------------------------------------------------------------------*\
 * Takes one byte and stuff it if needed.
 \*-------------------------------------------------------------------------*/
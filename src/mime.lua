@@ -82,6 +82,27 @@ function _M.normalize(marker)
     return ltn12.filter.cycle(_M.eol, 0, marker)
 end
 
+-- single pass filters, equivalent to chaining encode("base64") and
+-- wrap("base64"), or normalize(), encode("quoted-printable") and
+-- wrap("quoted-printable")
+local function fused(low, length)
+    length = length or 76
+    local rest, left = "", length
+    return function(chunk)
+        local ret
+        ret, rest, left = low(rest, chunk, left, length)
+        return ret
+    end
+end
+
+function _M.b64wrap(length)
+    return fused(_M.b64wrp, length)
+end
+
+function _M.eolqpwrap(length)
+    return fused(_M.eolqpwrp, length)
+end
+
 -- high level stuffing filter
 function _M.stuff()
     return ltn12.filter.cycle(_M.dot, 2)
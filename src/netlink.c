@@ -438,7 +438,6 @@ static int global_create(lua_State *L) {
         /* set its type as master object */
         auxiliar_setclass(L, "netlink{unconnected}", -1);
         /* initialize remaining structure fields */
-        socket_setnonblocking(&sock);
         nl->fd = sock;
         nl->type = SOCK_RAW;
         timeout_init(&nl->tm, -1, -1);
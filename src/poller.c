@@ -0,0 +1,553 @@
+/*=========================================================================*\
+* Persistent poller object
+* LuaSocket toolkit
+\*=========================================================================*/
+#include <string.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "compat.h"
+
+#include "auxiliar.h"
+#include "socket.h"
+#include "tcp.h"
+#include "poller.h"
+
+#ifdef LUASOCKET_EPOLL
+#include <sys/epoll.h>
+
+/* interest flags */
+#define POLLER_R 1
+#define POLLER_W 2
+
+/* maximum number of kernel events collected by each call to wait */
+#define POLLER_MAXEVENTS 256
+
+/* per descriptor registration */
+typedef struct t_pollslot_ {
+    int events;             /* interest flags, 0 if slot is unused */
+    p_buffer buf;           /* input buffer of known buffered objects */
+    int luadirty;           /* object must be asked through its dirty() */
+    int dirtyidx;           /* position in the dirty list, plus one */
+    unsigned int stamp;     /* last wait in which the slot was reported */
+} t_pollslot;
+
+/* poller control structure */
+typedef struct t_poller_ {
+    int epfd;               /* epoll descriptor */
+    int ref;                /* registry reference to fd <-> object table */
+    t_pollslot *slots;      /* registrations, indexed by descriptor */
+    int nslots;             /* number of allocated slots */
+    int count;              /* number of registered objects */
+    int *dirty;             /* descriptors that may have buffered data */
+    int ndirty;             /* number of entries in the dirty list */
+    int dirtycap;           /* number of allocated entries */
+    unsigned int stamp;     /* incremented at each wait */
+    struct epoll_event events[POLLER_MAXEVENTS];
+} t_poller;
+typedef t_poller *p_poller;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_add(lua_State *L);
+static int meth_modify(lua_State *L);
+static int meth_remove(lua_State *L);
+static int meth_wait(lua_State *L);
+static int meth_count(lua_State *L);
+static int meth_getfd(lua_State *L);
+static int meth_close(lua_State *L);
+
+/* poller object methods */
+static luaL_Reg poller_methods[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"add",         meth_add},
+    {"close",       meth_close},
+    {"count",       meth_count},
+    {"getfd",       meth_getfd},
+    {"modify",      meth_modify},
+    {"remove",      meth_remove},
+    {"wait",        meth_wait},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"poller", global_create},
+    {NULL,     NULL}
+};
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int poller_open(lua_State *L) {
+    auxiliar_newclass(L, "poller{}", poller_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Asks object at stack index idx for its descriptor
+\*-------------------------------------------------------------------------*/
+static t_socket getfd(lua_State *L, int idx) {
+    t_socket fd = SOCKET_INVALID;
+    lua_pushstring(L, "getfd");
+    lua_gettable(L, idx);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 1);
+        if (lua_isnumber(L, -1)) {
+            double numfd = lua_tonumber(L, -1);
+            fd = (numfd >= 0.0)? (t_socket) numfd: SOCKET_INVALID;
+        }
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+/*-------------------------------------------------------------------------*\
+* Asks object at stack index idx if it has buffered data
+\*-------------------------------------------------------------------------*/
+static int dirty(lua_State *L, int idx) {
+    int is = 0;
+    lua_pushstring(L, "dirty");
+    lua_gettable(L, idx);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 1);
+        is = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+    return is;
+}
+
+/*-------------------------------------------------------------------------*\
+* Translates interest string ("r", "w" or "rw") into flags
+\*-------------------------------------------------------------------------*/
+static int checkevents(lua_State *L, int narg) {
+    const char *s = luaL_optstring(L, narg, "r");
+    int events = 0;
+    for ( ; *s; s++) {
+        if (*s == 'r') events |= POLLER_R;
+        else if (*s == 'w') events |= POLLER_W;
+        else luaL_argerror(L, narg, "invalid event mode");
+    }
+    luaL_argcheck(L, events != 0, narg, "invalid event mode");
+    return events;
+}
+
+static unsigned int toepoll(int events) {
+    unsigned int ev = 0;
+    if (events & POLLER_R) ev |= EPOLLIN;
+    if (events & POLLER_W) ev |= EPOLLOUT;
+    return ev;
+}
+
+/*-------------------------------------------------------------------------*\
+* Makes sure there is a slot for descriptor fd
+\*-------------------------------------------------------------------------*/
+static int growslots(p_poller poller, int fd) {
+    int n = poller->nslots > 0? poller->nslots: 64;
+    t_pollslot *slots;
+    if (fd < poller->nslots) return 1;
+    while (n <= fd) n *= 2;
+    slots = (t_pollslot *) realloc(poller->slots, n*sizeof(t_pollslot));
+    if (!slots) return 0;
+    memset(slots + poller->nslots, 0,
+        (n - poller->nslots)*sizeof(t_pollslot));
+    poller->slots = slots;
+    poller->nslots = n;
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Adds descriptor fd to the list of registrations that may have buffered
+* data, so that wait only looks at those instead of every slot
+\*-------------------------------------------------------------------------*/
+static int adddirty(p_poller poller, int fd) {
+    if (poller->ndirty == poller->dirtycap) {
+        int n = poller->dirtycap > 0? 2*poller->dirtycap: 16;
+        int *dirty = (int *) realloc(poller->dirty, n*sizeof(int));
+        if (!dirty) return 0;
+        poller->dirty = dirty;
+        poller->dirtycap = n;
+    }
+    poller->dirty[poller->ndirty++] = fd;
+    poller->slots[fd].dirtyidx = poller->ndirty;
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Removes descriptor fd from the dirty list, moving the last entry into
+* its place
+\*-------------------------------------------------------------------------*/
+static void removedirty(p_poller poller, int fd) {
+    int i = poller->slots[fd].dirtyidx - 1;
+    int last = poller->dirty[--poller->ndirty];
+    poller->dirty[i] = last;
+    poller->slots[last].dirtyidx = i + 1;
+    poller->slots[fd].dirtyidx = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Forgets about the registration in slot fd, keeping the object table
+* (at stack index tab) in sync
+\*-------------------------------------------------------------------------*/
+static void dropslot(lua_State *L, p_poller poller, int tab, int fd) {
+    t_pollslot *slot = &poller->slots[fd];
+    if (!slot->events) return;
+    if (slot->dirtyidx) removedirty(poller, fd);
+    memset(slot, 0, sizeof(t_pollslot));
+    poller->count--;
+    lua_rawgeti(L, tab, fd);
+    lua_pushnil(L);
+    lua_rawset(L, tab);
+    lua_pushnil(L);
+    lua_rawseti(L, tab, fd);
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes object table and returns its stack index
+\*-------------------------------------------------------------------------*/
+static int pushtable(lua_State *L, p_poller poller) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, poller->ref);
+    return lua_gettop(L);
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the poller in argument 1, making sure it has not been closed
+\*-------------------------------------------------------------------------*/
+static p_poller checkpoller(lua_State *L) {
+    p_poller poller = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    if (poller->epfd < 0) luaL_argerror(L, 1, "poller is closed");
+    return poller;
+}
+
+/*-------------------------------------------------------------------------*\
+* Checks that slot fd is still registered for reading by the object at
+* stack index obj, after Lua code has had a chance to run
+\*-------------------------------------------------------------------------*/
+static int stillreading(lua_State *L, p_poller poller, int tab, int fd,
+        int obj) {
+    int same;
+    if (poller->epfd < 0 || fd >= poller->nslots ||
+            !(poller->slots[fd].events & POLLER_R))
+        return 0;
+    lua_rawgeti(L, tab, fd);
+    same = lua_rawequal(L, -1, obj);
+    lua_pop(L, 1);
+    return same;
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends object at stack index obj to the array+set result at tab
+\*-------------------------------------------------------------------------*/
+static void append(lua_State *L, int tab, int obj, int *n) {
+    ++*n;
+    lua_pushvalue(L, obj);
+    lua_rawseti(L, tab, *n);
+    lua_pushvalue(L, obj);
+    lua_pushinteger(L, *n);
+    lua_rawset(L, tab);
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Registers an object for the given events
+\*-------------------------------------------------------------------------*/
+static int meth_add(lua_State *L) {
+    p_poller poller = checkpoller(L);
+    int events = checkevents(L, 3);
+    struct epoll_event ev;
+    t_pollslot *slot;
+    t_socket fd;
+    int tab;
+    luaL_checkany(L, 2);
+    fd = getfd(L, 2);
+    if (fd == SOCKET_INVALID) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid descriptor");
+        return 2;
+    }
+    if (!growslots(poller, fd)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return 2;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toepoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, errno == EEXIST? "already registered":
+            socket_strerror(errno));
+        return 2;
+    }
+    tab = pushtable(L, poller);
+    /* the kernel forgets descriptors when they are closed, so a stale
+     * registration might still be sitting in our slot */
+    dropslot(L, poller, tab, fd);
+    /* the object itself might be registered under a descriptor it no
+     * longer owns */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, tab);
+    if (!lua_isnil(L, -1)) {
+        int old = (int) lua_tonumber(L, -1);
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, old, &ev);
+        if (old >= 0 && old < poller->nslots) dropslot(L, poller, tab, old);
+    }
+    lua_pop(L, 1);
+    slot = &poller->slots[fd];
+    slot->events = events;
+    slot->stamp = poller->stamp;
+    if (auxiliar_getgroupudata(L, "tcp{any}", 2)) {
+        p_tcp tcp = (p_tcp) lua_touserdata(L, 2);
+        slot->buf = &tcp->buf;
+    } else if (!auxiliar_getgroupudata(L, "udp{any}", 2)) {
+        lua_pushstring(L, "dirty");
+        lua_gettable(L, 2);
+        slot->luadirty = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+    }
+    if ((slot->buf || slot->luadirty) && !adddirty(poller, fd)) {
+        memset(slot, 0, sizeof(t_pollslot));
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, &ev);
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return 2;
+    }
+    poller->count++;
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, tab, fd);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, fd);
+    lua_rawset(L, tab);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Changes the events an object is registered for
+\*-------------------------------------------------------------------------*/
+static int meth_modify(lua_State *L) {
+    p_poller poller = checkpoller(L);
+    int events = checkevents(L, 3);
+    int tab = pushtable(L, poller);
+    struct epoll_event ev;
+    int fd;
+    luaL_checkany(L, 2);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, tab);
+    if (lua_isnil(L, -1)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not registered");
+        return 2;
+    }
+    fd = (int) lua_tonumber(L, -1);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toepoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        int err = errno;
+        /* descriptor was closed behind our back */
+        if (err == ENOENT || err == EBADF) dropslot(L, poller, tab, fd);
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    poller->slots[fd].events = events;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Unregisters an object
+\*-------------------------------------------------------------------------*/
+static int meth_remove(lua_State *L) {
+    p_poller poller = checkpoller(L);
+    int tab = pushtable(L, poller);
+    struct epoll_event ev;
+    int fd;
+    luaL_checkany(L, 2);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, tab);
+    if (lua_isnil(L, -1)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not registered");
+        return 2;
+    }
+    fd = (int) lua_tonumber(L, -1);
+    /* closed descriptors have already left the epoll set, so errors
+     * here are of no interest. ev is needed by kernels before 2.6.9 */
+    memset(&ev, 0, sizeof(ev));
+    epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, &ev);
+    dropslot(L, poller, tab, fd);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits until registered objects are ready or timeout.
+* Returns the readable and writable objects in the same format as select.
+\*-------------------------------------------------------------------------*/
+static int meth_wait(lua_State *L) {
+    p_poller poller = checkpoller(L);
+    double t = luaL_optnumber(L, 2, -1);
+    int tab, rtab, wtab, obj;
+    int nr = 0, nw = 0, ret, i, ndirty;
+    int *dirtyfds = NULL;
+    unsigned int stamp;
+    t_timeout tm;
+    lua_settop(L, 2);
+    tab = pushtable(L, poller);
+    lua_newtable(L); rtab = lua_gettop(L);
+    lua_newtable(L); wtab = lua_gettop(L);
+    stamp = ++poller->stamp;
+    /* buffered data counts as readable, and no waiting is needed. only
+     * the registrations that can hold buffered data are looked at. dirty()
+     * methods can add, remove or close, so we go over a copy of the list
+     * and look the slot up again after each call */
+    ndirty = poller->ndirty;
+    if (ndirty > 0) {
+        dirtyfds = (int *) lua_newuserdata(L, ndirty*sizeof(int));
+        memcpy(dirtyfds, poller->dirty, ndirty*sizeof(int));
+    }
+    for (i = 0; i < ndirty && poller->epfd >= 0; i++) {
+        int fd = dirtyfds[i];
+        int is;
+        if (fd >= poller->nslots || !(poller->slots[fd].events & POLLER_R))
+            continue;
+        lua_rawgeti(L, tab, fd);
+        obj = lua_gettop(L);
+        if (poller->slots[fd].buf) is = !buffer_isempty(poller->slots[fd].buf);
+        else is = dirty(L, obj) && stillreading(L, poller, tab, fd, obj);
+        if (is) {
+            append(L, rtab, obj, &nr);
+            poller->slots[fd].stamp = stamp;
+        }
+        lua_pop(L, 1);
+    }
+    if (dirtyfds) lua_pop(L, 1);
+    if (poller->epfd < 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 3;
+    }
+    timeout_init(&tm, nr > 0? 0.0: t, -1);
+    timeout_markstart(&tm);
+    do {
+        double left = timeout_getretry(&tm);
+        int ms = left >= 0.0? (int) (left*1.0e3): -1;
+        ret = epoll_wait(poller->epfd, poller->events, POLLER_MAXEVENTS, ms);
+    } while (ret < 0 && errno == EINTR);
+    timeout_refresh();
+    if (ret < 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(errno));
+        return 3;
+    }
+    for (i = 0; i < ret; i++) {
+        int fd = poller->events[i].data.fd;
+        unsigned int ev = poller->events[i].events;
+        t_pollslot *slot;
+        if (fd < 0 || fd >= poller->nslots) continue;
+        slot = &poller->slots[fd];
+        if (!slot->events) continue;
+        lua_rawgeti(L, tab, fd);
+        obj = lua_gettop(L);
+        if ((slot->events & POLLER_R) && slot->stamp != stamp &&
+                (ev & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+            append(L, rtab, obj, &nr);
+        if ((slot->events & POLLER_W) && (ev & (EPOLLOUT|EPOLLHUP|EPOLLERR)))
+            append(L, wtab, obj, &nw);
+        lua_pop(L, 1);
+    }
+    if (nr > 0 || nw > 0) return 2;
+    lua_pushliteral(L, "timeout");
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the number of registered objects
+\*-------------------------------------------------------------------------*/
+static int meth_count(lua_State *L) {
+    p_poller poller = checkpoller(L);
+    lua_pushinteger(L, poller->count);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Select support methods (pollers can themselves be waited on)
+\*-------------------------------------------------------------------------*/
+static int meth_getfd(lua_State *L) {
+    p_poller poller = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    lua_pushnumber(L, poller->epfd);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the kernel object and all registrations
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_poller poller = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    if (poller->epfd >= 0) {
+        close(poller->epfd);
+        poller->epfd = -1;
+    }
+    if (poller->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, poller->ref);
+        poller->ref = LUA_NOREF;
+    }
+    free(poller->slots);
+    poller->slots = NULL;
+    free(poller->dirty);
+    poller->dirty = NULL;
+    poller->nslots = poller->count = 0;
+    poller->ndirty = poller->dirtycap = 0;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a new poller object
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    p_poller poller = (p_poller) lua_newuserdata(L, sizeof(t_poller));
+    memset(poller, 0, sizeof(t_poller));
+    poller->ref = LUA_NOREF;
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(errno));
+        return 2;
+    }
+    auxiliar_setclass(L, "poller{}", -1);
+    lua_newtable(L);
+    poller->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+#else /* LUASOCKET_EPOLL */
+
+int poller_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+
+#endif /* LUASOCKET_EPOLL */
@@ -0,0 +1,20 @@
+#ifndef POLLER_H
+#define POLLER_H
+/*=========================================================================*\
+* Persistent poller object
+* LuaSocket toolkit
+*
+* The poller keeps its registrations in the kernel (through epoll), so that
+* waiting costs time proportional to the number of ready objects, instead of
+* the number of objects being watched, as is the case with select.
+*
+* Objects are registered with the same protocol used by select: they must
+* export a getfd() method, and buffered objects are considered readable
+* while dirty() returns true. The descriptor is queried only once, when the
+* object is added. Buffers of tcp objects are checked directly in C.
+\*=========================================================================*/
+#include "lua.h"
+
+int poller_open(lua_State *L);
+
+#endif /* POLLER_H */
@@ -0,0 +1,466 @@
+/*=========================================================================*\
+* Asynchronous name resolution
+* LuaSocket toolkit
+\*=========================================================================*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* needed for pipe2 and dladdr */
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "compat.h"
+
+#include "auxiliar.h"
+#include "socket.h"
+#include "inet.h"
+#include "resolver.h"
+
+#ifdef LUASOCKET_RESOLVER
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+/* default and largest number of worker threads */
+#define RESOLVER_WORKERS 4
+#define RESOLVER_MAXWORKERS 64
+
+/* kinds of lookup */
+#define LOOKUP_ADDR 0           /* host name to addresses */
+#define LOOKUP_NAME 1           /* address to host name */
+
+/* one lookup, from submission until its result is collected */
+typedef struct t_lookup_ {
+    struct t_lookup_ *next;
+    lua_Number id;              /* identifies the lookup to the caller */
+    int kind;
+    char *host;                 /* name to look up */
+    int family;                 /* family wanted for the addresses */
+    t_sockaddr_storage addr;    /* address to look up */
+    socklen_t addr_len;
+    int err;                    /* getaddrinfo or getnameinfo error code */
+    struct addrinfo *resolved;  /* addresses found */
+    char name[NI_MAXHOST];      /* name found */
+} t_lookup;
+typedef t_lookup *p_lookup;
+
+/* state shared with the workers, which may outlive the resolver object */
+typedef struct t_pool_ {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    p_lookup queue, *queuetail; /* lookups waiting for a worker */
+    p_lookup done, *donetail;   /* finished lookups not collected yet */
+    int fd[2];                  /* readable while done is not empty */
+    int refs;                   /* running workers, plus the object */
+    int closed;
+} t_pool;
+typedef t_pool *p_pool;
+
+/* resolver control structure */
+typedef struct t_resolver_ {
+    p_pool pool;                /* NULL once closed */
+    lua_Number lastid;
+    int pending;                /* lookups submitted and not collected */
+} t_resolver;
+typedef t_resolver *p_resolver;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_getaddrinfo(lua_State *L);
+static int meth_getnameinfo(lua_State *L);
+static int meth_results(lua_State *L);
+static int meth_pending(lua_State *L);
+static int meth_getfd(lua_State *L);
+static int meth_dirty(lua_State *L);
+static int meth_close(lua_State *L);
+
+/* resolver object methods */
+static luaL_Reg resolver_methods[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"close",       meth_close},
+    {"dirty",       meth_dirty},
+    {"getaddrinfo", meth_getaddrinfo},
+    {"getfd",       meth_getfd},
+    {"getnameinfo", meth_getnameinfo},
+    {"pending",     meth_pending},
+    {"results",     meth_results},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"resolver", global_create},
+    {NULL,       NULL}
+};
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int resolver_open(lua_State *L) {
+    auxiliar_newclass(L, "resolver{}", resolver_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static void freelookups(p_lookup lookup) {
+    while (lookup) {
+        p_lookup next = lookup->next;
+        if (lookup->resolved) freeaddrinfo(lookup->resolved);
+        free(lookup->host);
+        free(lookup);
+        lookup = next;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Drops a reference to the pool, which must be locked, and frees it when
+* nobody is left
+\*-------------------------------------------------------------------------*/
+static void release(p_pool pool) {
+    int last = --pool->refs == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (!last) return;
+    freelookups(pool->queue);
+    freelookups(pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs the blocking system resolver
+\*-------------------------------------------------------------------------*/
+static void resolve(p_lookup lookup) {
+    if (lookup->kind == LOOKUP_ADDR) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_family = lookup->family;
+        lookup->err = getaddrinfo(lookup->host, NULL, &hints,
+            &lookup->resolved);
+    } else {
+        lookup->err = getnameinfo((SA *) &lookup->addr, lookup->addr_len,
+            lookup->name, (socklen_t) sizeof(lookup->name), NULL, 0,
+            NI_NAMEREQD);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Worker thread: takes lookups from the queue until the pool is closed
+\*-------------------------------------------------------------------------*/
+static void *work(void *arg) {
+    p_pool pool = (p_pool) arg;
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; ) {
+        p_lookup lookup;
+        while (!pool->closed && !pool->queue)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->closed) break;
+        lookup = pool->queue;
+        if (!(pool->queue = lookup->next)) pool->queuetail = &pool->queue;
+        pthread_mutex_unlock(&pool->lock);
+        resolve(lookup);
+        pthread_mutex_lock(&pool->lock);
+        /* nobody wants the result anymore */
+        if (pool->closed) {
+            lookup->next = NULL;
+            freelookups(lookup);
+            break;
+        }
+        lookup->next = NULL;
+        *pool->donetail = lookup;
+        pool->donetail = &lookup->next;
+        /* wake up whoever watches the descriptor */
+        if (pool->done == lookup) {
+            char c = 0;
+            if (write(pool->fd[1], &c, 1) < 0) { /* pipe is full anyway */ }
+        }
+    }
+    release(pool);
+    return NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Workers run code from this library and may still be blocked in the system
+* resolver when the Lua state that loaded it is closed. Taking a reference
+* of our own that is never dropped keeps the code mapped until the process
+* exits
+\*-------------------------------------------------------------------------*/
+static pthread_once_t pinned = PTHREAD_ONCE_INIT;
+
+static void pin(void) {
+#ifdef RTLD_NODELETE
+    Dl_info info;
+    /* fails when linked statically, and then nothing is ever unloaded */
+    if (dladdr((void *) resolver_open, &info) && info.dli_fname)
+        (void) dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE);
+#endif
+}
+
+/*-------------------------------------------------------------------------*\
+* Creates the pipe the workers use to signal results
+\*-------------------------------------------------------------------------*/
+static int openpipe(int fd[2]) {
+#ifdef __linux__
+    return pipe2(fd, O_NONBLOCK|O_CLOEXEC);
+#else
+    int i;
+    if (pipe(fd) != 0) return -1;
+    for (i = 0; i < 2; i++) {
+        fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+#endif
+}
+
+/*-------------------------------------------------------------------------*\
+* Queues a lookup for the workers
+\*-------------------------------------------------------------------------*/
+static int submit(lua_State *L, p_resolver resolver, p_lookup lookup) {
+    p_pool pool = resolver->pool;
+    lookup->id = ++resolver->lastid;
+    pthread_mutex_lock(&pool->lock);
+    *pool->queuetail = lookup;
+    pool->queuetail = &lookup->next;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    resolver->pending++;
+    lua_pushnumber(L, lookup->id);
+    return 1;
+}
+
+static p_lookup newlookup(lua_State *L, int kind) {
+    p_lookup lookup = (p_lookup) calloc(1, sizeof(t_lookup));
+    if (!lookup) luaL_error(L, "not enough memory");
+    lookup->kind = kind;
+    return lookup;
+}
+
+static p_resolver checkopen(lua_State *L) {
+    p_resolver resolver = (p_resolver) auxiliar_checkclass(L, "resolver{}", 1);
+    if (!resolver->pool) luaL_argerror(L, 1, "resolver is closed");
+    return resolver;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Starts looking up the addresses of a host name
+* resolver:getaddrinfo(host [, family])
+\*-------------------------------------------------------------------------*/
+static int meth_getaddrinfo(lua_State *L) {
+    p_resolver resolver = checkopen(L);
+    const char *host = luaL_checkstring(L, 2);
+    int family = inet_optfamily(L, 3, "unspec");
+    p_lookup lookup = newlookup(L, LOOKUP_ADDR);
+    lookup->family = family;
+    if (!(lookup->host = strdup(host))) {
+        free(lookup);
+        return luaL_error(L, "not enough memory");
+    }
+    return submit(L, resolver, lookup);
+}
+
+/*-------------------------------------------------------------------------*\
+* Starts looking up the host name of a numeric address
+* resolver:getnameinfo(address)
+\*-------------------------------------------------------------------------*/
+static int meth_getnameinfo(lua_State *L) {
+    p_resolver resolver = checkopen(L);
+    const char *address = luaL_checkstring(L, 2);
+    struct addrinfo hints, *resolved = NULL;
+    p_lookup lookup;
+    int err;
+    /* numeric addresses are converted right away, without blocking */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(address, NULL, &hints, &resolved)) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_gaistrerror(err));
+        return 2;
+    }
+    lookup = (p_lookup) calloc(1, sizeof(t_lookup));
+    if (!lookup) {
+        freeaddrinfo(resolved);
+        return luaL_error(L, "not enough memory");
+    }
+    lookup->kind = LOOKUP_NAME;
+    memcpy(&lookup->addr, resolved->ai_addr, resolved->ai_addrlen);
+    lookup->addr_len = (socklen_t) resolved->ai_addrlen;
+    freeaddrinfo(resolved);
+    return submit(L, resolver, lookup);
+}
+
+/*-------------------------------------------------------------------------*\
+* Collects the lookups finished so far
+* resolver:results()
+\*-------------------------------------------------------------------------*/
+static int meth_results(lua_State *L) {
+    p_resolver resolver = checkopen(L);
+    p_pool pool = resolver->pool;
+    p_lookup list, lookup;
+    char drain[64];
+    int i = 1;
+    pthread_mutex_lock(&pool->lock);
+    list = pool->done;
+    pool->done = NULL;
+    pool->donetail = &pool->done;
+    while (read(pool->fd[0], drain, sizeof(drain)) > 0) ;
+    pthread_mutex_unlock(&pool->lock);
+    lua_newtable(L);
+    for (lookup = list; lookup; lookup = lookup->next) {
+        int err = lookup->err;
+        resolver->pending--;
+        lua_newtable(L);
+        lua_pushnumber(L, lookup->id);
+        lua_setfield(L, -2, "id");
+        if (err == 0) {
+            if (lookup->kind == LOOKUP_ADDR)
+                err = inet_pushaddrinfo(L, lookup->resolved);
+            else lua_pushstring(L, lookup->name);
+            if (err == 0) lua_setfield(L, -2, "result");
+        }
+        if (err != 0) {
+            lua_pushstring(L, socket_gaistrerror(err));
+            lua_setfield(L, -2, "err");
+        }
+        lua_rawseti(L, -2, i++);
+    }
+    freelookups(list);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the number of lookups whose results were not collected yet
+\*-------------------------------------------------------------------------*/
+static int meth_pending(lua_State *L) {
+    p_resolver resolver = (p_resolver) auxiliar_checkclass(L, "resolver{}", 1);
+    lua_pushnumber(L, resolver->pending);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Select support methods
+\*-------------------------------------------------------------------------*/
+static int meth_getfd(lua_State *L) {
+    p_resolver resolver = (p_resolver) auxiliar_checkclass(L, "resolver{}", 1);
+    lua_pushnumber(L, resolver->pool? resolver->pool->fd[0]: -1);
+    return 1;
+}
+
+static int meth_dirty(lua_State *L) {
+    (void) auxiliar_checkclass(L, "resolver{}", 1);
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Abandons pending lookups and lets the workers go. Workers busy with a
+* lookup exit when it finishes
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_resolver resolver = (p_resolver) auxiliar_checkclass(L, "resolver{}", 1);
+    p_pool pool = resolver->pool;
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->closed = 1;
+        close(pool->fd[0]);
+        close(pool->fd[1]);
+        pthread_cond_broadcast(&pool->wake);
+        release(pool);
+        resolver->pool = NULL;
+        resolver->pending = 0;
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a new resolver object with its pool of workers
+* socket.resolver([workers])
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    int i, workers = (int) luaL_optnumber(L, 1, RESOLVER_WORKERS);
+    p_resolver resolver;
+    p_pool pool;
+    sigset_t all, old;
+    luaL_argcheck(L, workers >= 1 && workers <= RESOLVER_MAXWORKERS, 1,
+        "invalid number of workers");
+    resolver = (p_resolver) lua_newuserdata(L, sizeof(t_resolver));
+    memset(resolver, 0, sizeof(t_resolver));
+    auxiliar_setclass(L, "resolver{}", -1);
+    if (!(pool = (p_pool) calloc(1, sizeof(t_pool)))) {
+        lua_pushnil(L);
+        lua_pushstring(L, "not enough memory");
+        return 2;
+    }
+    if (openpipe(pool->fd) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(errno));
+        free(pool);
+        return 2;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->queuetail = &pool->queue;
+    pool->donetail = &pool->done;
+    pool->refs = 1;
+    resolver->pool = pool;
+    pthread_once(&pinned, pin);
+    /* signals are for the Lua thread to handle */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < workers; i++) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_mutex_lock(&pool->lock);
+        pool->refs++;
+        pthread_mutex_unlock(&pool->lock);
+        if (pthread_create(&thread, &attr, work, pool) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->refs--;
+            pthread_mutex_unlock(&pool->lock);
+            pthread_attr_destroy(&attr);
+            break;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    /* without workers nothing would ever be resolved */
+    if (i == 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "unable to start resolver threads");
+        return 2;
+    }
+    return 1;
+}
+
+#else /* LUASOCKET_RESOLVER */
+
+int resolver_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+
+#endif /* LUASOCKET_RESOLVER */
@@ -0,0 +1,17 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+/*=========================================================================*\
+* Asynchronous name resolution
+* LuaSocket toolkit
+*
+* The resolver hands lookups to a small pool of native threads, which call
+* the blocking system resolver, so that the Lua thread never waits on DNS.
+* Finished lookups are collected with results(). The descriptor returned by
+* getfd() is readable while results are waiting, so the resolver can be
+* watched by select or a poller together with the sockets.
+\*=========================================================================*/
+#include "lua.h"
+
+int resolver_open(lua_State *L);
+
+#endif /* RESOLVER_H */
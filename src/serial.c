@@ -37,6 +37,8 @@ static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
 
 /* serial object methods */
 static luaL_Reg serial_methods[] = {
@@ -44,11 +46,13 @@ static luaL_Reg serial_methods[] = {
     {"__tostring",  auxiliar_tostring},
     {"close",       meth_close},
     {"dirty",       meth_dirty},
+    {"getbuffersize", meth_getbuffersize},
     {"getfd",       meth_getfd},
     {"getstats",    meth_getstats},
     {"setstats",    meth_setstats},
     {"receive",     meth_receive},
     {"send",        meth_send},
+    {"setbuffersize", meth_setbuffersize},
     {"setfd",       meth_setfd},
     {"settimeout",  meth_settimeout},
     {NULL,          NULL}
@@ -92,6 +96,16 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &un->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_getbuffersize(L, &un->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_setbuffersize(L, &un->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Select support methods
 \*-------------------------------------------------------------------------*/
@@ -121,6 +135,7 @@ static int meth_close(lua_State *L)
 {
     p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
     socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
     lua_pushnumber(L, 1);
     return 1;
 }
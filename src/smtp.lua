@@ -35,6 +35,8 @@ _M.PORT = 25
 _M.DOMAIN = os.getenv("SERVER_NAME") or "localhost"
 -- default time zone (means we don't know)
 _M.ZONE = "-0000"
+-- hold commands in the output buffer until the reply is read
+_M.OUTPUTBUFFER = false
 
 ---------------------------------------------------------------------------
 -- Low level SMTP API
@@ -115,7 +117,7 @@ end
 
 function _M.open(server, port, create)
     local tp = socket.try(tp.connect(server or _M.SERVER, port or _M.PORT,
-        _M.TIMEOUT, create))
+        _M.TIMEOUT, create, _M.OUTPUTBUFFER))
     local s = base.setmetatable({tp = tp}, metat)
     -- make sure tp is closed if we get an exception
     s.try = socket.newtry(function()
@@ -31,6 +31,29 @@
 /* we are lazy... */
 typedef struct sockaddr SA;
 
+/* one slot of a batch of datagrams received by socket_recvmany */
+typedef struct t_dgram_ {
+    char *data;                 /* where the datagram is stored */
+    size_t size;                /* capacity of data */
+    size_t len;                 /* length of the datagram received */
+    t_sockaddr_storage addr;    /* sender address */
+    socklen_t addr_len;
+} t_dgram;
+typedef t_dgram *p_dgram;
+
+/* one datagram of a batch sent by socket_sendmany */
+typedef struct t_outdgram_ {
+    const char *data;           /* datagram contents */
+    size_t count;               /* length of data */
+    t_sockaddr_storage addr;    /* destination address */
+    socklen_t addr_len;         /* 0 on connected sockets */
+    int err;                    /* outcome of the send */
+} t_outdgram;
+typedef t_outdgram *p_outdgram;
+
+/* most connection attempts socket_waitconnect can wait on at once */
+#define SOCKET_MAXCONNECT 8
+
 /*=========================================================================*\
 * Functions bellow implement a comfortable platform independent 
 * interface to sockets
@@ -43,6 +66,10 @@ int socket_sendto(p_socket ps, const char *data, size_t count,
         size_t *sent, SA *addr, socklen_t addr_len, p_timeout tm);
 int socket_recvfrom(p_socket ps, char *data, size_t count, 
         size_t *got, SA *addr, socklen_t *addr_len, p_timeout tm);
+int socket_recvmany(p_socket ps, p_dgram dgrams, int count, int *got,
+        p_timeout tm);
+int socket_sendmany(p_socket ps, p_outdgram dgrams, int count, int gso,
+        int *sent, p_timeout tm);
 
 void socket_setnonblocking(p_socket ps);
 void socket_setblocking(p_socket ps);
@@ -52,11 +79,13 @@ int socket_select(t_socket n, fd_set *rfds, fd_set *wfds, fd_set *efds,
         p_timeout tm);
 
 int socket_connect(p_socket ps, SA *addr, socklen_t addr_len, p_timeout tm); 
+int socket_waitconnect(p_socket ps, int n, int *which, p_timeout tm);
 int socket_create(p_socket ps, int domain, int type, int protocol);
 int socket_bind(p_socket ps, SA *addr, socklen_t addr_len); 
 int socket_listen(p_socket ps, int backlog);
 int socket_accept(p_socket ps, p_socket pa, SA *addr, 
         socklen_t *addr_len, p_timeout tm);
+int socket_acceptready(p_socket ps, p_socket pa);
 
 const char *socket_hoststrerror(int err);
 const char *socket_gaistrerror(int err);
@@ -66,6 +95,8 @@ const char *socket_strerror(int err);
    and the buffered input module */
 int socket_send(p_socket ps, const char *data, size_t count, 
         size_t *sent, p_timeout tm);
+int socket_sendv(p_socket ps, const t_iobuf *bufs, int n, size_t *sent,
+        p_timeout tm);
 int socket_recv(p_socket ps, char *data, size_t count, size_t *got, p_timeout tm);
 int socket_write(p_socket ps, const char *data, size_t count, 
         size_t *sent, p_timeout tm);
@@ -10,18 +10,19 @@ local base = _G
 local string = require("string")
 local math = require("math")
 local socket = require("socket.core")
+local ltn12 = require("ltn12")
 
 local _M = socket
 
 -----------------------------------------------------------------------------
 -- Exported auxiliar functions
 -----------------------------------------------------------------------------
-function _M.connect4(address, port, laddress, lport)
-    return socket.connect(address, port, laddress, lport, "inet")
+function _M.connect4(address, port, laddress, lport, delay)
+    return socket.connect(address, port, laddress, lport, "inet", delay)
 end
 
-function _M.connect6(address, port, laddress, lport)
-    return socket.connect(address, port, laddress, lport, "inet6")
+function _M.connect6(address, port, laddress, lport, delay)
+    return socket.connect(address, port, laddress, lport, "inet6", delay)
 end
 
 function _M.bind(host, port, backlog)
@@ -56,13 +57,13 @@ end
 _M.try = _M.newtry()
 
 function _M.choose(table)
-    return function(name, opt1, opt2)
+    return function(name, opt1, opt2, opt3)
         if base.type(name) ~= "string" then
-            name, opt1, opt2 = "default", name, opt1
+            name, opt1, opt2, opt3 = "default", name, opt1, opt2
         end
         local f = table[name or "nil"]
         if not f then base.error("unknown key (".. base.tostring(name) ..")", 3)
-        else return f(opt1, opt2) end
+        else return f(opt1, opt2, opt3) end
     end
 end
 
@@ -76,8 +77,27 @@ _M.sinkt = sinkt
 
 _M.BLOCKSIZE = 2048
 
+-- moves data between native sources and sinks for ltn12.pump.all
+local function splice(from, to)
+    local moved, err, partial = socket.splice(from.object, to.object,
+        from.length)
+    if from.length then from.length = from.length - (moved or partial) end
+    if moved and from.close then from.object:close() end
+    if to.close then to.object:close() end
+    if moved then return 1 else return nil, err end
+end
+
+-- only plain tcp objects can be spliced, wrapped ones must go through Lua
+local function native(t, sock, d)
+    if socket.cansplice(sock) then
+        d.object, d.splice = sock, splice
+        ltn12.native[t] = d
+    end
+    return t
+end
+
 sinkt["close-when-done"] = function(sock)
-    return base.setmetatable({
+    return native(base.setmetatable({
         getfd = function() return sock:getfd() end,
         dirty = function() return sock:dirty() end
     }, {
@@ -87,11 +107,11 @@ sinkt["close-when-done"] = function(sock)
                 return 1
             else return sock:send(chunk) end
         end
-    })
+    }), sock, { close = true })
 end
 
 sinkt["keep-open"] = function(sock)
-    return base.setmetatable({
+    return native(base.setmetatable({
         getfd = function() return sock:getfd() end,
         dirty = function() return sock:dirty() end
     }, {
@@ -99,38 +119,40 @@ sinkt["keep-open"] = function(sock)
             if chunk then return sock:send(chunk)
             else return 1 end
         end
-    })
+    }), sock, {})
 end
 
 sinkt["default"] = sinkt["keep-open"]
 
 _M.sink = _M.choose(sinkt)
 
-sourcet["by-length"] = function(sock, length)
-    return base.setmetatable({
+sourcet["by-length"] = function(sock, length, size)
+    local d = { length = length }
+    size = size or socket.BLOCKSIZE
+    return native(base.setmetatable({
         getfd = function() return sock:getfd() end,
         dirty = function() return sock:dirty() end
     }, {
         __call = function()
-            if length <= 0 then return nil end
-            local size = math.min(socket.BLOCKSIZE, length)
-            local chunk, err = sock:receive(size)
+            if d.length <= 0 then return nil end
+            local chunk, err = sock:receive(math.min(size, d.length))
             if err then return nil, err end
-            length = length - string.len(chunk)
+            d.length = d.length - string.len(chunk)
             return chunk
         end
-    })
+    }), sock, d)
 end
 
-sourcet["until-closed"] = function(sock)
+sourcet["until-closed"] = function(sock, size)
     local done
-    return base.setmetatable({
+    size = size or socket.BLOCKSIZE
+    return native(base.setmetatable({
         getfd = function() return sock:getfd() end,
         dirty = function() return sock:dirty() end
     }, {
         __call = function()
             if done then return nil end
-            local chunk, err, partial = sock:receive(socket.BLOCKSIZE)
+            local chunk, err, partial = sock:receive(size)
             if not err then return chunk
             elseif err == "closed" then
                 sock:close()
@@ -138,7 +160,7 @@ sourcet["until-closed"] = function(sock)
                 return partial
             else return nil, err end
         end
-    })
+    }), sock, { close = true })
 end
 
 
@@ -0,0 +1,480 @@
+/*=========================================================================*\
+* Data transfer between sockets and files
+* LuaSocket toolkit
+\*=========================================================================*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* needed for splice */
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "compat.h"
+
+#include "socket.h"
+#include "tcp.h"
+#include "splice.h"
+
+#ifdef LUASOCKET_SPLICE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+#ifndef MIN
+#define MIN(x, y) ((x) < (y) ? x : y)
+#endif
+
+/* large file positions */
+#ifdef _WIN32
+typedef __int64 t_offset;
+#define tellfile _ftelli64
+#define seekfile _fseeki64
+#else
+#include <sys/types.h>
+typedef off_t t_offset;
+#define tellfile ftello
+#define seekfile fseeko
+#endif
+
+/* size of the block used when data has to go through user space */
+#define SPLICE_BLOCK 16384
+/* most data the kernel is asked to move at once */
+#define SPLICE_CHUNK 65536
+
+/* results of transfer functions */
+#define SPLICE_OK 0             /* data moved, more can follow */
+#define SPLICE_END 1            /* source has no more data */
+#define SPLICE_ERROR 2          /* failure, described by msg */
+#define SPLICE_FALLBACK 3       /* kernel can't help, copy through memory */
+
+/* one end of the transfer, either a stream socket or a file */
+typedef struct t_end_ {
+    p_socket ps;                /* socket, or NULL for files */
+    p_buffer buf;               /* buffer of the socket */
+    FILE *file;
+} t_end;
+
+/* transfer control structure */
+typedef struct t_splice_ {
+    t_end from, to;
+    int limited;                /* count is meaningful */
+    size_t count;               /* bytes still to be moved */
+    size_t moved;               /* bytes moved so far */
+    const char *msg;            /* error message */
+} t_splice;
+typedef t_splice *p_splice;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_splice(lua_State *L);
+static int global_cansplice(lua_State *L);
+static FILE *getfile(lua_State *L, int idx);
+static void getcount(lua_State *L, int idx, p_splice s);
+static int run(lua_State *L, p_splice s);
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"splice",    global_splice},
+    {"cansplice", global_cansplice},
+    {NULL,        NULL}
+};
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int splice_open(lua_State *L) {
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends the contents of a file through a stream socket
+* object:sendfile(file [, offset, count])
+\*-------------------------------------------------------------------------*/
+int splice_meth_sendfile(lua_State *L, p_socket ps, p_buffer buf) {
+    t_splice s;
+    t_offset position = 0;
+    int ret, seek = !lua_isnoneornil(L, 3);
+    s.from.ps = NULL;
+    s.from.buf = NULL;
+    if (!(s.from.file = getfile(L, 2))) luaL_argerror(L, 2, "file expected");
+    s.to.ps = ps;
+    s.to.buf = buf;
+    s.to.file = NULL;
+    getcount(L, 4, &s);
+    /* an explicit offset leaves the file position alone */
+    if (seek) {
+        lua_Number offset = luaL_checknumber(L, 3);
+        luaL_argcheck(L, offset >= 0, 3, "invalid offset");
+        position = tellfile(s.from.file);
+        if (position < 0 ||
+            seekfile(s.from.file, (t_offset) offset, SEEK_SET) != 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            lua_pushnumber(L, 0);
+            return 3;
+        }
+    }
+    ret = run(L, &s);
+    if (seek) seekfile(s.from.file, position, SEEK_SET);
+    return ret;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Checks the class of an object without raising errors
+\*-------------------------------------------------------------------------*/
+static int testclass(lua_State *L, int idx, const char *classname) {
+    int ok = 0;
+    if (lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, classname);
+        ok = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    return ok;
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets an open file handle from the stack, or NULL if it is not a file
+\*-------------------------------------------------------------------------*/
+static FILE *getfile(lua_State *L, int idx) {
+    FILE *file = NULL;
+    if (!testclass(L, idx, LUA_FILEHANDLE)) return NULL;
+#if LUA_VERSION_NUM > 501
+    {
+        luaL_Stream *stream = (luaL_Stream *) lua_touserdata(L, idx);
+        if (stream->closef) file = stream->f;
+    }
+#else
+    file = *(FILE **) lua_touserdata(L, idx);
+#endif
+    if (!file) luaL_argerror(L, idx, "attempt to use a closed file");
+    return file;
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets one end of the transfer from the stack
+\*-------------------------------------------------------------------------*/
+static void getend(lua_State *L, int idx, t_end *end) {
+    end->ps = NULL;
+    end->buf = NULL;
+    end->file = NULL;
+    if (testclass(L, idx, "tcp{client}")) {
+        p_tcp tcp = (p_tcp) lua_touserdata(L, idx);
+        end->ps = &tcp->sock;
+        end->buf = &tcp->buf;
+    } else if (!(end->file = getfile(L, idx)))
+        luaL_argerror(L, idx, "tcp{client} or file expected");
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets the optional byte count from the stack
+\*-------------------------------------------------------------------------*/
+static void getcount(lua_State *L, int idx, p_splice s) {
+    s->limited = !lua_isnoneornil(L, idx);
+    s->count = 0;
+    s->moved = 0;
+    s->msg = NULL;
+    if (s->limited) {
+        lua_Number count = luaL_checknumber(L, idx);
+        luaL_argcheck(L, count >= 0, idx, "invalid count");
+        s->count = (size_t) count;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Accounts for data that reached the destination
+\*-------------------------------------------------------------------------*/
+static void account(p_splice s, size_t n) {
+    s->moved += n;
+    if (s->limited) s->count -= n;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads at most count bytes from the source
+\*-------------------------------------------------------------------------*/
+static int readend(p_splice s, char *data, size_t count, size_t *got) {
+    if (s->from.ps) {
+        p_buffer buf = s->from.buf;
+        int err = buffer_read(buf, data, count, got);
+        if (err == IO_DONE) return SPLICE_OK;
+        if (err == IO_CLOSED) return SPLICE_END;
+        s->msg = buf->io->error(buf->io->ctx, err);
+        return SPLICE_ERROR;
+    } else {
+        *got = fread(data, 1, count, s->from.file);
+        if (*got > 0) return SPLICE_OK;
+        if (ferror(s->from.file)) {
+            s->msg = strerror(errno);
+            return SPLICE_ERROR;
+        }
+        return SPLICE_END;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Writes count bytes to the destination
+\*-------------------------------------------------------------------------*/
+static int writeend(p_splice s, const char *data, size_t count) {
+    size_t sent = 0;
+    if (s->to.ps) {
+        p_buffer buf = s->to.buf;
+        int err = buffer_write(buf, data, count, &sent);
+        account(s, sent);
+        if (err != IO_DONE) {
+            s->msg = buf->io->error(buf->io->ctx, err);
+            return SPLICE_ERROR;
+        }
+    } else {
+        sent = fwrite(data, 1, count, s->to.file);
+        account(s, sent);
+        if (sent < count) {
+            s->msg = strerror(errno);
+            return SPLICE_ERROR;
+        }
+    }
+    return SPLICE_OK;
+}
+
+/*-------------------------------------------------------------------------*\
+* Copies data through a memory block. If buffered is set, stops as soon as
+* the input buffer of the source is empty, so that it never blocks
+\*-------------------------------------------------------------------------*/
+static int copy(p_splice s, int buffered) {
+    char block[SPLICE_BLOCK];
+    for ( ;; ) {
+        size_t wanted = SPLICE_BLOCK, got = 0;
+        int ret;
+        if (s->limited) {
+            if (s->count == 0) return SPLICE_OK;
+            wanted = MIN(wanted, s->count);
+        }
+        if (buffered && buffer_isempty(s->from.buf)) return SPLICE_OK;
+        ret = readend(s, block, wanted, &got);
+        if (got > 0) {
+            int err = writeend(s, block, got);
+            if (err != SPLICE_OK) return err;
+        }
+        if (ret != SPLICE_OK) return ret;
+    }
+}
+
+#ifdef LUASOCKET_SPLICE
+/*-------------------------------------------------------------------------*\
+* Kernel transfers, Linux only
+\*-------------------------------------------------------------------------*/
+static size_t chunk(p_splice s) {
+    return s->limited? MIN(s->count, SPLICE_CHUNK): SPLICE_CHUNK;
+}
+
+static int done(p_splice s) {
+    return s->limited && s->count == 0;
+}
+
+static int fail(p_splice s, int err) {
+    s->msg = err == EPIPE? io_strerror(IO_CLOSED): socket_strerror(err);
+    return SPLICE_ERROR;
+}
+
+static int waitend(p_splice s, t_end *end, int sw) {
+    p_buffer buf = end->buf;
+    int err = socket_waitfd(end->ps, sw, buf->tm);
+    if (err == IO_DONE) return SPLICE_OK;
+    s->msg = buf->io->error(buf->io->ctx, err);
+    return SPLICE_ERROR;
+}
+
+/* gets a destination file ready for writes behind the back of stdio */
+static int outfile(FILE *file, off_t *offset) {
+    int fd = fileno(file);
+    if (fflush(file) != 0 || (fcntl(fd, F_GETFL) & O_APPEND)) return -1;
+    *offset = ftello(file);
+    return fd;
+}
+
+/* moves count bytes from a pipe to the destination */
+static int drain(p_splice s, int in, int out, off_t *offset, size_t count) {
+    t_end *to = s->to.ps? &s->to: NULL;
+    while (count > 0) {
+        ssize_t n = splice(in, NULL, out, offset, count,
+            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            int ret;
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || !to) return fail(s, errno);
+            if ((ret = waitend(s, to, WAITFD_W)) != SPLICE_OK) return ret;
+            continue;
+        }
+        if (to) to->buf->sent += n;
+        account(s, (size_t) n);
+        count -= (size_t) n;
+    }
+    return SPLICE_OK;
+}
+
+/* socket to socket or file, through a pipe */
+static int fromsocket(p_splice s) {
+    t_end *from = &s->from;
+    off_t offset = -1;
+    int out, fd[2], ret = SPLICE_OK;
+    if (s->to.ps) out = *s->to.ps;
+    else if ((out = outfile(s->to.file, &offset)) < 0) return SPLICE_FALLBACK;
+    if (pipe2(fd, O_CLOEXEC) != 0) return SPLICE_FALLBACK;
+    while (ret == SPLICE_OK && !done(s)) {
+        ssize_t n = splice(*from->ps, NULL, fd[1], NULL, chunk(s),
+            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (n == 0) ret = SPLICE_END;
+        else if (n < 0) {
+            if (errno == EINTR) continue;
+            else if (errno == EAGAIN) ret = waitend(s, from, WAITFD_R);
+            else if (errno == EINVAL) ret = SPLICE_FALLBACK;
+            else ret = fail(s, errno);
+        } else {
+            from->buf->received += n;
+            ret = drain(s, fd[0], out, offset >= 0? &offset: NULL, (size_t) n);
+        }
+    }
+    close(fd[0]);
+    close(fd[1]);
+    if (offset >= 0) fseeko(s->to.file, offset, SEEK_SET);
+    return ret;
+}
+
+/* file to socket, through sendfile */
+static int fromfile(p_splice s) {
+    t_end *to = &s->to;
+    int in = fileno(s->from.file), ret = SPLICE_OK;
+    off_t offset = ftello(s->from.file);
+    if (offset < 0) return SPLICE_FALLBACK;
+    while (ret == SPLICE_OK && !done(s)) {
+        ssize_t n = sendfile(*to->ps, in, &offset, chunk(s));
+        if (n == 0) ret = SPLICE_END;
+        else if (n < 0) {
+            if (errno == EINTR) continue;
+            else if (errno == EAGAIN) ret = waitend(s, to, WAITFD_W);
+            else if (errno == EINVAL || errno == ENOSYS) ret = SPLICE_FALLBACK;
+            else ret = fail(s, errno);
+        } else {
+            to->buf->sent += n;
+            account(s, (size_t) n);
+        }
+    }
+    fseeko(s->from.file, offset, SEEK_SET);
+    return ret;
+}
+
+/* file to file, through copy_file_range, glibc 2.27 and later */
+static int betweenfiles(p_splice s) {
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    int in = fileno(s->from.file), out, ret = SPLICE_OK;
+    off_t inoffset = ftello(s->from.file), outoffset;
+    size_t moved = 0;
+    if (inoffset < 0) return SPLICE_FALLBACK;
+    if ((out = outfile(s->to.file, &outoffset)) < 0 || outoffset < 0)
+        return SPLICE_FALLBACK;
+    while (ret == SPLICE_OK && !done(s)) {
+        ssize_t n = copy_file_range(in, &inoffset, out, &outoffset,
+            chunk(s), 0);
+        /* some file systems report nothing instead of failing */
+        if (n == 0) ret = moved > 0? SPLICE_END: SPLICE_FALLBACK;
+        else if (n < 0) {
+            if (errno == EINTR) continue;
+            else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EBADF || errno == EOPNOTSUPP) ret = SPLICE_FALLBACK;
+            else ret = fail(s, errno);
+        } else {
+            moved += (size_t) n;
+            account(s, (size_t) n);
+        }
+    }
+    fseeko(s->from.file, inoffset, SEEK_SET);
+    fseeko(s->to.file, outoffset, SEEK_SET);
+    return ret;
+#else
+    (void) s;
+    return SPLICE_FALLBACK;
+#endif
+}
+#endif
+
+/*-------------------------------------------------------------------------*\
+* Moves data from source to destination
+\*-------------------------------------------------------------------------*/
+static int transfer(p_splice s) {
+    int ret;
+    /* pending output goes before anything else */
+    if (s->to.ps && (ret = writeend(s, NULL, 0)) != SPLICE_OK) return ret;
+    /* and so does buffered input */
+    if (s->from.ps && (ret = copy(s, 1)) != SPLICE_OK) return ret;
+    if (s->limited && s->count == 0) return SPLICE_OK;
+#ifdef LUASOCKET_SPLICE
+    if (s->from.ps) ret = fromsocket(s);
+    else if (s->to.ps) ret = fromfile(s);
+    else ret = betweenfiles(s);
+    if (ret != SPLICE_FALLBACK) return ret;
+#endif
+    return copy(s, 0);
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs a transfer and pushes its results
+\*-------------------------------------------------------------------------*/
+static int run(lua_State *L, p_splice s) {
+    int ret;
+    if ((s->from.ps && *s->from.ps == SOCKET_INVALID) ||
+        (s->to.ps && *s->to.ps == SOCKET_INVALID)) {
+        s->msg = "closed";
+        ret = SPLICE_ERROR;
+    } else {
+        if (s->from.ps) timeout_markstart(s->from.buf->tm);
+        if (s->to.ps) timeout_markstart(s->to.buf->tm);
+        ret = transfer(s);
+    }
+    if (ret == SPLICE_END && s->limited && s->count > 0) {
+        s->msg = "closed";
+        ret = SPLICE_ERROR;
+    }
+    if (ret == SPLICE_ERROR) {
+        lua_pushnil(L);
+        lua_pushstring(L, s->msg);
+        lua_pushnumber(L, (lua_Number) s->moved);
+        return 3;
+    }
+    lua_pushnumber(L, (lua_Number) s->moved);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Moves data between tcp objects and files
+\*-------------------------------------------------------------------------*/
+static int global_splice(lua_State *L) {
+    t_splice s;
+    getend(L, 1, &s.from);
+    getend(L, 2, &s.to);
+    getcount(L, 3, &s);
+    return run(L, &s);
+}
+
+/*-------------------------------------------------------------------------*\
+* Tells whether an object can be one end of a splice
+\*-------------------------------------------------------------------------*/
+static int global_cansplice(lua_State *L) {
+    lua_pushboolean(L, testclass(L, 1, "tcp{client}") ||
+        testclass(L, 1, LUA_FILEHANDLE));
+    return 1;
+}
@@ -0,0 +1,21 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+/*=========================================================================*\
+* Data transfer between sockets and files
+* LuaSocket toolkit
+*
+* Moves data between connected tcp objects and Lua file handles without
+* creating Lua strings, and sends files through stream sockets. Data
+* already held in the object buffers is moved first. On Linux, the rest is
+* moved by the kernel, through splice, sendfile or copy_file_range.
+* Elsewhere, or when the kernel refuses, data is copied through a C buffer.
+\*=========================================================================*/
+#include "lua.h"
+
+#include "buffer.h"
+#include "socket.h"
+
+int splice_open(lua_State *L);
+int splice_meth_sendfile(lua_State *L, p_socket ps, p_buffer buf);
+
+#endif /* SPLICE_H */
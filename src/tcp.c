@@ -13,6 +13,10 @@
 #include "inet.h"
 #include "options.h"
 #include "tcp.h"
+#include "splice.h"
+
+/* connection attempt delay recommended by RFC 8305 */
+#define TCP_EYEBALLS 0.25
 
 /*=========================================================================*\
 * Internal function prototypes
@@ -26,14 +30,25 @@ static int meth_listen(lua_State *L);
 static int meth_getfamily(lua_State *L);
 static int meth_bind(lua_State *L);
 static int meth_send(lua_State *L);
+static int meth_sendv(lua_State *L);
+static int meth_sendfile(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
+static int meth_setoutputbuffer(lua_State *L);
+static int meth_flush(lua_State *L);
 static int meth_getsockname(lua_State *L);
 static int meth_getpeername(lua_State *L);
 static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
+static int meth_receiveheaders(lua_State *L);
+static int meth_receivechunk(lua_State *L);
+static int meth_sendchunk(lua_State *L);
 static int meth_accept(lua_State *L);
+static int meth_acceptmany(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
 static int meth_getoption(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_gettimeout(lua_State *L);
@@ -44,14 +59,17 @@ static int meth_dirty(lua_State *L);
 
 /* tcp object methods */
 static luaL_Reg tcp_methods[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
+    {"acceptmany",  meth_acceptmany},
     {"bind",        meth_bind},
     {"close",       meth_close},
     {"connect",     meth_connect},
     {"dirty",       meth_dirty},
+    {"flush",       meth_flush},
     {"getfamily",   meth_getfamily},
+    {"getbuffersize", meth_getbuffersize},
     {"getfd",       meth_getfd},
     {"getoption",   meth_getoption},
     {"getpeername", meth_getpeername},
@@ -60,7 +78,14 @@ static luaL_Reg tcp_methods[] = {
     {"setstats",    meth_setstats},
     {"listen",      meth_listen},
     {"receive",     meth_receive},
+    {"receivechunk", meth_receivechunk},
+    {"receiveheaders", meth_receiveheaders},
     {"send",        meth_send},
+    {"sendchunk",   meth_sendchunk},
+    {"sendfile",    meth_sendfile},
+    {"sendv",       meth_sendv},
+    {"setbuffersize", meth_setbuffersize},
+    {"setoutputbuffer", meth_setoutputbuffer},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
     {"setpeername", meth_connect},
@@ -136,11 +161,36 @@ static int meth_send(lua_State *L) {
     return buffer_meth_send(L, &tcp->buf);
 }
 
+static int meth_sendv(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_sendv(L, &tcp->buf);
+}
+
+static int meth_sendfile(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return splice_meth_sendfile(L, &tcp->sock, &tcp->buf);
+}
+
 static int meth_receive(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
     return buffer_meth_receive(L, &tcp->buf);
 }
 
+static int meth_receiveheaders(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receiveheaders(L, &tcp->buf);
+}
+
+static int meth_receivechunk(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receivechunk(L, &tcp->buf);
+}
+
+static int meth_sendchunk(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_sendchunk(L, &tcp->buf);
+}
+
 static int meth_getstats(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
     return buffer_meth_getstats(L, &tcp->buf);
@@ -151,6 +201,26 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &tcp->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_getbuffersize(L, &tcp->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_setbuffersize(L, &tcp->buf);
+}
+
+static int meth_setoutputbuffer(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_setoutputbuffer(L, &tcp->buf);
+}
+
+static int meth_flush(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_flush(L, &tcp->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Just call option handler
 \*-------------------------------------------------------------------------*/
@@ -191,6 +261,27 @@ static int meth_dirty(lua_State *L)
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Pushes a client object for a socket accepted by the server object
+\*-------------------------------------------------------------------------*/
+static void pushclient(lua_State *L, p_tcp server, t_socket sock)
+{
+    p_tcp clnt = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
+    auxiliar_setclass(L, "tcp{client}", -1);
+    /* initialize structure fields */
+    memset(clnt, 0, sizeof(t_tcp));
+    clnt->sock = sock;
+    io_init(&clnt->io, (p_send) socket_send, (p_recv) socket_recv,
+            (p_error) socket_ioerror, &clnt->sock);
+    io_setsendv(&clnt->io, (p_sendv) socket_sendv);
+    timeout_init(&clnt->tm, -1, -1);
+    buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
+    /* clients inherit the buffer settings of the server */
+    clnt->buf.size = server->buf.size;
+    clnt->buf.release = server->buf.release;
+    clnt->family = server->family;
+}
+
 /*-------------------------------------------------------------------------*\
 * Waits for and returns a client object attempting connection to the
 * server object
@@ -203,17 +294,7 @@ static int meth_accept(lua_State *L)
     const char *err = inet_tryaccept(&server->sock, server->family, &sock, tm);
     /* if successful, push client socket */
     if (err == NULL) {
-        p_tcp clnt = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
-        auxiliar_setclass(L, "tcp{client}", -1);
-        /* initialize structure fields */
-        memset(clnt, 0, sizeof(t_tcp));
-        socket_setnonblocking(&sock);
-        clnt->sock = sock;
-        io_init(&clnt->io, (p_send) socket_send, (p_recv) socket_recv,
-                (p_error) socket_ioerror, &clnt->sock);
-        timeout_init(&clnt->tm, -1, -1);
-        buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
-        clnt->family = server->family;
+        pushclient(L, server, sock);
         return 1;
     } else {
         lua_pushnil(L);
@@ -222,6 +303,37 @@ static int meth_accept(lua_State *L)
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Waits for a connection like accept, then takes every connection already
+* pending, up to max, and returns them in an array
+\*-------------------------------------------------------------------------*/
+static int meth_acceptmany(lua_State *L)
+{
+    p_tcp server = (p_tcp) auxiliar_checkclass(L, "tcp{server}", 1);
+    lua_Number max = luaL_optnumber(L, 2, -1);
+    p_timeout tm = timeout_markstart(&server->tm);
+    int n = 0, err = IO_DONE;
+    luaL_argcheck(L, max < 0 || max >= 1, 2, "invalid maximum");
+    lua_newtable(L);
+    while (max < 0 || n < max) {
+        t_socket sock;
+        err = socket_acceptready(&server->sock, &sock);
+        if (err == IO_DONE) {
+            pushclient(L, server, sock);
+            lua_rawseti(L, -2, ++n);
+        } else if (n > 0) {
+            /* errors show up again on the next call */
+            break;
+        } else if (err != IO_TIMEOUT ||
+            (err = socket_waitfd(&server->sock, WAITFD_R, tm)) != IO_DONE) {
+            lua_pushnil(L);
+            lua_pushstring(L, socket_strerror(err));
+            return 2;
+        }
+    }
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * Binds an object to an address
 \*-------------------------------------------------------------------------*/
@@ -235,7 +347,7 @@ static int meth_bind(lua_State *L) {
     bindhints.ai_socktype = SOCK_STREAM;
     bindhints.ai_family = tcp->family;
     bindhints.ai_flags = AI_PASSIVE;
-    err = inet_trybind(&tcp->sock, &tcp->family, address, port, &bindhints);
+    err = inet_trybind(L, &tcp->sock, &tcp->family, address, port, &bindhints);
     if (err) {
         lua_pushnil(L);
         lua_pushstring(L, err);
@@ -245,6 +357,31 @@ static int meth_bind(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Gets the optional delay between parallel connection attempts, which is
+* negative when addresses are to be tried one after the other
+\*-------------------------------------------------------------------------*/
+static double optdelay(lua_State *L, int idx) {
+    lua_Number delay;
+    if (lua_isnoneornil(L, idx)) return -1.0;
+    if (lua_isboolean(L, idx)) return lua_toboolean(L, idx)? TCP_EYEBALLS: -1.0;
+    delay = luaL_checknumber(L, idx);
+    luaL_argcheck(L, delay >= 0, idx, "invalid delay");
+    return (double) delay;
+}
+
+/*-------------------------------------------------------------------------*\
+* Connects to the first resolved address that answers
+\*-------------------------------------------------------------------------*/
+static const char *tryconnect(lua_State *L, p_tcp tcp, const char *address,
+        const char *serv, struct addrinfo *connecthints, double delay) {
+    if (delay >= 0.0)
+        return inet_tryeyeballs(L, &tcp->sock, &tcp->family, address, serv,
+            &tcp->tm, connecthints, delay);
+    return inet_tryconnect(L, &tcp->sock, &tcp->family, address, serv,
+        &tcp->tm, connecthints);
+}
+
 /*-------------------------------------------------------------------------*\
 * Turns a master tcp object into a client object.
 \*-------------------------------------------------------------------------*/
@@ -252,6 +389,7 @@ static int meth_connect(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
     const char *address =  luaL_checkstring(L, 2);
     const char *port = luaL_checkstring(L, 3);
+    double delay = optdelay(L, 4);
     struct addrinfo connecthints;
     const char *err;
     memset(&connecthints, 0, sizeof(connecthints));
@@ -259,8 +397,7 @@ static int meth_connect(lua_State *L) {
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = tcp->family;
     timeout_markstart(&tcp->tm);
-    err = inet_tryconnect(&tcp->sock, &tcp->family, address, port,
-        &tcp->tm, &connecthints);
+    err = tryconnect(L, tcp, address, port, &connecthints, delay);
     /* have to set the class even if it failed due to non-blocking connects */
     auxiliar_setclass(L, "tcp{client}", 1);
     if (err) {
@@ -273,16 +410,39 @@ static int meth_connect(lua_State *L) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Closes socket used by object
+* Closes socket used by object, after sending pending output on a
+* best-effort basis. The socket is closed even if that fails
 \*-------------------------------------------------------------------------*/
-static int meth_close(lua_State *L)
+static int closeobj(lua_State *L, int wait)
 {
     p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    const char *err = NULL;
+    if (tcp->sock != SOCKET_INVALID) {
+        int ret = buffer_flushpending(&tcp->buf, wait);
+        if (ret != IO_DONE) err = tcp->io.error(tcp->io.ctx, ret);
+    }
     socket_destroy(&tcp->sock);
+    buffer_destroy(&tcp->buf);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
     lua_pushnumber(L, 1);
     return 1;
 }
 
+static int meth_close(lua_State *L)
+{
+    return closeobj(L, 1);
+}
+
+/* collected objects never block on their pending output */
+static int meth_gc(lua_State *L)
+{
+    return closeobj(L, 0);
+}
+
 /*-------------------------------------------------------------------------*\
 * Returns family as string
 \*-------------------------------------------------------------------------*/
@@ -382,6 +542,7 @@ static int tcp_create(lua_State *L, int family) {
     tcp->family = family;
     io_init(&tcp->io, (p_send) socket_send, (p_recv) socket_recv,
             (p_error) socket_ioerror, &tcp->sock);
+    io_setsendv(&tcp->io, (p_sendv) socket_sendv);
     timeout_init(&tcp->tm, -1, -1);
     buffer_init(&tcp->buf, &tcp->io, &tcp->tm);
     if (family != AF_UNSPEC) {
@@ -391,7 +552,6 @@ static int tcp_create(lua_State *L, int family) {
             lua_pushstring(L, err);
             return 2;
         }
-        socket_setnonblocking(&tcp->sock);
     }
     return 1;
 }
@@ -414,6 +574,7 @@ static int global_connect(lua_State *L) {
     const char *localaddr  = luaL_optstring(L, 3, NULL);
     const char *localserv  = luaL_optstring(L, 4, "0");
     int family = inet_optfamily(L, 5, "unspec");
+    double delay = optdelay(L, 6);
     p_tcp tcp = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
     struct addrinfo bindhints, connecthints;
     const char *err = NULL;
@@ -421,6 +582,7 @@ static int global_connect(lua_State *L) {
     memset(tcp, 0, sizeof(t_tcp));
     io_init(&tcp->io, (p_send) socket_send, (p_recv) socket_recv,
             (p_error) socket_ioerror, &tcp->sock);
+    io_setsendv(&tcp->io, (p_sendv) socket_sendv);
     timeout_init(&tcp->tm, -1, -1);
     buffer_init(&tcp->buf, &tcp->io, &tcp->tm);
     tcp->sock = SOCKET_INVALID;
@@ -431,7 +593,7 @@ static int global_connect(lua_State *L) {
     bindhints.ai_family = family;
     bindhints.ai_flags = AI_PASSIVE;
     if (localaddr) {
-        err = inet_trybind(&tcp->sock, &tcp->family, localaddr,
+        err = inet_trybind(L, &tcp->sock, &tcp->family, localaddr,
             localserv, &bindhints);
         if (err) {
             lua_pushnil(L);
@@ -444,8 +606,7 @@ static int global_connect(lua_State *L) {
     connecthints.ai_socktype = SOCK_STREAM;
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = tcp->family;
-    err = inet_tryconnect(&tcp->sock, &tcp->family, remoteaddr, remoteserv,
-         &tcp->tm, &connecthints);
+    err = tryconnect(L, tcp, remoteaddr, remoteserv, &connecthints, delay);
     if (err) {
         socket_destroy(&tcp->sock);
         lua_pushnil(L);
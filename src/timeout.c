@@ -32,14 +32,36 @@
 * Internal function prototypes
 \*=========================================================================*/
 static int timeout_lua_gettime(lua_State *L);
+static int timeout_lua_monotime(lua_State *L);
+static int timeout_lua_cachetime(lua_State *L);
 static int timeout_lua_sleep(lua_State *L);
 
 static luaL_Reg func[] = {
     { "gettime", timeout_lua_gettime },
+    { "monotime", timeout_lua_monotime },
+    { "cachetime", timeout_lua_cachetime },
     { "sleep", timeout_lua_sleep },
     { NULL, NULL }
 };
 
+/* thread local storage, so that threads running their own event loops do
+ * not see, or race on, each other's cached time */
+#if defined(_MSC_VER)
+#define TIMEOUT_THREAD __declspec(thread)
+#elif defined(__GNUC__)
+#define TIMEOUT_THREAD __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TIMEOUT_THREAD _Thread_local
+#else
+#define TIMEOUT_THREAD
+#endif
+
+/* monotonic time cached by cachetime, or negative if caching is off. it
+ * is refreshed after every wait (see timeout_refresh), so that operations
+ * that wait more than once see time go by. there is one value per thread,
+ * shared by the Lua states that run in it */
+static TIMEOUT_THREAD double cached = -1.0;
+
 /*=========================================================================*\
 * Exported functions.
 \*=========================================================================*/
@@ -63,12 +85,12 @@ double timeout_get(p_timeout tm) {
     if (tm->block < 0.0 && tm->total < 0.0) {
         return -1;
     } else if (tm->block < 0.0) {
-        double t = tm->total - timeout_gettime() + tm->start;
+        double t = tm->total - timeout_now() + tm->start;
         return MAX(t, 0.0);
     } else if (tm->total < 0.0) {
         return tm->block;
     } else {
-        double t = tm->total - timeout_gettime() + tm->start;
+        double t = tm->total - timeout_now() + tm->start;
         return MIN(tm->block, MAX(t, 0.0));
     }
 }
@@ -96,13 +118,13 @@ double timeout_getretry(p_timeout tm) {
     if (tm->block < 0.0 && tm->total < 0.0) {
         return -1;
     } else if (tm->block < 0.0) {
-        double t = tm->total - timeout_gettime() + tm->start;
+        double t = tm->total - timeout_now() + tm->start;
         return MAX(t, 0.0);
     } else if (tm->total < 0.0) {
-        double t = tm->block - timeout_gettime() + tm->start;
+        double t = tm->block - timeout_now() + tm->start;
         return MAX(t, 0.0);
     } else {
-        double t = tm->total - timeout_gettime() + tm->start;
+        double t = tm->total - timeout_now() + tm->start;
         return MIN(tm->block, MAX(t, 0.0));
     }
 }
@@ -113,10 +135,29 @@ double timeout_getretry(p_timeout tm) {
 *   tm: timeout control structure
 \*-------------------------------------------------------------------------*/
 p_timeout timeout_markstart(p_timeout tm) {
-    tm->start = timeout_gettime();
+    tm->start = timeout_now();
     return tm;
 }
 
+/*-------------------------------------------------------------------------*\
+* Gets the time used for timeouts: the cached time, if caching is on, or
+* the monotonic clock otherwise
+* Returns
+*   time in s.
+\*-------------------------------------------------------------------------*/
+double timeout_now(void) {
+    return cached >= 0.0? cached: timeout_monotime();
+}
+
+/*-------------------------------------------------------------------------*\
+* Updates the cached time, if caching is on. Called after every wait for
+* events, so that event loops get a fresh time for free, and so that
+* timeouts keep running down inside operations that wait repeatedly
+\*-------------------------------------------------------------------------*/
+void timeout_refresh(void) {
+    if (cached >= 0.0) cached = timeout_monotime();
+}
+
 /*-------------------------------------------------------------------------*\
 * Gets time in s, relative to January 1, 1970 (UTC)
 * Returns
@@ -141,6 +182,36 @@ double timeout_gettime(void) {
 }
 #endif
 
+/*-------------------------------------------------------------------------*\
+* Gets time in s from an unspecified starting point. Unlike the time of
+* day, it never jumps when the system clock is set
+* Returns
+*   time in s.
+\*-------------------------------------------------------------------------*/
+#ifdef _WIN32
+double timeout_monotime(void) {
+    static double frequency = 0.0;
+    LARGE_INTEGER counter;
+    if (frequency == 0.0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        frequency = (double) f.QuadPart;
+    }
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart/frequency;
+}
+#else
+double timeout_monotime(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec v;
+    /* served from the vDSO on Linux, without entering the kernel */
+    if (clock_gettime(CLOCK_MONOTONIC, &v) == 0)
+        return v.tv_sec + v.tv_nsec/1.0e9;
+#endif
+    return timeout_gettime();
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Initializes module
 \*-------------------------------------------------------------------------*/
@@ -195,6 +266,29 @@ static int timeout_lua_gettime(lua_State *L)
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Returns the monotonic time, in seconds.
+\*-------------------------------------------------------------------------*/
+static int timeout_lua_monotime(lua_State *L)
+{
+    lua_pushnumber(L, timeout_monotime());
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Turns time caching on, updating the cached time, or off.
+* Lua Input: [on]
+*   on: false to stop caching (default: true)
+* Lua Returns: the time now used for timeouts
+\*-------------------------------------------------------------------------*/
+static int timeout_lua_cachetime(lua_State *L)
+{
+    if (lua_isnone(L, 1) || lua_toboolean(L, 1)) cached = timeout_monotime();
+    else cached = -1.0;
+    lua_pushnumber(L, timeout_now());
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * Sleep for n seconds.
 \*-------------------------------------------------------------------------*/
@@ -206,6 +300,7 @@ int timeout_lua_sleep(lua_State *L)
     if (n < DBL_MAX/1000.0) n *= 1000.0;
     if (n > INT_MAX) n = INT_MAX;
     Sleep((int)n);
+    timeout_refresh();
     return 0;
 }
 #else
@@ -223,6 +318,7 @@ int timeout_lua_sleep(lua_State *L)
         t.tv_sec = r.tv_sec;
         t.tv_nsec = r.tv_nsec;
     }
+    timeout_refresh();
     return 0;
 }
 #endif
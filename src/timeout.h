@@ -10,7 +10,7 @@
 typedef struct t_timeout_ {
     double block;          /* maximum time for blocking calls */
     double total;          /* total number of miliseconds for operation */
-    double start;          /* time of start of operation */
+    double start;          /* time of start of operation, see timeout_now */
 } t_timeout;
 typedef t_timeout *p_timeout;
 
@@ -21,6 +21,9 @@ double timeout_getretry(p_timeout tm);
 p_timeout timeout_markstart(p_timeout tm);
 double timeout_getstart(p_timeout tm);
 double timeout_gettime(void);
+double timeout_monotime(void);
+double timeout_now(void);
+void timeout_refresh(void);
 int timeout_meth_settimeout(lua_State *L, p_timeout tm);
 int timeout_meth_gettimeout(lua_State *L, p_timeout tm);
 
@@ -118,8 +118,9 @@ function metat.__index:close()
     return 1
 end
 
--- connect with server and return c object
-function _M.connect(host, port, timeout, create)
+-- connect with server and return c object. if outputbuffer is true,
+-- commands are held in the output buffer until we read the reply
+function _M.connect(host, port, timeout, create, outputbuffer)
     local c, e = (create or socket.tcp)()
     if not c then return nil, e end
     c:settimeout(timeout or _M.TIMEOUT)
@@ -128,6 +129,7 @@ function _M.connect(host, port, timeout, create)
         c:close()
         return nil, e
     end
+    if outputbuffer and c.setoutputbuffer then c:setoutputbuffer() end
     return base.setmetatable({c = c}, metat)
 end
 
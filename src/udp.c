@@ -31,8 +31,10 @@ static int global_create4(lua_State *L);
 static int global_create6(lua_State *L);
 static int meth_send(lua_State *L);
 static int meth_sendto(lua_State *L);
+static int meth_sendmany(lua_State *L);
 static int meth_receive(lua_State *L);
 static int meth_receivefrom(lua_State *L);
+static int meth_receivemany(lua_State *L);
 static int meth_getfamily(lua_State *L);
 static int meth_getsockname(lua_State *L);
 static int meth_getpeername(lua_State *L);
@@ -59,7 +61,9 @@ static luaL_Reg udp_methods[] = {
     {"getsockname", meth_getsockname},
     {"receive",     meth_receive},
     {"receivefrom", meth_receivefrom},
+    {"receivemany", meth_receivemany},
     {"send",        meth_send},
+    {"sendmany",    meth_sendmany},
     {"sendto",      meth_sendto},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
@@ -172,6 +176,77 @@ static int meth_send(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Parses a numeric (ip, port) pair, going through a small per-object cache
+* of recently used destinations, so that peers that repeat are not parsed
+* again. The result points either into the cache or to scratch, and is
+* only valid until the next call. Returns a getaddrinfo error code.
+\*-------------------------------------------------------------------------*/
+static int udp_resolve(p_udp udp, const char *ip, const char *port,
+        p_inetaddr scratch, p_inetaddr *dest) {
+    p_udpcache entry, victim = NULL;
+    struct addrinfo aihint, *ai;
+    int i, err;
+    if (strlen(ip) < UDP_CACHEIPLEN && strlen(port) < UDP_CACHEPORTLEN) {
+        if (!udp->cache) udp->cache = (p_udpcache) calloc(UDP_CACHESIZE,
+            sizeof(t_udpcache));
+        for (i = 0, entry = udp->cache; entry && i < UDP_CACHESIZE;
+                i++, entry++) {
+            if (entry->ip[0] && entry->family == udp->family &&
+                    strcmp(entry->ip, ip) == 0 &&
+                    strcmp(entry->port, port) == 0) {
+                entry->tick = ++udp->cachetick;
+                *dest = &entry->addr;
+                return 0;
+            }
+            /* evict the least recently used entry */
+            if (!victim || entry->tick < victim->tick) victim = entry;
+        }
+    }
+    memset(&aihint, 0, sizeof(aihint));
+    aihint.ai_family = udp->family;
+    aihint.ai_socktype = SOCK_DGRAM;
+    aihint.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    err = getaddrinfo(ip, port, &aihint, &ai);
+    if (err) return err;
+    if (victim) {
+        strcpy(victim->ip, ip);
+        strcpy(victim->port, port);
+        victim->family = udp->family;
+        victim->tick = ++udp->cachetick;
+        *dest = &victim->addr;
+    } else *dest = scratch;
+    memcpy(&(*dest)->addr, ai->ai_addr, ai->ai_addrlen);
+    (*dest)->addr_len = (socklen_t) ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets the destination of a send, given either as an address object at
+* stack index idx or as an (ip, port) pair at idx and idx+1. Creates the
+* socket of AF_UNSPEC objects on their first send, with the family of the
+* destination. Returns an error message, or NULL on success.
+\*-------------------------------------------------------------------------*/
+static const char *udp_destination(lua_State *L, p_udp udp, int idx,
+        p_inetaddr scratch, p_inetaddr *dest) {
+    p_inetaddr addr = inet_toaddress(L, idx);
+    if (addr) *dest = addr;
+    else {
+        const char *ip = luaL_checkstring(L, idx);
+        const char *port = luaL_checkstring(L, idx+1);
+        int err = udp_resolve(udp, ip, port, scratch, dest);
+        if (err) return socket_gaistrerror(err);
+    }
+    if (udp->family == AF_UNSPEC && udp->sock == SOCKET_INVALID) {
+        int family = ((SA *) &(*dest)->addr)->sa_family;
+        const char *err = inet_trycreate(&udp->sock, family, SOCK_DGRAM, 0);
+        if (err) return err;
+        udp->family = family;
+    }
+    return NULL;
+}
+
 /*-------------------------------------------------------------------------*\
 * Send data through unconnected udp socket
 \*-------------------------------------------------------------------------*/
@@ -179,47 +254,19 @@ static int meth_sendto(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkclass(L, "udp{unconnected}", 1);
     size_t count, sent = 0;
     const char *data = luaL_checklstring(L, 2, &count);
-    const char *ip = luaL_checkstring(L, 3);
-    const char *port = luaL_checkstring(L, 4);
     p_timeout tm = &udp->tm;
+    t_inetaddr scratch;
+    p_inetaddr dest;
+    const char *errstr = udp_destination(L, udp, 3, &scratch, &dest);
     int err;
-    struct addrinfo aihint;
-    struct addrinfo *ai;
-    memset(&aihint, 0, sizeof(aihint));
-    aihint.ai_family = udp->family;
-    aihint.ai_socktype = SOCK_DGRAM;
-    aihint.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
-    err = getaddrinfo(ip, port, &aihint, &ai);
-	if (err) {
+    if (errstr) {
         lua_pushnil(L);
-        lua_pushstring(L, gai_strerror(err));
+        lua_pushstring(L, errstr);
         return 2;
     }
-
-    /* create socket if on first sendto if AF_UNSPEC was set */
-    if (udp->family == AF_UNSPEC && udp->sock == SOCKET_INVALID) {
-        struct addrinfo *ap;
-        const char *errstr = NULL;
-        for (ap = ai; ap != NULL; ap = ap->ai_next) {
-            errstr = inet_trycreate(&udp->sock, ap->ai_family, SOCK_DGRAM, 0);
-            if (errstr == NULL) {
-                socket_setnonblocking(&udp->sock);
-                udp->family = ap->ai_family;
-                break;
-            }
-        }
-        if (errstr != NULL) {
-            lua_pushnil(L);
-            lua_pushstring(L, errstr);
-            freeaddrinfo(ai);
-            return 2;
-        }
-    }
-
     timeout_markstart(tm);
-    err = socket_sendto(&udp->sock, data, count, &sent, ai->ai_addr,
-        (socklen_t) ai->ai_addrlen, tm);
-    freeaddrinfo(ai);
+    err = socket_sendto(&udp->sock, data, count, &sent, (SA *) &dest->addr,
+        dest->addr_len, tm);
     if (err != IO_DONE) {
         lua_pushnil(L);
         lua_pushstring(L, udp_strerror(err));
@@ -229,6 +276,93 @@ static int meth_sendto(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sends a batch of datagrams with as few system calls as possible.
+* Connected objects take an array of strings, unconnected objects an array
+* of {datagram, ip, port} or {datagram, address} tables. Returns the
+* number of datagrams sent, followed by a table with the error of each
+* datagram that failed, if any.
+\*-------------------------------------------------------------------------*/
+static int meth_sendmany(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+    int gso = lua_toboolean(L, 3);
+    p_timeout tm = &udp->tm;
+    p_outdgram dgrams;
+    const char **errs;
+    int i, connected, count = 0, sent = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_getmetatable(L, 1);
+    luaL_getmetatable(L, "udp{connected}");
+    connected = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    for (;;) {
+        lua_rawgeti(L, 2, count+1);
+        if (lua_isnil(L, -1)) break;
+        lua_pop(L, 1);
+        count++;
+    }
+    lua_pop(L, 1);
+    /* the userdata is released by the collector even if we raise errors */
+    dgrams = (p_outdgram) lua_newuserdata(L,
+        count*(sizeof(t_outdgram) + sizeof(const char *)) + 1);
+    errs = (const char **) (dgrams + count);
+    for (i = 0; i < count; i++) {
+        p_outdgram d = dgrams + i;
+        d->err = IO_DONE;
+        d->addr_len = 0;
+        errs[i] = NULL;
+        lua_rawgeti(L, 2, i+1);
+        if (connected) {
+            /* only strings stay put while they sit in the table */
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2,
+                "array of strings expected");
+            d->data = lua_tolstring(L, -1, &d->count);
+        } else {
+            t_inetaddr scratch;
+            p_inetaddr dest;
+            int top;
+            luaL_argcheck(L, lua_istable(L, -1), 2, "array of tables expected");
+            lua_rawgeti(L, -1, 1);
+            lua_rawgeti(L, -2, 2);
+            lua_rawgeti(L, -3, 3);
+            top = lua_gettop(L);
+            luaL_argcheck(L, lua_type(L, top-2) == LUA_TSTRING &&
+                (inet_toaddress(L, top-1) || (lua_isstring(L, top-1) &&
+                    lua_isstring(L, top))), 2,
+                "{datagram, ip, port} or {datagram, address} expected");
+            d->data = lua_tolstring(L, top-2, &d->count);
+            errs[i] = udp_destination(L, udp, top-1, &scratch, &dest);
+            if (!errs[i]) {
+                memcpy(&d->addr, &dest->addr, dest->addr_len);
+                d->addr_len = dest->addr_len;
+            }
+            lua_pop(L, 3);
+        }
+        lua_pop(L, 1);
+    }
+    timeout_markstart(tm);
+    /* send runs of datagrams that were resolved */
+    for (i = 0; i < count; ) {
+        int j = i, n = 0;
+        while (j < count && !errs[j]) j++;
+        if (j > i) socket_sendmany(&udp->sock, dgrams + i, j - i, gso, &n, tm);
+        sent += n;
+        i = j + 1;
+    }
+    lua_pushnumber(L, (lua_Number) sent);
+    if (sent == count) return 1;
+    lua_newtable(L);
+    for (i = 0; i < count; i++) {
+        if (errs[i]) lua_pushstring(L, errs[i]);
+        else if (dgrams[i].err != IO_DONE)
+            lua_pushstring(L, udp_strerror(dgrams[i].err));
+        else continue;
+        lua_rawseti(L, -2, i+1);
+    }
+    return 2;
+}
+
 /*-------------------------------------------------------------------------*\
 * Receives data from a UDP socket
 \*-------------------------------------------------------------------------*/
@@ -302,6 +436,73 @@ static int meth_receivefrom(lua_State *L) {
     return 3;
 }
 
+/*-------------------------------------------------------------------------*\
+* Makes sure the receivemany ring has at least count slots of size bytes.
+* Slots and their storage come from a single allocation that is reused
+* by later calls, and released when the object is closed.
+\*-------------------------------------------------------------------------*/
+static int udp_reservering(p_udp udp, int count, size_t size) {
+    int i;
+    if (count > udp->ringcount || size > udp->ringsize) {
+        int ncount = MAX(count, udp->ringcount);
+        size_t nsize = MAX(size, udp->ringsize);
+        char *data;
+        p_dgram ring;
+        /* refuse sizes that would wrap around */
+        if (nsize > ((size_t) -1)/ncount - sizeof(t_dgram)) return 0;
+        ring = (p_dgram) malloc(ncount*(sizeof(t_dgram) + nsize));
+        if (!ring) return 0;
+        free(udp->ring);
+        data = (char *) (ring + ncount);
+        for (i = 0; i < ncount; i++) ring[i].data = data + i*nsize;
+        udp->ring = ring;
+        udp->ringcount = ncount;
+        udp->ringsize = nsize;
+    }
+    for (i = 0; i < count; i++) udp->ring[i].size = size;
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Receives up to count datagrams and their senders with a single call.
+* Senders are returned in packed form (see socket.dns.unpackaddr).
+\*-------------------------------------------------------------------------*/
+static int meth_receivemany(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+    double n = luaL_checknumber(L, 2);
+    double wanted = luaL_optnumber(L, 3, UDP_DATAGRAMSIZE);
+    p_timeout tm = &udp->tm;
+    int i, count, got, err;
+    size_t size;
+    luaL_argcheck(L, n > 0 && n <= UDP_MAXBATCH, 2, "out of range");
+    luaL_argcheck(L, wanted >= 0 && wanted <= UDP_MAXDATAGRAM, 3,
+        "out of range");
+    count = (int) n;
+    size = (size_t) wanted;
+    timeout_markstart(tm);
+    if (!udp_reservering(udp, count, size)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "out of memory");
+        return 2;
+    }
+    err = socket_recvmany(&udp->sock, udp->ring, count, &got, tm);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, udp_strerror(err));
+        return 2;
+    }
+    lua_createtable(L, got, 0);
+    lua_createtable(L, got, 0);
+    for (i = 0; i < got; i++) {
+        p_dgram d = &udp->ring[i];
+        lua_pushlstring(L, d->data, d->len);
+        lua_rawseti(L, -3, i+1);
+        inet_pushpacked(L, (SA *) &d->addr, d->addr_len);
+        lua_rawseti(L, -2, i+1);
+    }
+    return 2;
+}
+
 /*-------------------------------------------------------------------------*\
 * Returns family as string
 \*-------------------------------------------------------------------------*/
@@ -397,7 +598,7 @@ static int meth_setpeername(lua_State *L) {
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = udp->family;
     if (connecting) {
-        err = inet_tryconnect(&udp->sock, &udp->family, address,
+        err = inet_tryconnect(L, &udp->sock, &udp->family, address,
             port, tm, &connecthints);
         if (err) {
             lua_pushnil(L);
@@ -421,6 +622,12 @@ static int meth_setpeername(lua_State *L) {
 static int meth_close(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
     socket_destroy(&udp->sock);
+    free(udp->ring);
+    udp->ring = NULL;
+    udp->ringcount = 0;
+    udp->ringsize = 0;
+    free(udp->cache);
+    udp->cache = NULL;
     lua_pushnumber(L, 1);
     return 1;
 }
@@ -438,7 +645,7 @@ static int meth_setsockname(lua_State *L) {
     bindhints.ai_socktype = SOCK_DGRAM;
     bindhints.ai_family = udp->family;
     bindhints.ai_flags = AI_PASSIVE;
-    err = inet_trybind(&udp->sock, &udp->family, address, port, &bindhints);
+    err = inet_trybind(L, &udp->sock, &udp->family, address, port, &bindhints);
     if (err) {
         lua_pushnil(L);
         lua_pushstring(L, err);
@@ -464,6 +671,11 @@ static int udp_create(lua_State *L, int family) {
     udp->sock = SOCKET_INVALID;
     timeout_init(&udp->tm, -1, -1);
     udp->family = family;
+    udp->ring = NULL;
+    udp->ringcount = 0;
+    udp->ringsize = 0;
+    udp->cache = NULL;
+    udp->cachetick = 0;
     if (family != AF_UNSPEC) {
         const char *err = inet_trycreate(&udp->sock, family, SOCK_DGRAM, 0);
         if (err != NULL) {
@@ -471,7 +683,6 @@ static int udp_create(lua_State *L, int family) {
             lua_pushstring(L, err);
             return 2;
         }
-        socket_setnonblocking(&udp->sock);
     }
     return 1;
 }
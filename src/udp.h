@@ -16,13 +16,37 @@
 
 #include "timeout.h"
 #include "socket.h"
+#include "inet.h"
 
 #define UDP_DATAGRAMSIZE 8192
+/* maximum number of datagrams returned by each call to receivemany */
+#define UDP_MAXBATCH 1024
+/* largest datagram receivemany can be asked for */
+#define UDP_MAXDATAGRAM 65535
+
+/* cache of recently used sendto destinations */
+#define UDP_CACHESIZE 8
+#define UDP_CACHEIPLEN 64
+#define UDP_CACHEPORTLEN 8
+
+typedef struct t_udpcache_ {
+    char ip[UDP_CACHEIPLEN];        /* empty if the entry is unused */
+    char port[UDP_CACHEPORTLEN];
+    int family;                     /* family of the object when parsed */
+    unsigned int tick;              /* last use, for LRU eviction */
+    t_inetaddr addr;
+} t_udpcache;
+typedef t_udpcache *p_udpcache;
 
 typedef struct t_udp_ {
     t_socket sock;
     t_timeout tm;
     int family;
+    p_dgram ring;       /* receivemany slots, allocated on first use */
+    int ringcount;      /* number of slots in ring */
+    size_t ringsize;    /* capacity of each slot */
+    p_udpcache cache;   /* sendto destinations, allocated on first use */
+    unsigned int cachetick;
 } t_udp;
 typedef t_udp *p_udp;
 
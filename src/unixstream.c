@@ -11,6 +11,7 @@
 #include "auxiliar.h"
 #include "socket.h"
 #include "options.h"
+#include "splice.h"
 #include "unixstream.h"
 #include <sys/un.h>
 
@@ -22,10 +23,16 @@ static int meth_connect(lua_State *L);
 static int meth_listen(lua_State *L);
 static int meth_bind(lua_State *L);
 static int meth_send(lua_State *L);
+static int meth_sendv(lua_State *L);
+static int meth_sendfile(lua_State *L);
 static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
+static int meth_receiveheaders(lua_State *L);
+static int meth_receivechunk(lua_State *L);
+static int meth_sendchunk(lua_State *L);
 static int meth_accept(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_settimeout(lua_State *L);
 static int meth_getfd(lua_State *L);
@@ -33,6 +40,10 @@ static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
+static int meth_setoutputbuffer(lua_State *L);
+static int meth_flush(lua_State *L);
 static int meth_getsockname(lua_State *L);
 
 static const char *unixstream_tryconnect(p_unix un, const char *path);
@@ -40,19 +51,28 @@ static const char *unixstream_trybind(p_unix un, const char *path);
 
 /* unixstream object methods */
 static luaL_Reg unixstream_methods[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
     {"bind",        meth_bind},
     {"close",       meth_close},
     {"connect",     meth_connect},
     {"dirty",       meth_dirty},
+    {"flush",       meth_flush},
+    {"getbuffersize", meth_getbuffersize},
     {"getfd",       meth_getfd},
     {"getstats",    meth_getstats},
     {"setstats",    meth_setstats},
     {"listen",      meth_listen},
     {"receive",     meth_receive},
+    {"receivechunk", meth_receivechunk},
+    {"receiveheaders", meth_receiveheaders},
     {"send",        meth_send},
+    {"sendchunk",   meth_sendchunk},
+    {"sendfile",    meth_sendfile},
+    {"sendv",       meth_sendv},
+    {"setbuffersize", meth_setbuffersize},
+    {"setoutputbuffer", meth_setoutputbuffer},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
     {"setpeername", meth_connect},
@@ -111,11 +131,36 @@ static int meth_send(lua_State *L) {
     return buffer_meth_send(L, &un->buf);
 }
 
+static int meth_sendv(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_sendv(L, &un->buf);
+}
+
+static int meth_sendfile(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return splice_meth_sendfile(L, &un->sock, &un->buf);
+}
+
 static int meth_receive(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
     return buffer_meth_receive(L, &un->buf);
 }
 
+static int meth_receiveheaders(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receiveheaders(L, &un->buf);
+}
+
+static int meth_receivechunk(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receivechunk(L, &un->buf);
+}
+
+static int meth_sendchunk(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_sendchunk(L, &un->buf);
+}
+
 static int meth_getstats(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
     return buffer_meth_getstats(L, &un->buf);
@@ -126,6 +171,26 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &un->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_getbuffersize(L, &un->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_setbuffersize(L, &un->buf);
+}
+
+static int meth_setoutputbuffer(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_setoutputbuffer(L, &un->buf);
+}
+
+static int meth_flush(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_flush(L, &un->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Just call option handler
 \*-------------------------------------------------------------------------*/
@@ -170,12 +235,15 @@ static int meth_accept(lua_State *L) {
         p_unix clnt = (p_unix) lua_newuserdata(L, sizeof(t_unix));
         auxiliar_setclass(L, "unixstream{client}", -1);
         /* initialize structure fields */
-        socket_setnonblocking(&sock);
         clnt->sock = sock;
         io_init(&clnt->io, (p_send)socket_send, (p_recv)socket_recv,
                 (p_error) socket_ioerror, &clnt->sock);
+        io_setsendv(&clnt->io, (p_sendv) socket_sendv);
         timeout_init(&clnt->tm, -1, -1);
         buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
+        /* clients inherit the buffer settings of the server */
+        clnt->buf.size = server->buf.size;
+        clnt->buf.release = server->buf.release;
         return 1;
     } else {
         lua_pushnil(L);
@@ -279,16 +347,39 @@ static int meth_connect(lua_State *L)
 }
 
 /*-------------------------------------------------------------------------*\
-* Closes socket used by object
+* Closes socket used by object, after sending pending output on a
+* best-effort basis. The socket is closed even if that fails
 \*-------------------------------------------------------------------------*/
-static int meth_close(lua_State *L)
+static int closeobj(lua_State *L, int wait)
 {
     p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    const char *err = NULL;
+    if (un->sock != SOCKET_INVALID) {
+        int ret = buffer_flushpending(&un->buf, wait);
+        if (ret != IO_DONE) err = un->io.error(un->io.ctx, ret);
+    }
     socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
     lua_pushnumber(L, 1);
     return 1;
 }
 
+static int meth_close(lua_State *L)
+{
+    return closeobj(L, 1);
+}
+
+/* collected objects never block on their pending output */
+static int meth_gc(lua_State *L)
+{
+    return closeobj(L, 0);
+}
+
 /*-------------------------------------------------------------------------*\
 * Puts the sockt in listen mode
 \*-------------------------------------------------------------------------*/
@@ -346,10 +437,10 @@ static int global_create(lua_State *L) {
         /* set its type as master object */
         auxiliar_setclass(L, "unixstream{master}", -1);
         /* initialize remaining structure fields */
-        socket_setnonblocking(&sock);
         un->sock = sock;
         io_init(&un->io, (p_send) socket_send, (p_recv) socket_recv,
                 (p_error) socket_ioerror, &un->sock);
+        io_setsendv(&un->io, (p_sendv) socket_sendv);
         timeout_init(&un->tm, -1, -1);
         buffer_init(&un->buf, &un->io, &un->tm);
         return 1;
@@ -6,21 +6,42 @@
 * The penalty of calling select to avoid busy-wait is only paid when
 * the I/O call fail in the first place.
 \*=========================================================================*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* needed for recvmmsg */
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <signal.h>
 
 #include "socket.h"
 #include "pierror.h"
 
+/* new sockets come out non-blocking and close-on-exec in a single call */
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+#define SOCKET_NEWFLAGS (SOCK_NONBLOCK|SOCK_CLOEXEC)
+#endif
+
+/* batched datagram reception and transmission */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define SOCKET_MMSG
+#define MMSG_BATCH 64
+#include <netinet/udp.h>
+/* UDP generic segmentation offload, Linux 4.18 and later */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+/* kernel limits for the segments sent in a single call */
+#define GSO_MAXSEGS 64
+#define GSO_MAXBYTES 65507
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Wait for readable/writable/connected socket with timeout
 \*-------------------------------------------------------------------------*/
 #ifndef SOCKET_SELECT
-#include <sys/poll.h>
-
-#define WAITFD_R        POLLIN
-#define WAITFD_W        POLLOUT
-#define WAITFD_C        (POLLIN|POLLOUT)
 int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
     int ret;
     struct pollfd pfd;
@@ -32,17 +53,13 @@ int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
         int t = (int)(timeout_getretry(tm)*1e3);
         ret = poll(&pfd, 1, t >= 0? t: -1);
     } while (ret == -1 && errno == EINTR);
+    timeout_refresh();
     if (ret == -1) return errno;
     if (ret == 0) return IO_TIMEOUT;
     if (sw == WAITFD_C && (pfd.revents & (POLLIN|POLLERR))) return IO_CLOSED;
     return IO_DONE;
 }
 #else
-
-#define WAITFD_R        1
-#define WAITFD_W        2
-#define WAITFD_C        (WAITFD_R|WAITFD_W)
-
 int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
     int ret;
     fd_set rfds, wfds, *rp, *wp;
@@ -64,6 +81,7 @@ int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
         }
         ret = select(*ps+1, rp, wp, NULL, tp);
     } while (ret == -1 && errno == EINTR);
+    timeout_refresh();
     if (ret == -1) return errno;
     if (ret == 0) return IO_TIMEOUT;
     if (sw == WAITFD_C && FD_ISSET(*ps, &rfds)) return IO_CLOSED;
@@ -112,16 +130,25 @@ int socket_select(t_socket n, fd_set *rfds, fd_set *wfds, fd_set *efds,
         /* timeout = 0 means no wait */
         ret = select(n, rfds, wfds, efds, t >= 0.0 ? &tv: NULL);
     } while (ret < 0 && errno == EINTR);
+    timeout_refresh();
     return ret;
 }
 
 /*-------------------------------------------------------------------------*\
-* Creates and sets up a socket
+* Creates and sets up a socket, in non-blocking mode
 \*-------------------------------------------------------------------------*/
 int socket_create(p_socket ps, int domain, int type, int protocol) {
-    *ps = socket(domain, type, protocol);
+#ifdef SOCKET_NEWFLAGS
+    *ps = socket(domain, type|SOCKET_NEWFLAGS, protocol);
     if (*ps != SOCKET_INVALID) return IO_DONE;
-    else return errno;
+#else
+    *ps = socket(domain, type, protocol);
+    if (*ps != SOCKET_INVALID) {
+        socket_setnonblocking(ps);
+        return IO_DONE;
+    }
+#endif
+    return errno;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -129,9 +156,7 @@ int socket_create(p_socket ps, int domain, int type, int protocol) {
 \*-------------------------------------------------------------------------*/
 int socket_bind(p_socket ps, SA *addr, socklen_t len) {
     int err = IO_DONE;
-    socket_setblocking(ps);
     if (bind(*ps, addr, len) < 0) err = errno;
-    socket_setnonblocking(ps);
     return err;
 }
 
@@ -174,13 +199,100 @@ int socket_connect(p_socket ps, SA *addr, socklen_t len, p_timeout tm) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Accept with timeout
+* Waits until one of n connection attempts completes, and returns its
+* outcome. Which is set to its index, or to -1 if none completed
+\*-------------------------------------------------------------------------*/
+static int connecterror(p_socket ps) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(*ps, SOL_SOCKET, SO_ERROR, (char *) &err, &len) < 0)
+        return errno;
+    return err? err: IO_DONE;
+}
+
+#ifndef SOCKET_SELECT
+int socket_waitconnect(p_socket ps, int n, int *which, p_timeout tm) {
+    struct pollfd pfd[SOCKET_MAXCONNECT];
+    int i, ret;
+    *which = -1;
+    if (n > SOCKET_MAXCONNECT) return EINVAL;
+    for (i = 0; i < n; i++) {
+        pfd[i].fd = ps[i];
+        pfd[i].events = POLLOUT;
+        pfd[i].revents = 0;
+    }
+    do {
+        int t = (int)(timeout_getretry(tm)*1e3);
+        ret = poll(pfd, n, t >= 0? t: -1);
+    } while (ret == -1 && errno == EINTR);
+    timeout_refresh();
+    if (ret == -1) return errno;
+    for (i = 0; i < n && ret > 0; i++) {
+        if (pfd[i].revents) {
+            *which = i;
+            return connecterror(&ps[i]);
+        }
+    }
+    return IO_TIMEOUT;
+}
+#else
+int socket_waitconnect(p_socket ps, int n, int *which, p_timeout tm) {
+    fd_set wfds, efds;
+    struct timeval tv, *tp;
+    t_socket max = 0;
+    int i, ret;
+    double t;
+    *which = -1;
+    if (n > SOCKET_MAXCONNECT) return EINVAL;
+    for (i = 0; i < n; i++) {
+        if (ps[i] >= FD_SETSIZE) return EINVAL;
+        if (ps[i] > max) max = ps[i];
+    }
+    do {
+        /* must set bits within loop, because select may have modifed them */
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+        for (i = 0; i < n; i++) {
+            FD_SET(ps[i], &wfds);
+            FD_SET(ps[i], &efds);
+        }
+        t = timeout_getretry(tm);
+        tp = NULL;
+        if (t >= 0.0) {
+            tv.tv_sec = (int)t;
+            tv.tv_usec = (int)((t-tv.tv_sec)*1.0e6);
+            tp = &tv;
+        }
+        ret = select(max+1, NULL, &wfds, &efds, tp);
+    } while (ret == -1 && errno == EINTR);
+    timeout_refresh();
+    if (ret == -1) return errno;
+    for (i = 0; i < n && ret > 0; i++) {
+        if (FD_ISSET(ps[i], &wfds) || FD_ISSET(ps[i], &efds)) {
+            *which = i;
+            return connecterror(&ps[i]);
+        }
+    }
+    return IO_TIMEOUT;
+}
+#endif
+
+/*-------------------------------------------------------------------------*\
+* Accept with timeout. The new socket is in non-blocking mode
 \*-------------------------------------------------------------------------*/
 int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len, p_timeout tm) {
     if (*ps == SOCKET_INVALID) return IO_CLOSED;
     for ( ;; ) {
         int err;
-        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) return IO_DONE;
+#ifdef SOCKET_NEWFLAGS
+        *pa = accept4(*ps, addr, len, SOCKET_NEWFLAGS);
+        if (*pa != SOCKET_INVALID) return IO_DONE;
+#else
+        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
+#endif
         err = errno;
         if (err == EINTR) continue;
         if (err != EAGAIN && err != ECONNABORTED) return err;
@@ -190,6 +302,30 @@ int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len, p_timeout
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Accepts a pending connection without waiting. The new socket is left
+* in non-blocking mode
+\*-------------------------------------------------------------------------*/
+int socket_acceptready(p_socket ps, p_socket pa) {
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    for ( ;; ) {
+        int err;
+#ifdef SOCKET_NEWFLAGS
+        *pa = accept4(*ps, NULL, NULL, SOCKET_NEWFLAGS);
+        if (*pa != SOCKET_INVALID) return IO_DONE;
+#else
+        if ((*pa = accept(*ps, NULL, NULL)) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
+#endif
+        err = errno;
+        if (err == EINTR || err == ECONNABORTED) continue;
+        if (err == EAGAIN || err == EWOULDBLOCK) return IO_TIMEOUT;
+        return err;
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Send with timeout
 \*-------------------------------------------------------------------------*/
@@ -224,6 +360,48 @@ int socket_send(p_socket ps, const char *data, size_t count,
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Vectored send with timeout
+* Hands as many pieces as the system accepts to a single sendmsg call.
+\*-------------------------------------------------------------------------*/
+#define SENDV_MAXIOV 64
+int socket_sendv(p_socket ps, const t_iobuf *bufs, int n, size_t *sent,
+        p_timeout tm)
+{
+    struct iovec iov[SENDV_MAXIOV];
+    struct msghdr msg;
+    int i, err;
+    *sent = 0;
+    /* avoid making system calls on closed sockets */
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (n > SENDV_MAXIOV) n = SENDV_MAXIOV;
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = (void *) bufs[i].data;
+        iov[i].iov_len = bufs[i].count;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    /* loop until we send something or we give up on error */
+    for ( ;; ) {
+        long put = (long) sendmsg(*ps, &msg, 0);
+        /* if we sent anything, we are done */
+        if (put >= 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        err = errno;
+        /* same as in socket_send */
+        if (err == EPIPE) return IO_CLOSED;
+        if (err == EPROTOTYPE) continue;
+        if (err == EINTR) continue;
+        if (err != EAGAIN) return err;
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+    /* can't reach here */
+    return IO_UNKNOWN;
+}
+
 /*-------------------------------------------------------------------------*\
 * Sendto with timeout
 \*-------------------------------------------------------------------------*/
@@ -295,6 +473,203 @@ int socket_recvfrom(p_socket ps, char *data, size_t count, size_t *got,
 }
 
 
+/*-------------------------------------------------------------------------*\
+* Receive a batch of datagrams with timeout.
+* Only waits for the first datagram. After that, collects whatever is
+* already queued, up to count datagrams.
+\*-------------------------------------------------------------------------*/
+#ifdef SOCKET_MMSG
+int socket_recvmany(p_socket ps, p_dgram dgrams, int count, int *got,
+        p_timeout tm) {
+    struct mmsghdr msgs[MMSG_BATCH];
+    struct iovec iovs[MMSG_BATCH];
+    int err;
+    *got = 0;
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    while (*got < count) {
+        p_dgram d = dgrams + *got;
+        int i, taken, n = count - *got;
+        if (n > MMSG_BATCH) n = MMSG_BATCH;
+        memset(msgs, 0, n*sizeof(struct mmsghdr));
+        for (i = 0; i < n; i++) {
+            iovs[i].iov_base = d[i].data;
+            iovs[i].iov_len = d[i].size;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &d[i].addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(d[i].addr);
+        }
+        taken = recvmmsg(*ps, msgs, n, MSG_DONTWAIT, NULL);
+        if (taken >= 0) {
+            for (i = 0; i < taken; i++) {
+                d[i].len = msgs[i].msg_len;
+                d[i].addr_len = msgs[i].msg_hdr.msg_namelen;
+            }
+            *got += taken;
+            /* queue was drained */
+            if (taken < n) break;
+            continue;
+        }
+        err = errno;
+        if (err == EINTR) continue;
+        /* whatever went wrong will be reported by the next call */
+        if (*got > 0) break;
+        if (err != EAGAIN) return err;
+        if ((err = socket_waitfd(ps, WAITFD_R, tm)) != IO_DONE) return err;
+    }
+    return IO_DONE;
+}
+#else
+int socket_recvmany(p_socket ps, p_dgram dgrams, int count, int *got,
+        p_timeout tm) {
+    t_timeout zero;
+    int err;
+    *got = 0;
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    timeout_init(&zero, 0.0, -1);
+    while (*got < count) {
+        p_dgram d = dgrams + *got;
+        d->addr_len = sizeof(d->addr);
+        err = socket_recvfrom(ps, d->data, d->size, &d->len, (SA *) &d->addr,
+            &d->addr_len, *got > 0? &zero: tm);
+        /* unlike TCP, recv() of zero is not closed, but a zero-length packet */
+        if (err != IO_DONE && err != IO_CLOSED) {
+            if (*got > 0) break;
+            return err;
+        }
+        (*got)++;
+    }
+    return IO_DONE;
+}
+#endif
+
+
+/*-------------------------------------------------------------------------*\
+* Send a batch of datagrams with timeout.
+* The outcome of each datagram is stored in its err field, and the number
+* of datagrams that made it is returned in sent.
+\*-------------------------------------------------------------------------*/
+#ifdef SOCKET_MMSG
+/* number of datagrams starting at first that can go out as a single
+ * segmented send: same peer, same size, except for a shorter last one */
+static int gso_group(p_outdgram dgrams, int first, int count, int max) {
+    p_outdgram d = dgrams + first;
+    size_t total = d->count;
+    int n = 1;
+    if (max > GSO_MAXSEGS) max = GSO_MAXSEGS;
+    if (d->count == 0) return 1;
+    while (first + n < count && n < max) {
+        p_outdgram next = d + n;
+        if (next->count == 0 || next->count > d->count) break;
+        if (total + next->count > GSO_MAXBYTES) break;
+        if (next->addr_len != d->addr_len || (d->addr_len > 0 &&
+                memcmp(&next->addr, &d->addr, d->addr_len) != 0)) break;
+        total += next->count;
+        n++;
+        if (next->count < d->count) break;
+    }
+    return n;
+}
+
+/* checks if the kernel understands UDP_SEGMENT, since older kernels
+ * silently ignore it and would send all segments as a single datagram */
+static int gso_supported(p_socket ps) {
+    int size = 0;
+    socklen_t len = sizeof(size);
+    return getsockopt(*ps, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+int socket_sendmany(p_socket ps, p_outdgram dgrams, int count, int gso,
+        int *sent, p_timeout tm) {
+    struct mmsghdr msgs[MMSG_BATCH];
+    struct iovec iovs[MMSG_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctls[MMSG_BATCH];
+    int firsts[MMSG_BATCH], segs[MMSG_BATCH];
+    int i = 0, j, err;
+    *sent = 0;
+    if (*ps == SOCKET_INVALID) {
+        for (j = 0; j < count; j++) dgrams[j].err = IO_CLOSED;
+        return IO_CLOSED;
+    }
+    if (gso) gso = gso_supported(ps);
+    while (i < count) {
+        int n = 0, v = 0, k = i, taken;
+        memset(msgs, 0, sizeof(msgs));
+        /* pack as many datagrams as we can into this batch */
+        while (k < count && v < MMSG_BATCH) {
+            struct msghdr *h = &msgs[n].msg_hdr;
+            int m = gso? gso_group(dgrams, k, count, MMSG_BATCH - v): 1;
+            for (j = 0; j < m; j++) {
+                iovs[v+j].iov_base = (void *) dgrams[k+j].data;
+                iovs[v+j].iov_len = dgrams[k+j].count;
+            }
+            h->msg_iov = &iovs[v];
+            h->msg_iovlen = m;
+            if (dgrams[k].addr_len > 0) {
+                h->msg_name = &dgrams[k].addr;
+                h->msg_namelen = dgrams[k].addr_len;
+            }
+            if (m > 1) {
+                struct cmsghdr *cm;
+                h->msg_control = ctls[n].buf;
+                h->msg_controllen = sizeof(ctls[n].buf);
+                cm = CMSG_FIRSTHDR(h);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *) CMSG_DATA(cm) = (uint16_t) dgrams[k].count;
+            }
+            firsts[n] = k;
+            segs[n] = m;
+            n++; v += m; k += m;
+        }
+        taken = sendmmsg(*ps, msgs, n, 0);
+        if (taken > 0) {
+            k = firsts[taken-1] + segs[taken-1];
+            *sent += k - i;
+            for ( ; i < k; i++) dgrams[i].err = IO_DONE;
+            continue;
+        }
+        err = errno;
+        if (err == EINTR) continue;
+        if (err == EAGAIN) {
+            if ((err = socket_waitfd(ps, WAITFD_W, tm)) == IO_DONE) continue;
+            /* nothing else will make it */
+            for ( ; i < count; i++) dgrams[i].err = err;
+            break;
+        }
+        /* the device may not be able to segment this group after all */
+        if (segs[0] > 1) {
+            gso = 0;
+            continue;
+        }
+        /* sendmmsg only fails if the first message failed */
+        dgrams[i++].err = err;
+    }
+    return IO_DONE;
+}
+#else
+int socket_sendmany(p_socket ps, p_outdgram dgrams, int count, int gso,
+        int *sent, p_timeout tm) {
+    int i;
+    (void) gso;
+    *sent = 0;
+    for (i = 0; i < count; i++) {
+        p_outdgram d = dgrams + i;
+        size_t done;
+        if (d->addr_len > 0) d->err = socket_sendto(ps, d->data, d->count,
+            &done, (SA *) &d->addr, d->addr_len, tm);
+        else d->err = socket_send(ps, d->data, d->count, &done, tm);
+        if (d->err == IO_DONE) (*sent)++;
+    }
+    return IO_DONE;
+}
+#endif
+
+
 /*-------------------------------------------------------------------------*\
 * Write with timeout
 *
@@ -50,6 +50,18 @@
 #endif /* IPV6_LEAVE_GROUP */
 #endif /* !IPV6_DROP_MEMBERSHIP */
 
+/* conditions for socket_waitfd */
+#ifndef SOCKET_SELECT
+#include <sys/poll.h>
+#define WAITFD_R        POLLIN
+#define WAITFD_W        POLLOUT
+#define WAITFD_C        (POLLIN|POLLOUT)
+#else
+#define WAITFD_R        1
+#define WAITFD_W        2
+#define WAITFD_C        (WAITFD_R|WAITFD_W)
+#endif
+
 typedef int t_socket;
 typedef t_socket *p_socket;
 typedef struct sockaddr_storage t_sockaddr_storage;
@@ -40,11 +40,6 @@ int socket_close(void) {
 /*-------------------------------------------------------------------------*\
 * Wait for readable/writable/connected socket with timeout
 \*-------------------------------------------------------------------------*/
-#define WAITFD_R        1
-#define WAITFD_W        2
-#define WAITFD_E        4
-#define WAITFD_C        (WAITFD_E|WAITFD_W)
-
 int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
     int ret;
     fd_set rfds, wfds, efds, *rp = NULL, *wp = NULL, *ep = NULL;
@@ -64,6 +59,7 @@ int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
         tp = &tv;
     }
     ret = select(0, rp, wp, ep, tp);
+    timeout_refresh();
     if (ret == -1) return WSAGetLastError();
     if (ret == 0) return IO_TIMEOUT;
     if (sw == WAITFD_C && FD_ISSET(*ps, &efds)) return IO_CLOSED;
@@ -77,12 +73,15 @@ int socket_select(t_socket n, fd_set *rfds, fd_set *wfds, fd_set *efds,
         p_timeout tm) {
     struct timeval tv;
     double t = timeout_get(tm);
+    int ret;
     tv.tv_sec = (int) t;
     tv.tv_usec = (int) ((t - tv.tv_sec) * 1.0e6);
     if (n <= 0) {
         Sleep((DWORD) (1000*t));
-        return 0;
-    } else return select(0, rfds, wfds, efds, t >= 0.0? &tv: NULL);
+        ret = 0;
+    } else ret = select(0, rfds, wfds, efds, t >= 0.0? &tv: NULL);
+    timeout_refresh();
+    return ret;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -106,12 +105,13 @@ void socket_shutdown(p_socket ps, int how) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Creates and sets up a socket
+* Creates and sets up a socket, in non-blocking mode
 \*-------------------------------------------------------------------------*/
 int socket_create(p_socket ps, int domain, int type, int protocol) {
     *ps = socket(domain, type, protocol);
-    if (*ps != SOCKET_INVALID) return IO_DONE;
-    else return WSAGetLastError();
+    if (*ps == SOCKET_INVALID) return WSAGetLastError();
+    socket_setnonblocking(ps);
+    return IO_DONE;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -143,6 +143,46 @@ int socket_connect(p_socket ps, SA *addr, socklen_t len, p_timeout tm) {
 
 }
 
+/*-------------------------------------------------------------------------*\
+* Waits until one of n connection attempts completes, and returns its
+* outcome. Which is set to its index, or to -1 if none completed
+\*-------------------------------------------------------------------------*/
+int socket_waitconnect(p_socket ps, int n, int *which, p_timeout tm) {
+    fd_set wfds, efds;
+    struct timeval tv, *tp = NULL;
+    int i, ret;
+    double t;
+    *which = -1;
+    if (n > SOCKET_MAXCONNECT) return WSAEINVAL;
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    for (i = 0; i < n; i++) {
+        FD_SET(ps[i], &wfds);
+        FD_SET(ps[i], &efds);
+    }
+    if ((t = timeout_getretry(tm)) >= 0.0) {
+        tv.tv_sec = (int) t;
+        tv.tv_usec = (int) ((t-tv.tv_sec)*1.0e6);
+        tp = &tv;
+    }
+    ret = select(0, NULL, &wfds, &efds, tp);
+    timeout_refresh();
+    if (ret == -1) return WSAGetLastError();
+    for (i = 0; i < n && ret > 0; i++) {
+        if (FD_ISSET(ps[i], &wfds)) {
+            *which = i;
+            return IO_DONE;
+        }
+        if (FD_ISSET(ps[i], &efds)) {
+            int err = 0, len = sizeof(err);
+            *which = i;
+            getsockopt(ps[i], SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+            return err > 0? err: IO_UNKNOWN;
+        }
+    }
+    return IO_TIMEOUT;
+}
+
 /*-------------------------------------------------------------------------*\
 * Binds or returns error message
 \*-------------------------------------------------------------------------*/
@@ -166,7 +206,7 @@ int socket_listen(p_socket ps, int backlog) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Accept with timeout
+* Accept with timeout. The new socket is in non-blocking mode
 \*-------------------------------------------------------------------------*/
 int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len,
         p_timeout tm) {
@@ -174,7 +214,10 @@ int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len,
     for ( ;; ) {
         int err;
         /* try to get client socket */
-        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) return IO_DONE;
+        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
         /* find out why we failed */
         err = WSAGetLastError();
         /* if we failed because there was no connectoin, keep trying */
@@ -184,6 +227,25 @@ int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len,
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Accepts a pending connection without waiting. The new socket is left
+* in non-blocking mode
+\*-------------------------------------------------------------------------*/
+int socket_acceptready(p_socket ps, p_socket pa) {
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    for ( ;; ) {
+        int err;
+        if ((*pa = accept(*ps, NULL, NULL)) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
+        err = WSAGetLastError();
+        if (err == WSAECONNABORTED) continue;
+        if (err == WSAEWOULDBLOCK) return IO_TIMEOUT;
+        return err;
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Send with timeout
 * On windows, if you try to send 10MB, the OS will buffer EVERYTHING
@@ -215,6 +277,46 @@ int socket_send(p_socket ps, const char *data, size_t count,
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Vectored send with timeout
+* Hands the pieces to a single WSASend call. As with socket_send, we avoid
+* passing huge amounts of data at once.
+\*-------------------------------------------------------------------------*/
+#define SENDV_MAXIOV 64
+#define SENDV_MAXBYTES 65536
+int socket_sendv(p_socket ps, const t_iobuf *bufs, int n, size_t *sent,
+        p_timeout tm)
+{
+    WSABUF wsabufs[SENDV_MAXIOV];
+    size_t total = 0;
+    int i, err;
+    *sent = 0;
+    /* avoid making system calls on closed sockets */
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (n > SENDV_MAXIOV) n = SENDV_MAXIOV;
+    for (i = 0; i < n && total < SENDV_MAXBYTES; i++) {
+        size_t count = bufs[i].count;
+        if (count > SENDV_MAXBYTES - total) count = SENDV_MAXBYTES - total;
+        wsabufs[i].buf = (char *) bufs[i].data;
+        wsabufs[i].len = (u_long) count;
+        total += count;
+    }
+    n = i;
+    /* loop until we send something or we give up on error */
+    for ( ;; ) {
+        DWORD put = 0;
+        if (WSASend(*ps, wsabufs, n, &put, 0, NULL, NULL) == 0 && put > 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        err = WSAGetLastError();
+        /* we can only proceed if there was no serious error */
+        if (err != WSAEWOULDBLOCK) return err;
+        /* avoid busy wait */
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Sendto with timeout
 \*-------------------------------------------------------------------------*/
@@ -294,6 +396,55 @@ int socket_recvfrom(p_socket ps, char *data, size_t count, size_t *got,
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Receive a batch of datagrams with timeout.
+* Windows has no recvmmsg, so we simply loop over recvfrom, waiting only
+* for the first datagram.
+\*-------------------------------------------------------------------------*/
+int socket_recvmany(p_socket ps, p_dgram dgrams, int count, int *got,
+        p_timeout tm)
+{
+    t_timeout zero;
+    int err;
+    *got = 0;
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    timeout_init(&zero, 0.0, -1);
+    while (*got < count) {
+        p_dgram d = dgrams + *got;
+        d->addr_len = sizeof(d->addr);
+        err = socket_recvfrom(ps, d->data, d->size, &d->len, (SA *) &d->addr,
+            &d->addr_len, *got > 0? &zero: tm);
+        if (err != IO_DONE && err != IO_CLOSED) {
+            if (*got > 0) break;
+            return err;
+        }
+        (*got)++;
+    }
+    return IO_DONE;
+}
+
+/*-------------------------------------------------------------------------*\
+* Send a batch of datagrams with timeout.
+* There is no sendmmsg or segmentation offload on Windows, so we send one
+* datagram at a time.
+\*-------------------------------------------------------------------------*/
+int socket_sendmany(p_socket ps, p_outdgram dgrams, int count, int gso,
+        int *sent, p_timeout tm)
+{
+    int i;
+    (void) gso;
+    *sent = 0;
+    for (i = 0; i < count; i++) {
+        p_outdgram d = dgrams + i;
+        size_t done;
+        if (d->addr_len > 0) d->err = socket_sendto(ps, d->data, d->count,
+            &done, (SA *) &d->addr, d->addr_len, tm);
+        else d->err = socket_send(ps, d->data, d->count, &done, tm);
+        if (d->err == IO_DONE) (*sent)++;
+    }
+    return IO_DONE;
+}
+
 /*-------------------------------------------------------------------------*\
 * Put socket into blocking mode
 \*-------------------------------------------------------------------------*/
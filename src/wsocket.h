@@ -22,6 +22,12 @@ typedef t_socket *p_socket;
 
 #define SOCKET_INVALID (INVALID_SOCKET)
 
+/* conditions for socket_waitfd */
+#define WAITFD_R        1
+#define WAITFD_W        2
+#define WAITFD_E        4
+#define WAITFD_C        (WAITFD_E|WAITFD_W)
+
 #ifndef SO_REUSEPORT
 #define SO_REUSEPORT SO_REUSEADDR
 #endif
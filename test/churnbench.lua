@@ -0,0 +1,40 @@
+-----------------------------------------------------------------------------
+-- Benchmark for connection churn
+-- LuaSocket toolkit.
+--
+-- Creates, connects, accepts and closes sockets over loopback, as fast as
+-- it can. Run it under strace to count the system calls made per
+-- connection, e.g.
+--     strace -c -f lua churnbench.lua 20000
+-----------------------------------------------------------------------------
+local socket = require("socket")
+
+local ROUNDS = tonumber(arg and arg[1]) or 20000
+
+local server = assert(socket.bind("127.0.0.1", 0, 1024))
+local ip, port = server:getsockname()
+
+local function bench(name, round)
+    local t = socket.gettime()
+    for i = 1, ROUNDS do round() end
+    local elapsed = socket.gettime() - t
+    io.write(string.format("%-24s %10.0f per second\n", name,
+        ROUNDS/elapsed))
+end
+
+bench("tcp create/close", function()
+    assert(socket.tcp()):close()
+end)
+
+bench("udp create/close", function()
+    assert(socket.udp()):close()
+end)
+
+bench("tcp connect/accept", function()
+    local c = assert(socket.connect(ip, port))
+    local a = assert(server:accept())
+    a:close()
+    c:close()
+end)
+
+server:close()
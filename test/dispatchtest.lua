@@ -0,0 +1,63 @@
+-----------------------------------------------------------------------------
+-- Coroutine dispatcher test
+-- LuaSocket toolkit.
+-----------------------------------------------------------------------------
+local socket = require("socket")
+local dispatch = require("dispatch")
+
+-- runs func in a coroutine of the handler until it returns
+local function run(handler, func)
+    local done = false
+    local results
+    handler:start(function()
+        results = { func() }
+        done = true
+    end)
+    for i = 1, 20 do
+        if done then break end
+        handler:step()
+    end
+    assert(done, "dispatcher did not finish")
+    return (table.unpack or unpack)(results)
+end
+
+io.write("testing connect through the dispatcher: ")
+local server = assert(socket.bind("127.0.0.1", 0))
+local port = select(2, server:getsockname())
+local handler = dispatch.newhandler("coroutine")
+assert(run(handler, function()
+    local c = handler.tcp()
+    local ok, err = c:connect("127.0.0.1", port)
+    c:close()
+    return ok, err
+end))
+print("ok")
+
+io.write("testing fallback when the first address refuses: ")
+local resolver = handler.resolver
+if resolver then
+    -- answer lookups with an address nobody listens on first
+    handler.resolver = setmetatable({
+        results = function()
+            local lookups = resolver:results()
+            for _, lookup in ipairs(lookups) do
+                if lookup.result then
+                    table.insert(lookup.result, 1,
+                        { family = "inet6", addr = "::1" })
+                end
+            end
+            return lookups
+        end
+    }, { __index = function(self, key)
+        return function(_, ...) return resolver[key](resolver, ...) end
+    end })
+    local ok, err = run(handler, function()
+        local c = handler.tcp()
+        local ok, err = c:connect("localhost", port)
+        c:close()
+        return ok, err
+    end)
+    assert(ok == 1, tostring(err))
+    print("ok")
+else print("skipped (no resolver)") end
+server:close()
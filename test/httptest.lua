@@ -416,6 +416,71 @@ body = http.request("http://" .. host .. prefix .. "/index.html")
 assert(body == index)
 print("ok")
 
+------------------------------------------------------------------------
+io.write("testing keep-alive connection reuse: ")
+http.closeidle()
+local before = http.poolstats()
+for i = 1, 3 do
+    body = http.request{
+        url = "http://" .. host .. prefix .. "/index.html",
+        sink = ltn12.sink.null(),
+        keepalive = true
+    }
+    assert(body == 1)
+end
+local after = http.poolstats()
+assert(after.misses - before.misses == 1, "connection was not reused")
+assert(after.hits - before.hits == 2, "connection was not reused")
+assert(after.idle == 1)
+http.closeidle()
+assert(http.poolstats().idle == 0)
+print("ok")
+
+------------------------------------------------------------------------
+io.write("testing retry when the server drops an idle connection: ")
+-- the peer answers one request on its first connection, and then drops
+-- it when the next request arrives, as if it had timed it out just as
+-- the connection was reused
+local peer, err = spawn([[
+local socket = require("socket")
+local server = assert(socket.bind("127.0.0.1", 0))
+io.write(select(2, server:getsockname()), "\n")
+io.flush()
+local function request(c)
+    repeat
+        local line = c:receive()
+        if not line then return nil end
+    until line == ""
+    return 1
+end
+local response = "HTTP/1.1 200 OK\r\ncontent-length: 2\r\n\r\nok"
+local c = assert(server:accept())
+assert(request(c))
+assert(c:send(response))
+assert(request(c))
+c:close()
+c = assert(server:accept())
+assert(request(c))
+assert(c:send(response))
+c:receive()
+c:close()
+]])
+if peer then
+    local port = assert(tonumber(peer:read("*l")))
+    local u = "http://127.0.0.1:" .. port .. "/"
+    http.closeidle()
+    body = http.request{ url = u, sink = ltn12.sink.null(), keepalive = true }
+    assert(body == 1 and http.poolstats().idle == 1)
+    local t = {}
+    local r, c = http.request{ url = u, sink = ltn12.sink.table(t),
+        keepalive = true }
+    assert(r == 1 and c == 200, tostring(c))
+    assert(table.concat(t) == "ok")
+    http.closeidle()
+    peer:close()
+    print("ok")
+else print("skipped (" .. err .. ")") end
+
 ------------------------------------------------------------------------
 io.write("testing HEAD method: ")
 local r, c, h = http.request {
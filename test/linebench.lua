@@ -0,0 +1,45 @@
+-----------------------------------------------------------------------------
+-- Benchmark for line reception ("*l" pattern)
+-- LuaSocket toolkit.
+--
+-- Runs on its own, over a loopback connection. Run it against two builds
+-- of the library to compare them, e.g.
+--     LUA_CPATH="old/?.so" lua linebench.lua
+--     LUA_CPATH="new/?.so" lua linebench.lua
+-----------------------------------------------------------------------------
+local socket = require("socket")
+
+local TOTAL = tonumber(arg and arg[1]) or 64*1024*1024
+local BLOCK = 64*1024
+
+local server = assert(socket.bind("127.0.0.1", 0))
+local client = assert(socket.connect("127.0.0.1",
+    (select(2, server:getsockname()))))
+local data = assert(server:accept())
+server:close()
+
+local function bench(name, line)
+    -- enough whole lines to fill a block, which always fits the kernel
+    -- buffers, so we can send and receive from the same thread
+    local n = math.floor(BLOCK/#line)
+    local block = string.rep(line, n)
+    local rounds = math.floor(TOTAL/#block)
+    local elapsed = 0
+    for i = 1, rounds do
+        assert(client:send(block))
+        local t = socket.gettime()
+        for j = 1, n do assert(data:receive()) end
+        elapsed = elapsed + socket.gettime() - t
+    end
+    io.write(string.format("%-24s %8.1f MB/s %10.0f lines/s\n", name,
+        rounds*#block/elapsed/1024/1024, rounds*n/elapsed))
+end
+
+bench("short lines (LF)", string.rep("x", 14) .. "\n")
+bench("short lines (CRLF)", string.rep("x", 13) .. "\r\n")
+bench("header lines (CRLF)", "Content-Type: text/html; charset=utf-8\r\n")
+bench("long lines (CRLF)", string.rep("x", 1022) .. "\r\n")
+bench("very long lines (CRLF)", string.rep("x", 32766) .. "\r\n")
+
+client:close()
+data:close()
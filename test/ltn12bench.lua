@@ -0,0 +1,109 @@
+-----------------------------------------------------------------------------
+-- Benchmark for ltn12 pumps between files and sockets
+-- LuaSocket toolkit.
+--
+-- Pumps a file into a socket, and a socket into a file, with different
+-- block sizes, with small blocks coalesced, and through the native pump.
+-- The other end of the connection runs in a child process, e.g.
+--     lua ltn12bench.lua [size]
+-----------------------------------------------------------------------------
+local socket = require("socket")
+local ltn12 = require("ltn12")
+dofile("testsupport.lua")
+
+local SIZE = tonumber(arg and arg[1]) or 64*1024*1024
+local BLOCKS = { 2048, 8192, 32768, 131072 }
+
+-- the other end: discards what it receives, or sends what it is asked to
+local peer = assert(spawn([[
+local socket = require("socket")
+local ltn12 = require("ltn12")
+local server = assert(socket.bind("127.0.0.1", 0))
+local _, port = server:getsockname()
+io.write(port, "\n")
+io.flush()
+local block = string.rep("0123456789abcdef", 4096)
+while true do
+    local c = assert(server:accept())
+    local line = assert(c:receive())
+    if line == "quit" then break end
+    local n = tonumber(string.match(line, "^send (%d+)$"))
+    if n then
+        while n > 0 do
+            assert(c:send(block, 1, math.min(n, #block)))
+            n = n - #block
+        end
+    else
+        assert(ltn12.pump.all(socket.source("until-closed", c, #block),
+            ltn12.sink.null()))
+    end
+    c:close()
+end
+]]))
+local port = assert(tonumber(peer:read("*l")))
+
+local function connect(line)
+    local c = assert(socket.connect("127.0.0.1", port))
+    assert(c:send(line .. "\n"))
+    return c
+end
+
+-- a step that is not pump.step, so that the native pump is not used
+local function step(src, snk)
+    return ltn12.pump.step(src, snk)
+end
+
+local name = os.tmpname()
+local file = assert(io.open(name, "wb"))
+local block = string.rep("0123456789abcdef", 4096)
+for j = 1, math.ceil(SIZE/#block) do file:write(block) end
+file:close()
+SIZE = math.ceil(SIZE/#block)*#block
+
+local function report(label, elapsed)
+    io.write(string.format("%-32s %8.1f MB/s\n", label,
+        SIZE/elapsed/1024/1024))
+end
+
+local function tosocket(label, source, s)
+    local c = connect("recv")
+    local t = socket.gettime()
+    assert(ltn12.pump.all(source(io.open(name, "rb")),
+        socket.sink("keep-open", c), s))
+    -- the peer closes once it has seen everything
+    c:shutdown("send")
+    c:receive()
+    report(label, socket.gettime() - t)
+    c:close()
+end
+
+local function fromsocket(label, size, s)
+    local c = connect("send " .. SIZE)
+    local t = socket.gettime()
+    assert(ltn12.pump.all(socket.source("by-length", c, SIZE, size),
+        ltn12.sink.file(io.open(name .. ".out", "wb")), s))
+    report(label, socket.gettime() - t)
+    c:close()
+end
+
+io.write("file -> socket\n")
+for _, size in ipairs(BLOCKS) do
+    tosocket("  block " .. size, function(f)
+        return ltn12.source.file(f, nil, size)
+    end, step)
+end
+tosocket("  block 2048, coalesced", function(f)
+    return ltn12.source.chain(ltn12.source.file(f), ltn12.filter.coalesce())
+end, step)
+tosocket("  native", ltn12.source.file)
+
+io.write("socket -> file\n")
+for _, size in ipairs(BLOCKS) do
+    fromsocket("  block " .. size, size, step)
+end
+fromsocket("  native")
+
+connect("quit"):close()
+peer:close()
+os.remove(name)
+os.remove(name .. ".out")
@@ -297,3 +297,25 @@ assert(filter4(nil, 1), "filter4 not empty")
 assert(filter5(nil, 1), "filter5 not empty")
 print("ok")
 
+
+--------------------------------
+io.write("testing filter.coalesce: ")
+source = ltn12.source.chain(ltn12.source.string(s, 3),
+    ltn12.filter.coalesce(10, 20))
+sink, t = ltn12.sink.table()
+assert(ltn12.pump.all(source, sink), "returned error")
+assert(table.concat(t) == s, "mismatch")
+for i = 1, #t - 1 do assert(#t[i] >= 10 and #t[i] <= 20, "bad size") end
+-- large chunks are not split, and small ones are not held past them
+sink, t = ltn12.sink.table()
+source = ltn12.source.cat(ltn12.source.string("ab"),
+    ltn12.source.string(string.rep("x", 50), 50), ltn12.source.string("cd"))
+assert(ltn12.pump.all(ltn12.source.chain(source,
+    ltn12.filter.coalesce(10, 20)), sink))
+assert(#t == 3 and t[1] == "ab" and #t[2] == 50 and t[3] == "cd")
+sink, t = ltn12.sink.table()
+source = ltn12.source.chain(ltn12.source.string(s, 7),
+    ltn12.filter.coalesce(100))
+assert(ltn12.pump.all(source, sink))
+assert(table.concat(t) == s, "mismatch")
+print("ok")
@@ -0,0 +1,86 @@
+-----------------------------------------------------------------------------
+-- Benchmark for SMTP message bodies with encoded attachments
+-- LuaSocket toolkit.
+--
+-- Builds the same message with chained MIME filters and with the single
+-- pass filters, and pumps each through smtp.message and mime.stuff, as
+-- smtp.send would, into a sink that discards the data.
+-----------------------------------------------------------------------------
+local socket = require("socket")
+local ltn12 = require("ltn12")
+local mime = require("mime")
+local smtp = require("socket.smtp")
+
+local SIZE = tonumber(arg and arg[1]) or 8*1024*1024
+local ROUNDS = 5
+
+local bytes = {}
+for i = 1, 4096 do bytes[i] = string.char(math.random(0, 255)) end
+local binary = string.rep(table.concat(bytes), math.ceil(SIZE/4096))
+local text = string.rep("Quoted-printable text, with = signs, trailing " ..
+    "spaces \nand bare line feeds, which need normalizing.\n",
+    math.ceil(SIZE/96))
+
+local function chained()
+    return ltn12.filter.chain(mime.encode("base64"), mime.wrap("base64")),
+        ltn12.filter.chain(mime.normalize(), mime.encode("quoted-printable"),
+            mime.wrap("quoted-printable"))
+end
+
+local function fused()
+    return mime.b64wrap(), mime.eolqpwrap()
+end
+
+local function message(filters)
+    local b64, qp = filters()
+    return smtp.message{
+        headers = { subject = "benchmark" },
+        body = {
+            [1] = {
+                headers = {
+                    ["content-type"] = 'text/plain; charset="iso-8859-1"',
+                    ["content-transfer-encoding"] = "quoted-printable"
+                },
+                body = ltn12.source.chain(ltn12.source.string(text), qp)
+            },
+            [2] = {
+                headers = {
+                    ["content-type"] = "application/octet-stream",
+                    ["content-disposition"] =
+                        'attachment; filename="data.bin"',
+                    ["content-transfer-encoding"] = "base64"
+                },
+                body = ltn12.source.chain(ltn12.source.string(binary), b64)
+            }
+        }
+    }
+end
+
+local function bench(name, filters)
+    local best = math.huge
+    for i = 1, ROUNDS do
+        local source = ltn12.source.chain(message(filters), mime.stuff())
+        local t = socket.gettime()
+        assert(ltn12.pump.all(source, ltn12.sink.null()))
+        best = math.min(best, socket.gettime() - t)
+    end
+    io.write(string.format("%-16s %8.1f MB/s\n", name,
+        (#binary + #text)/best/1024/1024))
+end
+
+-- make sure both produce the same bodies before timing them
+local function encode(source, filter)
+    local t = {}
+    assert(ltn12.pump.all(ltn12.source.chain(source, filter),
+        ltn12.sink.table(t)))
+    return table.concat(t)
+end
+local b64c, qpc = chained()
+local b64f, qpf = fused()
+assert(encode(ltn12.source.string(binary), b64c) ==
+    encode(ltn12.source.string(binary), b64f))
+assert(encode(ltn12.source.string(text), qpc) ==
+    encode(ltn12.source.string(text), qpf))
+
+bench("chained filters", chained)
+bench("single pass", fused)
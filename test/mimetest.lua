@@ -151,6 +151,32 @@ local function create_qptest()
     f:close()
 end
 
+local function split_qptest()
+io.write("testing qp split input: ")
+    local text = "plain text, trailing space \r\ntab\t\r\n=3D\255 end "
+    local whole = mime.qp(text)
+    assert(mime.unqp(whole) == text)
+    for i = 0, #text do
+        local a, b = mime.qp(string.sub(text, 1, i), string.sub(text, i+1))
+        assert(a .. (mime.qp(b) or "") == whole)
+        a, b = mime.unqp(string.sub(whole, 1, i), string.sub(whole, i+1))
+        assert(a .. (mime.unqp(b) or "") == text)
+    end
+    print("ok")
+end
+
+local function fused_qptest()
+io.write("testing qp single pass filter: ")
+    local chain = ltn12.filter.chain(
+        mime.normalize(),
+        mime.encode("quoted-printable"),
+        mime.wrap("quoted-printable")
+    )
+    transform(qptest, eqptest, chain)
+    transform(qptest, dqptest, mime.eolqpwrap())
+    compare(eqptest, dqptest)
+end
+
 local function cleanup_qptest()
     os.remove(qptest)
     os.remove(eqptest)
@@ -192,6 +218,14 @@ local function decode_b64test()
     transform(eb64test, db64test, chain)
 end
 
+local function fused_b64test()
+io.write("testing b64 single pass filter: ")
+    local chain = ltn12.filter.chain(mime.encode("base64"), mime.wrap("base64"))
+    transform(b64test, eb64test, chain)
+    transform(b64test, db64test, mime.b64wrap())
+    compare(eb64test, db64test)
+end
+
 local function cleanup_b64test()
     os.remove(b64test)
     os.remove(eb64test)
@@ -275,6 +309,31 @@ io.write("testing b64 low-level: ")
     print("ok")
 end
 
+local function test_b64bulk()
+io.write("testing b64 bulk: ")
+    local bytes = {}
+    for i = 1, 10000 do bytes[i] = string.char(math.random(0, 255)) end
+    local binary = table.concat(bytes)
+    local encoded = mime.b64(binary)
+    assert(#encoded == math.ceil(#binary/3)*4)
+    assert(mime.unb64(encoded) == binary)
+    -- line breaks and stray characters must not get in the way
+    local wrapped = string.gsub(encoded, string.rep(".", 76), "%0\r\n")
+    assert(mime.unb64(wrapped) == binary)
+    assert(mime.unb64((string.gsub(encoded, "(....)", "%1 *"))) == binary)
+    -- splitting the input at any point must not change the result
+    local short = string.sub(binary, 1, 64)
+    local whole = mime.b64(short)
+    for i = 0, #short do
+        local a, b = mime.b64(string.sub(short, 1, i), string.sub(short, i+1))
+        local c = mime.b64(b)
+        assert(a .. c == whole)
+        a, b = mime.unb64(string.sub(whole, 1, i), string.sub(whole, i+1))
+        assert(a == short and b == "")
+    end
+    print("ok")
+end
+
 local t = socket.gettime()
 
 create_b64test()
@@ -282,9 +341,11 @@ identity_test()
 encode_b64test()
 decode_b64test()
 compare_b64test()
+fused_b64test()
 cleanup_b64test()
 padding_b64test()
 test_b64lowlevel()
+test_b64bulk()
 
 create_qptest()
 encode_qptest()
@@ -293,6 +354,8 @@ compare_qptest()
 encode_qptest("binary")
 decode_qptest()
 compare_qptest()
+split_qptest()
+fused_qptest()
 cleanup_qptest()
 
 
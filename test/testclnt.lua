@@ -1,4 +1,5 @@
 local socket = require"socket"
+assert(loadfile("testsupport.lua"))("globals")
 
 host = host or "localhost"
 port = port or "8383"
@@ -199,6 +200,25 @@ remote "data:send(str)"
     else fail("blocks don't match") end
 end
 
+------------------------------------------------------------------------
+function test_sendv(len)
+    reconnect()
+    io.stderr:write("length " .. len .. ": ")
+    local parts = { "", string.rep("x", math.floor(len/3)), "z",
+        string.rep("y", len - math.floor(len/3) - 1), "" }
+    local all = table.concat(parts)
+remote (string.format("str = data:receive(%d)", len - 2))
+    -- skip the first and last bytes, as with send
+    local sent, err = data:sendv(parts, 2, -2)
+    if err then fail(err) end
+    assert(sent == len - 1, "wrong index returned")
+remote "data:send(str)"
+    local back, err = data:receive(len - 2)
+    if err then fail(err) end
+    if back == string.sub(all, 2, -2) then pass("blocks match")
+    else fail("blocks don't match") end
+end
+
 ------------------------------------------------------------------------
 function test_totaltimeoutreceive(len, tm, sl)
     reconnect()
@@ -438,6 +458,33 @@ function accept_errors()
     pass("ok")
 end
 
+function accept_many()
+    printf("accept many: ")
+    local s = assert(socket.bind("127.0.0.1", 0))
+    local ip, port = s:getsockname()
+    s:settimeout(0)
+    local r, e = s:acceptmany()
+    assert(not r and e == "timeout", string.format("wrong error (%s)", e))
+    local c = {}
+    for i = 1, 5 do c[i] = assert(socket.connect(ip, port)) end
+    s:settimeout(1)
+    r = assert(s:acceptmany(3))
+    assert(#r == 3, "max not honored")
+    local t = assert(s:acceptmany())
+    for i = 1, #t do r[#r+1] = t[i] end
+    -- the last ones may still be on their way
+    while #r < 5 do r[#r+1] = assert(s:accept()) end
+    for i = 1, 5 do
+        assert(string.match(tostring(r[i]), "^tcp{client}"))
+        assert(c[i]:send(i .. "\n"))
+        assert(r[i]:receive() == tostring(i), "wrong order")
+        r[i]:close()
+        c[i]:close()
+    end
+    s:close()
+    pass("ok")
+end
+
 ------------------------------------------------------------------------
 function connect_errors()
     printf("connection refused: ")
@@ -450,6 +497,40 @@ function connect_errors()
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function connect_eyeballs()
+    printf("connect racing addresses: ")
+    local s = assert(socket.bind("127.0.0.1", 0))
+    local _, port = s:getsockname()
+    -- localhost may resolve to ::1 first, which refuses the connection
+    local c = assert(socket.tcp())
+    c:settimeout(2)
+    assert(c:connect("localhost", port, true))
+    local a = assert(s:accept())
+    assert(c:send("ping\n"))
+    assert(a:receive() == "ping")
+    a:close()
+    c:close()
+    c = assert(socket.connect("localhost", port, nil, nil, nil, 0.05))
+    c:close()
+    s:close()
+    pass("ok")
+    printf("connect racing unreachable addresses: ")
+    -- 192.0.2.1 is reserved for documentation (TEST-NET-1), so it is
+    -- either not routed at all or never answers
+    c = assert(socket.tcp())
+    c:settimeout(0.5)
+    local t = socket.gettime()
+    local r, e = c:connect("192.0.2.1", 81, 0.1)
+    assert(not r and e, "should not connect")
+    assert(socket.gettime() - t < 2, "took too long to give up.")
+    -- the race keeps its attempts to itself, while a sequential connect
+    -- would have left the failed socket in the object
+    assert(c:getfd() == -1, "addresses were not raced")
+    c:close()
+    pass("ok")
+end
+
 ------------------------------------------------------------------------
 function rebind_test()
    local c ,c1 = socket.bind("127.0.0.1", 0)
@@ -488,6 +569,263 @@ function getstats_test()
 end
 
 
+------------------------------------------------------------------------
+function test_buffersize()
+    local size, release = socket.tcp():getbuffersize()
+    assert(size == 8192 and release == false)
+    for _, config in ipairs{{3, true}, {17, false}, {1048576, true}} do
+        reconnect()
+        assert(data:setbuffersize(config[1], config[2]))
+        size, release = data:getbuffersize()
+        assert(size == config[1] and release == config[2])
+        local p1 = string.rep("x", 1000) .. "\n"
+        local p2 = string.rep("y", 100000)
+remote (string.format("str = data:receive(%d)", #p1 + #p2))
+        data:send(p1 .. p2)
+remote "data:send(str); data:close()"
+        local bp1 = assert(data:receive())
+        -- shrinking while data is buffered must keep it
+        assert(data:setbuffersize(1))
+        local bp2 = assert(data:receive("*a"))
+        assert(bp1 .. "\n" == p1 and bp2 == p2, "patterns don't match")
+    end
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_framed()
+    reconnect()
+remote [[
+    data:send("GET / HTTP/1.0\r\nHost: x\r\n\r\nbody\0")
+    data:send("\0\5hello\5\0\0\0world")
+    data:send("\0\0\1\0" .. string.rep("x", 256))
+    data:send("toolongline\n")
+]]
+    local head = assert(data:receive{delimiter = "\r\n\r\n"})
+    assert(head == "GET / HTTP/1.0\r\nHost: x", "delimiter failed")
+    assert(data:receive{delimiter = "\0", max = 4} == "body")
+    assert(data:receive{length = 2} == "hello", "big endian failed")
+    assert(data:receive{length = 4, endian = "little"} == "world",
+        "little endian failed")
+    assert(data:receive{length = 4, max = 256} == string.rep("x", 256))
+    local ret, err, partial = data:receive{delimiter = "\n", max = 4}
+    assert(not ret and err == "limit exceeded", "limit failed")
+    assert(partial == "toolo", "wrong partial result")
+    assert(not pcall(data.receive, data, {length = 3}))
+    assert(not pcall(data.receive, data, {delimiter = ""}))
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_receiveheaders()
+    reconnect()
+remote [[
+    data:send("Content-Type: text/html\r\nX-Folded: a\r\n\32\32b\r\n")
+    data:send("set-cookie: x=1\r\nSet-Cookie: y=2\r\n\r\nbody\n")
+    data:send("bad header\r\n")
+]]
+    local h = assert(data:receiveheaders())
+    assert(h["content-type"] == "text/html", "simple field failed")
+    assert(h["x-folded"] == "a  b", "folding failed")
+    assert(h["set-cookie"] == "x=1, y=2", "joining failed")
+    assert(data:receive() == "body")
+    local t = {["content-type"] = "x"}
+    local ret, err = data:receiveheaders(t)
+    assert(not ret and err == "malformed reponse headers")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_chunked()
+    reconnect()
+    local big = string.rep("x", 100000)
+remote [[
+    data:send("5;ext=1\r\nhello\r\n")
+    data:send("186A0\r\n" .. string.rep("x", 100000) .. "\r\n")
+    data:send("0\r\nx-trailer: yes\r\n\r\nzz\r\n")
+    str = data:receive("*a")
+    data:close()
+]]
+    assert(data:receivechunk() == "hello")
+    assert(data:receivechunk() == big)
+    assert(data:receivechunk() == "")
+    assert(data:receiveheaders()["x-trailer"] == "yes")
+    local ret, err = data:receivechunk()
+    assert(not ret and err == "invalid chunk size")
+    assert(data:sendchunk("abc"))
+    assert(data:sendchunk(""))
+    assert(data:sendchunk(big))
+    assert(data:sendchunk())
+    data:close()
+remote [[
+    local x = string.rep("x", 100000)
+    assert(str == "3\r\nabc\r\n186A0\r\n" .. x .. "\r\n0\r\n\r\n")
+]]
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_outputbuffer()
+    reconnect()
+    assert(data:setoutputbuffer(16))
+remote "str = data:receive(); data:send(str .. '\\n')"
+    -- small writes are held until the receive below
+    assert(data:send("abc") == 3)
+    assert(data:sendv({"de", "fg"}) == 4)
+    local _, sent = data:getstats()
+    assert(sent == 0, "output was not buffered")
+    -- writes that do not fit go out with the pending output
+    local big = string.rep("x", 100)
+    assert(data:send(big) == 100)
+    _, sent = data:getstats()
+    assert(sent == 107, "pending output was not sent")
+    assert(data:send("\n") == 1)
+    local back = assert(data:receive())
+    assert(back == "abcdefg" .. big, "lines don't match")
+    -- explicit flush
+remote "str = data:receive(); data:send(str .. '\\n')"
+    assert(data:send("hello\n"))
+    assert(data:flush())
+    _, sent = data:getstats()
+    assert(sent == 114, "flush did not send")
+    assert(data:receive() == "hello")
+    assert(data:setoutputbuffer(0))
+    pass("ok")
+    -- resizing the input buffer keeps pending output
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local client = assert(socket.connect("127.0.0.1",
+        (select(2, server:getsockname()))))
+    local peer = assert(server:accept())
+    peer:settimeout(1)
+    assert(client:setoutputbuffer(64))
+    assert(client:send("kept\n"))
+    assert(client:setbuffersize(1024))
+    assert(client:flush())
+    assert(peer:receive() == "kept", "pending output was dropped")
+    pass("setbuffersize keeps output: ok")
+    -- closing sends pending output
+    assert(client:send("last\n"))
+    assert(client:close())
+    assert(peer:receive() == "last", "close dropped pending output")
+    assert(peer:receive() == nil)
+    peer:close()
+    server:close()
+    pass("close sends output: ok")
+end
+
+------------------------------------------------------------------------
+function test_splice()
+    local ltn12 = require("ltn12")
+    local big = string.rep("0123456789abcdef", 65536)
+    local name = os.tmpname()
+    reconnect()
+remote [[
+    data:send("head\n" .. string.rep("0123456789abcdef", 65536) .. "tail")
+    data:close()
+]]
+    -- buffered input goes first
+    assert(data:receive() == "head")
+    local file = assert(io.open(name, "w+b"))
+    assert(socket.cansplice(data) and socket.cansplice(file))
+    assert(not socket.cansplice(socket.tcp()))
+    assert(not socket.cansplice(setmetatable({}, {
+        __tostring = function() return "tcp{client}: fake" end })))
+    assert(socket.splice(data, file, #big) == #big)
+    local ret, err, n = socket.splice(data, file, 10)
+    assert(not ret and err == "closed" and n == 4)
+    file:seek("set")
+    assert(file:read("*a") == big .. "tail")
+    -- file positions are honored
+    reconnect()
+remote [[
+    str = data:receive(16*65536 - 12)
+    data:send(str)
+]]
+    file:seek("set", 16)
+    assert(socket.splice(file, data) == #big - 12)
+    assert(file:seek() == #big + 4)
+    assert(data:receive(#big - 12) == string.sub(big, 17) .. "tail")
+    file:close()
+    -- ltn12 pumps between sockets and files
+    reconnect()
+remote [[
+    data:send(string.rep("0123456789abcdef", 65536))
+    str = data:receive("*a")
+    data:send(str)
+]]
+    local source = socket.source("by-length", data, #big)
+    assert(ltn12.pump.all(source, ltn12.sink.file(io.open(name, "wb"))))
+    assert(ltn12.pump.all(ltn12.source.file(io.open(name, "rb")),
+        socket.sink("keep-open", data)))
+    data:shutdown("send")
+    assert(data:receive(#big) == big)
+    os.remove(name)
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_sendfile()
+    local big = string.rep("0123456789abcdef", 65536)
+    local name = os.tmpname()
+    local file = assert(io.open(name, "w+b"))
+    file:write(big)
+    reconnect()
+remote [[
+    str = data:receive(16*65536 - 12)
+    data:send(str)
+]]
+    -- explicit offsets leave the file position alone
+    assert(data:sendfile(file, 16, 16) == 16)
+    assert(file:seek() == #big)
+    file:seek("set", 32)
+    assert(data:sendfile(file, nil, 2) == 2)
+    assert(file:seek() == 34)
+    assert(data:send("xy") == 2)
+    assert(data:sendfile(file) == #big - 34)
+    assert(file:seek() == #big)
+    local ret, err, n = data:sendfile(file, #big - 2, 10)
+    assert(not ret and err == "closed" and n == 2)
+    local _, sent = data:getstats()
+    assert(sent == #big - 12)
+    assert(data:receive(#big - 12) == string.sub(big, 17, 34) .. "xy" ..
+        string.sub(big, 35) .. string.sub(big, -2))
+    file:close()
+    os.remove(name)
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function test_monotime()
+    local t = socket.monotime()
+    socket.sleep(0.1)
+    local elapsed = socket.monotime() - t
+    assert(elapsed >= 0.09 and elapsed < 1, "bad monotonic clock")
+    -- with caching on, time only moves when the cache is updated
+    local cached = socket.cachetime(true)
+    socket.sleep(0.1)
+    assert(socket.cachetime(true) - cached >= 0.09)
+    reconnect()
+    data:settimeout(0.1)
+    local ret, err = data:receive()
+    assert(not ret and err == "timeout")
+    assert(socket.cachetime(false) >= cached)
+    pass("ok")
+    -- total timeouts run down while data trickles in, even with caching on
+    reconnect()
+    remote [[
+        for i = 1, 20 do data:send("x"); socket.sleep(0.1) end
+    ]]
+    socket.cachetime(true)
+    data:settimeout(0.5, "t")
+    local t = socket.monotime()
+    ret, err = data:receive(40)
+    local elapsed = socket.monotime() - t
+    socket.cachetime(false)
+    assert(not ret and err == "timeout")
+    assert(elapsed < 1.5, "total timeout did not run down")
+    pass("cached time in repeated waits: ok")
+end
+
 ------------------------------------------------------------------------
 function test_nonblocking(size)
     reconnect()
@@ -526,6 +864,308 @@ remote(string.format([[
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function test_poller()
+    if not socket.poller then
+        pass("poller not available")
+        return
+    end
+    local poller = assert(socket.poller())
+    local r, s, e = poller:wait(0.1)
+    assert(type(r) == "table" and type(s) == "table" and e == "timeout")
+    pass("empty wait: ok")
+    local udp = socket.udp()
+    assert(udp:setsockname("127.0.0.1", 0))
+    assert(poller:add(udp, "rw"))
+    local ok, err = poller:add(udp)
+    assert(not ok and err == "already registered", tostring(err))
+    assert(poller:count() == 1)
+    r, s, e = poller:wait(0.1)
+    assert(#r == 0 and s[1] == udp and s[udp] == 1 and not e)
+    pass("writable: ok")
+    assert(poller:modify(udp, "r"))
+    r, s, e = poller:wait(0.1)
+    assert(#r == 0 and #s == 0 and e == "timeout")
+    local ip, port = udp:getsockname()
+    assert(udp:sendto("poller", ip, port))
+    r, s, e = poller:wait(1)
+    assert(r[1] == udp and r[udp] == 1 and #s == 0 and not e)
+    assert(udp:receive() == "poller")
+    pass("readable: ok")
+    assert(poller:remove(udp))
+    ok, err = poller:remove(udp)
+    assert(not ok and err == "not registered", tostring(err))
+    assert(poller:count() == 0)
+    pass("remove: ok")
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local client = assert(socket.connect("127.0.0.1",
+        (select(2, server:getsockname()))))
+    local peer = assert(server:accept())
+    assert(poller:add(server))
+    assert(poller:add(peer))
+    assert(client:send("first\nsecond\n"))
+    r, s, e = poller:wait(1)
+    assert(r[1] == peer and #r == 1 and not e)
+    -- the second line is left in the buffer, with nothing in the kernel
+    assert(peer:receive() == "first")
+    r, s, e = poller:wait(0.1)
+    assert(r[1] == peer and #r == 1 and not e)
+    assert(peer:receive() == "second")
+    r, s, e = poller:wait(0.1)
+    assert(#r == 0 and e == "timeout")
+    assert(poller:remove(peer))
+    assert(poller:remove(server))
+    assert(poller:count() == 0)
+    peer:close()
+    client:close()
+    server:close()
+    pass("buffered tcp input: ok")
+    -- dirty() methods can change the registrations while wait runs
+    local function wrap(u, isdirty)
+        return { getfd = function() return u:getfd() end, dirty = isdirty }
+    end
+    local u1, u2 = socket.udp(), socket.udp()
+    assert(u1:setsockname("127.0.0.1", 0))
+    assert(u2:setsockname("127.0.0.1", 0))
+    local w1, w2
+    w1 = wrap(u1, function() assert(poller:remove(w2)) return true end)
+    w2 = wrap(u2, function() return true end)
+    assert(poller:add(w1))
+    assert(poller:add(w2))
+    r, s, e = poller:wait(0.1)
+    assert(r[1] == w1 and #r == 1 and not r[w2] and not e)
+    assert(poller:count() == 1)
+    local closer = assert(socket.poller())
+    assert(closer:add(wrap(u2, function() closer:close() return true end)))
+    r, s, e = closer:wait(0.1)
+    assert(e == "closed", tostring(e))
+    assert(poller:remove(w1))
+    u1:close()
+    u2:close()
+    pass("dirty methods changing registrations: ok")
+    e = pcall(poller.add, poller, udp, "x")
+    assert(e == false, tostring(e))
+    pass("invalid input: ok")
+    udp:close()
+    poller:close()
+    e = pcall(poller.wait, poller, 0)
+    assert(e == false, tostring(e))
+    pass("closed poller: ok")
+end
+
+------------------------------------------------------------------------
+function test_resolver()
+    if not socket.resolver then
+        pass("resolver not available")
+        return
+    end
+    local resolver = assert(socket.resolver(2))
+    assert(#resolver:results() == 0 and resolver:pending() == 0)
+    local ids = {
+        [assert(resolver:getaddrinfo("localhost"))] = "localhost",
+        [assert(resolver:getaddrinfo("127.0.0.1", "inet"))] = "ip",
+        [assert(resolver:getaddrinfo("host.is.invalid"))] = "invalid",
+        [assert(resolver:getnameinfo("127.0.0.1"))] = "name"
+    }
+    assert(resolver:pending() == 4)
+    local r, e = resolver:getnameinfo("not an address")
+    assert(not r and e)
+    local found = {}
+    while resolver:pending() > 0 do
+        local r, _, e = socket.select({resolver}, nil, 5)
+        assert(r[1] == resolver, tostring(e))
+        for _, lookup in ipairs(resolver:results()) do
+            found[ids[lookup.id]] = lookup
+        end
+    end
+    assert(#found.localhost.result > 0)
+    assert(found.ip.result[1].addr == "127.0.0.1")
+    assert(found.ip.result[1].family == "inet")
+    assert(not found.invalid.result and found.invalid.err)
+    assert(type(found.name.result) == "string")
+    -- nothing left, so the descriptor is no longer readable
+    r = socket.select({resolver}, nil, 0.1)
+    assert(#r == 0)
+    pass("lookups: ok")
+    resolver:getaddrinfo("localhost")
+    resolver:close()
+    assert(resolver:pending() == 0)
+    e = pcall(resolver.getaddrinfo, resolver, "localhost")
+    assert(e == false, tostring(e))
+    pass("closed resolver: ok")
+    -- workers still busy when the state goes away must not crash
+    local pipe, err = spawn([[
+        local r = require"socket".resolver(64)
+        for i = 1, 1024 do r:getaddrinfo("localhost") end
+        io.write("queued")
+    ]])
+    if not pipe then
+        pass("state closed with lookups in flight: skipped (%s)", err)
+        return
+    end
+    local out = pipe:read("*a")
+    local ok, how, code = pipe:close()
+    assert(out == "queued", out)
+    assert(ok, tostring(how) .. " " .. tostring(code))
+    pass("state closed with lookups in flight: ok")
+end
+
+------------------------------------------------------------------------
+function test_dnscache()
+    assert(socket.dns.setcache(60, 2, 10))
+    local ttl, size, negttl, count = socket.dns.getcache()
+    assert(ttl == 60 and size == 2 and negttl == 10 and count == 0)
+    local a = assert(socket.dns.getaddrinfo("localhost"))
+    local b = assert(socket.dns.getaddrinfo("localhost"))
+    assert(#a == #b and a[1].addr == b[1].addr)
+    local entries, hits = select(4, socket.dns.getcache())
+    assert(entries == 1 and hits == 1)
+    -- names too long for DNS are rejected as unknown without a query
+    local bad = string.rep("x", 300)
+    local r, e = socket.dns.getaddrinfo(bad)
+    assert(not r and e)
+    assert(select(4, socket.dns.getcache()) == 2)
+    assert(select(6, socket.dns.getcache()) == 1)
+    local r2, e2 = socket.dns.getaddrinfo(bad)
+    assert(not r2 and e2 == e)
+    assert(select(5, socket.dns.getcache()) == 2)
+    -- numeric addresses skip the cache
+    assert(socket.dns.getaddrinfo("127.0.0.1"))
+    assert(select(4, socket.dns.getcache()) == 2)
+    assert(select(5, socket.dns.getcache()) == 2)
+    pass("cached answers: ok")
+    -- connect goes through the cache too, which never grows past its size
+    local s = assert(socket.bind("127.0.0.1", 0))
+    local _, p = s:getsockname()
+    local c = assert(socket.connect("localhost", p))
+    assert(select(4, socket.dns.getcache()) == 2)
+    c:close()
+    s:close()
+    assert(socket.dns.flush("localhost"))
+    assert(select(4, socket.dns.getcache()) == 1)
+    assert(select(6, socket.dns.getcache()) == 1)
+    assert(socket.dns.flush())
+    assert(select(4, socket.dns.getcache()) == 0)
+    pass("flush: ok")
+    -- without a negative time to live, failed lookups are not kept
+    assert(socket.dns.setcache(60, 2, 0))
+    assert(not socket.dns.getaddrinfo(bad))
+    assert(select(4, socket.dns.getcache()) == 0)
+    pass("uncached failures: ok")
+    assert(socket.dns.setcache(nil))
+    assert(select(2, socket.dns.getcache()) == 0)
+    assert(socket.dns.getaddrinfo("localhost"))
+    assert(select(4, socket.dns.getcache()) == 0)
+    pass("disabled cache: ok")
+end
+
+------------------------------------------------------------------------
+function test_receivemany()
+    local udp = socket.udp4()
+    assert(udp:setsockname("127.0.0.1", 0))
+    local ip, port = udp:getsockname()
+    udp:settimeout(0.1)
+    local d, s = udp:receivemany(8)
+    assert(not d and s == "timeout", tostring(s))
+    pass("timeout: ok")
+    for i = 1, 5 do
+        assert(udp:sendto("datagram " .. i, ip, port))
+    end
+    d, s = udp:receivemany(3)
+    assert(#d == 3 and #s == 3)
+    assert(d[1] == "datagram 1" and d[3] == "datagram 3")
+    assert(s[1] == s[2] and s[2] == s[3])
+    local sip, sport, family = socket.dns.unpackaddr(s[1])
+    assert(sip == ip and sport == tonumber(port) and family == "inet")
+    d, s = udp:receivemany(8, 4)
+    assert(#d == 2 and d[1] == "data" and d[2] == "data")
+    pass("batch: ok")
+    assert(udp:sendto("", ip, port))
+    d = udp:receivemany(8)
+    assert(#d == 1 and d[1] == "")
+    pass("empty datagram: ok")
+    local e = pcall(udp.receivemany, udp, 0)
+    assert(e == false, tostring(e))
+    e = pcall(udp.receivemany, udp, 8, -1)
+    assert(e == false, tostring(e))
+    e = pcall(udp.receivemany, udp, 8, 2^40)
+    assert(e == false, tostring(e))
+    assert(not socket.dns.unpackaddr("bogus"))
+    pass("invalid input: ok")
+    udp:close()
+end
+
+------------------------------------------------------------------------
+function test_sendmany()
+    local udp = socket.udp4()
+    assert(udp:setsockname("127.0.0.1", 0))
+    local ip, port = udp:getsockname()
+    udp:settimeout(1)
+    local sender = socket.udp4()
+    local n, errs = sender:sendmany({
+        {"first", ip, port},
+        {"bogus", "not an address", port},
+        {"third", ip, port}
+    })
+    assert(n == 2 and errs and errs[2] and not errs[1] and not errs[3])
+    local d = udp:receivemany(8)
+    assert(#d == 2 and d[1] == "first" and d[2] == "third")
+    pass("unconnected: ok")
+    assert(sender:setpeername(ip, port))
+    local list = {}
+    for i = 1, 10 do list[i] = string.rep("x", 100) end
+    list[11] = "tail"
+    n, errs = sender:sendmany(list, true)
+    assert(n == 11 and not errs)
+    local got = {}
+    while #got < 11 do
+        d = assert(udp:receivemany(16))
+        for i = 1, #d do got[#got+1] = d[i] end
+    end
+    assert(got[1] == list[1] and got[11] == "tail")
+    pass("connected with segmentation: ok")
+    local e = pcall(sender.sendmany, sender, {{}})
+    assert(e == false, tostring(e))
+    pass("invalid input: ok")
+    sender:close()
+    udp:close()
+end
+
+------------------------------------------------------------------------
+function test_address()
+    local udp = socket.udp4()
+    assert(udp:setsockname("127.0.0.1", 0))
+    local ip, port = udp:getsockname()
+    udp:settimeout(1)
+    local addr = assert(socket.address(ip, port))
+    local aip, aport, family = addr:getaddress()
+    assert(aip == ip and aport == tonumber(port) and family == "inet")
+    assert(addr == socket.address(ip, port))
+    assert(not socket.address("localhost", port))
+    pass("creation: ok")
+    local sender = socket.udp()
+    assert(sender:sendto("object", addr))
+    assert(udp:receive() == "object")
+    -- more destinations than cache entries, many times over
+    for i = 1, 3 do
+        for j = 1, 20 do
+            assert(sender:sendto("x", "127.0.0." .. j, 9))
+        end
+        assert(sender:sendto("cached", ip, port))
+        assert(udp:receive() == "cached")
+    end
+    pass("sendto: ok")
+    assert(sender:sendto("packed", ip, port))
+    local d, s = udp:receivemany(1)
+    assert(d[1] == "packed")
+    sender:settimeout(1)
+    assert(udp:sendmany({{"reply", socket.address(s[1])}}) == 1)
+    assert(sender:receive() == "reply")
+    pass("sendmany: ok")
+    sender:close()
+    udp:close()
+end
+
 ------------------------------------------------------------------------
 function test_readafterclose()
     local back, partial, err
@@ -623,10 +1263,13 @@ test("method registration")
 
 local tcp_methods = {
     "accept",
+    "acceptmany",
     "bind",
     "close",
     "connect",
     "dirty",
+    "flush",
+    "getbuffersize",
     "getfamily",
     "getfd",
     "getoption",
@@ -636,9 +1279,15 @@ local tcp_methods = {
     "setstats",
     "listen",
     "receive",
+    "receivechunk",
+    "receiveheaders",
     "send",
+    "sendchunk",
+    "sendv",
+    "setbuffersize",
     "setfd",
     "setoption",
+    "setoutputbuffer",
     "setpeername",
     "setsockname",
     "settimeout",
@@ -660,7 +1309,9 @@ local udp_methods = {
     "getsockname",
     "receive",
     "receivefrom",
+    "receivemany",
     "send",
+    "sendmany",
     "sendto",
     "setfd",
     "setoption",
@@ -685,6 +1336,24 @@ test_partialrecv()
 test("select function")
 test_selectbugs()
 
+test("poller object")
+test_poller()
+
+test("resolver object")
+test_resolver()
+
+test("resolver cache")
+test_dnscache()
+
+test("batched udp receive")
+test_receivemany()
+
+test("batched udp send")
+test_sendmany()
+
+test("address objects")
+test_address()
+
 test("read after close")
 test_readafterclose()
 
@@ -695,6 +1364,7 @@ test("connect function")
 connect_timeout()
 empty_connect()
 connect_errors()
+connect_eyeballs()
 
 test("rebinding: ")
 rebind_test()
@@ -705,10 +1375,14 @@ active_close()
 test("accept function: ")
 accept_timeout()
 accept_errors()
+accept_many()
 
 test("getstats test")
 getstats_test()
 
+test("buffer size")
+test_buffersize()
+
 test("character line")
 test_asciiline(1)
 test_asciiline(17)
@@ -759,6 +1433,33 @@ test_raw(200)
 test_raw(17)
 test_raw(1)
 
+test("framed patterns")
+test_framed()
+
+test("header blocks")
+test_receiveheaders()
+
+test("chunked transfer-coding")
+test_chunked()
+
+test("output buffer")
+test_outputbuffer()
+
+test("splice")
+test_splice()
+
+test("sendfile")
+test_sendfile()
+
+test("monotonic clock")
+test_monotime()
+
+test("vectored transfer")
+test_sendv(3)
+test_sendv(200)
+test_sendv(80199)
+test_sendv(8000000)
+
 test("non-blocking transfer")
 test_nonblocking(1)
 test_nonblocking(17)
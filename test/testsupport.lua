@@ -23,6 +23,36 @@ function compare(input, output)
     else print("ok") end
 end
 
+-- Runs a Lua chunk in another process of the interpreter running this
+-- script, with the given arguments. Returns an object with the read and
+-- close methods of the pipe to its output, or nil and an error message
+-- when no other interpreter can be started
+function spawn(source, ...)
+    local i = -1
+    if not (arg and arg[i] and io.popen) then
+        return nil, "cannot start another interpreter"
+    end
+    while arg[i-1] do i = i - 1 end
+    local name = os.tmpname()
+    local file = assert(io.open(name, "w"))
+    file:write(source)
+    file:close()
+    local command = { table.concat(arg, " ", i, -1), name, ... }
+    local pipe, err = io.popen(table.concat(command, " "))
+    if not pipe then
+        os.remove(name)
+        return nil, err
+    end
+    return {
+        read = function(_, ...) return pipe:read(...) end,
+        close = function()
+            local ok, how, code = pipe:close()
+            os.remove(name)
+            return ok, how, code
+        end
+    }
+end
+
 local G = _G
 local set = rawset
 local warn = print
@@ -32,6 +62,10 @@ local setglobal = function(table, key, value)
     set(table, key, value)
 end
 
-setmetatable(G, {
-    __newindex = setglobal
-})
+-- scripts that define globals of their own load this file with
+-- loadfile("testsupport.lua")("globals") to leave them unguarded
+if ... ~= "globals" then
+    setmetatable(G, {
+        __newindex = setglobal
+    })
+end